@@ -8,18 +8,139 @@
 #include "mmap.h"
 #include "alloc.h"
 
+#if defined(__linux__)
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#endif
+
+#if defined(__linux__) && defined(__x86_64__) && defined(__has_include)
+#if __has_include(<sys/rseq.h>)
+#include <sys/rseq.h>
+#define ALLOC_HAVE_RSEQ 1
+#endif
+#endif
+#ifndef ALLOC_HAVE_RSEQ
+#define ALLOC_HAVE_RSEQ 0
+#endif
+
+// Only the register/unregister opcodes are used, through the raw syscall; no liburing needed
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#define ALLOC_HAVE_IO_URING 1
+#endif
+#endif
+#ifndef ALLOC_HAVE_IO_URING
+#define ALLOC_HAVE_IO_URING 0
+#endif
+
+// USDT probes under the "kvalloc" provider, e.g. bpftrace -e 'usdt:./alloc.so:kvalloc:freelist_miss { @[arg1] = count(); }'.
+// A disabled probe is a single nop; arguments are left wherever the compiler already has them
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define ALLOC_PROBE1(name, a1) STAP_PROBE1(kvalloc, name, a1)
+#define ALLOC_PROBE2(name, a1, a2) STAP_PROBE2(kvalloc, name, a1, a2)
+#define ALLOC_PROBE3(name, a1, a2, a3) STAP_PROBE3(kvalloc, name, a1, a2, a3)
+#endif
+#endif
+
+#if !defined(ALLOC_PROBE1) && defined(__linux__) && defined(__x86_64__)
+// Same .note.stapsdt layout that <sys/sdt.h> emits, for systems without the systemtap headers
+#define ALLOC_PROBE_EMIT(name, args, ...)                                          \
+    __asm__ __volatile__("990: nop\n\t"                                           \
+                         ".pushsection .note.stapsdt, \"?\", \"note\"\n\t"        \
+                         ".balign 4\n\t"                                           \
+                         ".4byte 992f-991f, 994f-993f, 3\n\t"                      \
+                         "991: .asciz \"stapsdt\"\n\t"                             \
+                         "992: .balign 4\n\t"                                      \
+                         "993: .8byte 990b\n\t"                                    \
+                         ".8byte _.stapsdt.base\n\t"                               \
+                         ".8byte 0\n\t"                                            \
+                         ".asciz \"kvalloc\"\n\t"                                  \
+                         ".asciz \"" #name "\"\n\t"                                 \
+                         ".asciz \"" args "\"\n\t"                                  \
+                         "994: .balign 4\n\t"                                      \
+                         ".popsection\n\t"                                         \
+                         ".ifndef _.stapsdt.base\n\t"                              \
+                         ".pushsection .stapsdt.base, \"aG\", \"progbits\", .stapsdt.base, comdat\n\t" \
+                         ".weak _.stapsdt.base\n\t"                                \
+                         ".hidden _.stapsdt.base\n\t"                              \
+                         "_.stapsdt.base: .space 1\n\t"                            \
+                         ".size _.stapsdt.base, 1\n\t"                             \
+                         ".popsection\n\t"                                         \
+                         ".endif\n\t"                                              \
+                         :                                                         \
+                         : __VA_ARGS__)
+#define ALLOC_PROBE1(name, a1) ALLOC_PROBE_EMIT(name, "8@%[arg1]", [arg1] "nor"((uint64_t)(a1)))
+#define ALLOC_PROBE2(name, a1, a2) ALLOC_PROBE_EMIT(name, "8@%[arg1] 8@%[arg2]", [arg1] "nor"((uint64_t)(a1)), [arg2] "nor"((uint64_t)(a2)))
+#define ALLOC_PROBE3(name, a1, a2, a3) ALLOC_PROBE_EMIT(name, "8@%[arg1] 8@%[arg2] 8@%[arg3]", [arg1] "nor"((uint64_t)(a1)), [arg2] "nor"((uint64_t)(a2)), [arg3] "nor"((uint64_t)(a3)))
+#endif
+
+#ifndef ALLOC_PROBE1
+#define ALLOC_PROBE1(name, a1) ((void)(a1))
+#define ALLOC_PROBE2(name, a1, a2) ((void)(a1), (void)(a2))
+#define ALLOC_PROBE3(name, a1, a2, a3) ((void)(a1), (void)(a2), (void)(a3))
+#endif
+
 #define ALIGN_MASK(SZ) ((SZ) - (1UL))
 #define ALIGN_TO_SIZE(X, MASK) ((MASK + X) & ~MASK)
 #define IS_ALIGNED(X, MASK) ((X & ALIGN_MASK(MASK)) == 0)
 
-static struct KV_alloc_pool *alloc_pool[MAX_ALLOCATION_POOLS_NUM] ALLOC_UNUSED;
-static int num_pools;
+// Radix tree from page number to the pool owning the page. Interior nodes are installed with a
+// CAS and never freed, so lookups need no lock
+static void **page_map[PAGE_MAP_LEVEL_SIZE];
+static uint64_t next_pool_id = 1;
+static int ctl_pool_flags = 0; // Added to the flags of every pool created after it is set
+static uint64_t ctl_reclaim_interval_ns = DEFERRED_RECLAIM_INTERVAL_NS;
 static struct KV_alloc_freelist alloc_freelist ALLOC_UNUSED;  // We may implement a global freelist later
 #if ALLOC_DEBUG_STATS
 static struct alloc_stats *stats = NULL;
 #endif
 
+_Static_assert(sizeof(struct KV_pool_header) <= POOL_HEADER_SIZE, "pool header must fit in its page");
+
+// Chunks are kept whole, header included, so they can spill to the shared freelist unchanged
+struct KV_percpu_class
+{
+    uint64_t count;
+    char *slots[PERCPU_CACHE_SLOTS];
+};
+
+struct KV_percpu_cache
+{
+    struct KV_percpu_class classes[MAX_FREELIST_NUM_CLASSES];
+} __attribute__((aligned(64)));
+
+// Live bytes and counts per tag. Each thread updates one shard, so threads rarely share a line
+struct KV_tag_shard
+{
+    int64_t bytes[ALLOC_NUM_TAGS];
+    int64_t count[ALLOC_NUM_TAGS];
+} __attribute__((aligned(64)));
+
+// Readers announce (epoch << 1) | 1 in state while inside a section. Only the owning thread touches the limbo buckets
+struct KV_epoch_record
+{
+    uint64_t state;
+    int nesting;
+    bool in_use; // Owned by a live thread; released records keep their limbo for the next owner
+    char *limbo[EPOCH_NUM_BUCKETS];
+    uint64_t limbo_epoch[EPOCH_NUM_BUCKETS];
+    int retired_since_scan;
+    struct KV_epoch_record *next;
+};
+
 static int KV_get_freelist_alloc_class(size_t size);
+static size_t KV_deferred_drain(struct KV_alloc_pool *pool);
+static void KV_epoch_records_free(struct KV_alloc_pool *pool);
+
+static _Thread_local bool budget_notifying; // Callbacks are running on this thread
+static _Thread_local int tag_shard = -1;
+static int next_tag_shard = 0;
 
 int (*get_alloc_class)(size_t size) = &KV_get_freelist_alloc_class;
 
@@ -44,390 +165,4313 @@ void s_unlock(struct KV_alloc_pool *pool, mtx_t *lock)
 #endif
 }
 
-void alloc_lock(struct KV_alloc_pool *pool, int n)
+#if defined(__linux__)
+static void shared_lock(pthread_mutex_t *lock)
 {
-#ifdef CONCURRENT_ACCESS
-    if (pool->allow_concurrent_allocs)
+    // A process died holding the lock. Its update of the class may be torn, but the pool stays usable
+    if (pthread_mutex_lock(lock) == EOWNERDEAD)
     {
-        mtx_lock(&pool->alloc_freelist->lock[n]);
+        pthread_mutex_consistent(lock);
     }
+}
+#endif
+
+static inline uint64_t KV_now_ns(void)
+{
+    struct timespec ts;
+#if defined(__linux__)
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+#else
+    timespec_get(&ts, TIME_UTC);
 #endif
+    return (uint64_t)ts.tv_sec * 1000000000UL + ts.tv_nsec;
 }
 
-void alloc_unlock(struct KV_alloc_pool *pool, int n)
+static void KV_latency_record(struct KV_alloc_pool *pool, int kind, uint64_t ns)
 {
-#ifdef CONCURRENT_ACCESS
-    if (pool->allow_concurrent_allocs)
+    struct KV_latency_histogram *hist = &pool->latency[kind];
+    int bucket = ns ? 63 - __builtin_clzll(ns) : 0;
+    if (bucket >= LATENCY_HIST_BUCKETS)
+    {
+        bucket = LATENCY_HIST_BUCKETS - 1;
+    }
+
+    __atomic_fetch_add(&hist->count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&hist->total_ns, ns, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&hist->buckets[bucket], 1, __ATOMIC_RELAXED);
+
+    uint64_t max_ns = __atomic_load_n(&hist->max_ns, __ATOMIC_RELAXED);
+    while (ns > max_ns && !__atomic_compare_exchange_n(&hist->max_ns, &max_ns, ns, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
     {
-        mtx_unlock(&pool->alloc_freelist->lock[n]);
     }
-#endif
 }
 
-const char *get_freelist_item(struct KV_alloc_pool *pool, int idx)
+// Histograms can be switched on and off at runtime, so both fields are read atomically
+static inline bool KV_latency_on(struct KV_alloc_pool *pool)
 {
-    return (const char *)pool->alloc_freelist->freelist[idx];
+    return __atomic_load_n(&pool->latency, __ATOMIC_ACQUIRE) != NULL && !__atomic_load_n(&pool->latency_paused, __ATOMIC_RELAXED);
 }
 
-static void *KV_mmap_allocate(size_t size)
+static inline uint64_t KV_latency_start(struct KV_alloc_pool *pool)
 {
-    void *data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_SHARED, -1, 0);
-    if (data == MAP_FAILED)
-    {
-        fprintf(stderr, "mmap_allocate: unable to allocate size=%u: %s\n", (unsigned)size, strerror(errno));
-        return NULL;
-    }
-#if ALLOC_DEBUG_STATS
-    s_lock(pool, &stats->lock);
-    stats->alloc_size += size;
-    s_unlock(pool, &stats->lock);
-#endif
-    return data;
+    return KV_latency_on(pool) ? KV_now_ns() : 0;
 }
 
-static int KV_mmap_deallocate(void *ptr, size_t size)
+static inline void KV_latency_end(struct KV_alloc_pool *pool, int kind, uint64_t start)
 {
-    if (ptr == NULL)
+    if (start != 0 && KV_latency_on(pool))
     {
-        return 0;
+        KV_latency_record(pool, kind, KV_now_ns() - start);
     }
-#if ALLOC_DEBUG_STATS
-    s_lock(pool, &stats->lock);
-    stats->alloc_size -= size;
-    s_unlock(pool, &stats->lock);
-#endif
-    return munmap(ptr, size);
 }
 
-struct KV_alloc_pool *KV_alloc_pool_init(size_t size, bool allow_concurrent_access)
+#if defined(__linux__)
+// Only waits are timed: a lock taken on the first try costs one trylock and no clock reads
+static void KV_alloc_lock_timed(struct KV_alloc_pool *pool, int n)
 {
-    size = ALIGN_TO_SIZE(size, ALIGN_MASK(MIN_ALLOCATION_POOL_SIZE));
-    struct KV_alloc_pool *pool = NULL;
+    uint64_t start;
 
-    if ((num_pools + 1) > MAX_ALLOCATION_POOLS_NUM)
+    if (pool->process_shared)
     {
-        fprintf(stderr, "KV_alloc_pool_init: exceeded memory size= %u\n", (unsigned)size);
-        return NULL;
-    }
+        int ret = pthread_mutex_trylock(&pool->header->shared_lock[n]);
+        if (ret == 0 || ret == EOWNERDEAD)
+        {
+            if (ret == EOWNERDEAD)
+            {
+                pthread_mutex_consistent(&pool->header->shared_lock[n]);
+            }
+            return;
+        }
 
-    pool = malloc(sizeof(struct KV_alloc_pool));
-    if (pool == NULL)
-    {
-        fprintf(stderr, "KV_alloc_pool_init: malloc: unable to allocate size= %u: %s\n", (unsigned)size, strerror(errno));
-        return NULL;
+        ALLOC_PROBE2(lock_contended, pool, n);
+        start = KV_now_ns();
+        shared_lock(&pool->header->shared_lock[n]);
     }
+    else
+    {
+        if (mtx_trylock(&pool->class_lock[n]) == thrd_success)
+        {
+            return;
+        }
 
-    pool->offset = pool->size = 0;
-    pool->data = NULL;
+        ALLOC_PROBE2(lock_contended, pool, n);
+        start = KV_now_ns();
+        mtx_lock(&pool->class_lock[n]);
+    }
+    KV_latency_record(pool, LATENCY_LOCK_WAIT, KV_now_ns() - start);
+}
+#endif
 
-#if ALLOC_DEBUG_STATS
-    pool->stats = malloc(sizeof(struct alloc_stats));
-    if (pool->stats == NULL)
+void alloc_lock(struct KV_alloc_pool *pool, int n)
+{
+#ifdef CONCURRENT_ACCESS
+    if (pool->allow_concurrent_allocs)
     {
-        fprintf(stderr, "KV_alloc_pool_init: unable to allocate stats");
-        return NULL;
+#if defined(__linux__)
+        if (KV_latency_on(pool))
+        {
+            KV_alloc_lock_timed(pool, n);
+            return;
+        }
+
+        if (pool->process_shared)
+        {
+            shared_lock(&pool->header->shared_lock[n]);
+            return;
+        }
+#endif
+        mtx_lock(&pool->class_lock[n]);
     }
-    memset(pool->stats, 0, sizeof(struct alloc_stats));
-    stats = pool->stats;
-    mtx_init(&pool->stats->lock, mtx_plain);
 #endif
+}
 
-    pool->data = KV_mmap_allocate(size);
-    if (pool->data == NULL)
+void alloc_unlock(struct KV_alloc_pool *pool, int n)
+{
+#ifdef CONCURRENT_ACCESS
+    if (pool->allow_concurrent_allocs)
     {
-        fprintf(stderr, "KV_alloc_pool_init: mmap_allocate: unable to allocate size=%u: %s\n", (unsigned)size, strerror(errno));
-        return NULL;
+#if defined(__linux__)
+        if (pool->process_shared)
+        {
+            pthread_mutex_unlock(&pool->header->shared_lock[n]);
+            return;
+        }
+#endif
+        mtx_unlock(&pool->class_lock[n]);
     }
+#endif
+}
 
-    pool->size += size;
 
-    pool->alloc_freelist = malloc(sizeof(struct KV_alloc_freelist));
-    if (pool->alloc_freelist == NULL)
+static void *KV_page_map_node(void **slot)
+{
+    void *node = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+    if (node)
     {
-        fprintf(stderr, "KV_alloc_pool_init: unable to allocate local freelist array");
-        return NULL;
+        return node;
     }
 
-    for (size_t i = 0; i < MAX_FREELIST_NUM_CLASSES; i++)
+    void *new_node = calloc(PAGE_MAP_LEVEL_SIZE, sizeof(void *));
+    if (new_node == NULL)
     {
-        pool->alloc_freelist->freelist[i] = NULL;
-        mtx_init(&pool->alloc_freelist->lock[i], mtx_plain);
+        fprintf(stderr, "KV_page_map_node: unable to allocate page map node: %s\n", strerror(errno));
+        return NULL;
     }
-    pool->allow_concurrent_allocs = allow_concurrent_access;
 
-    return (struct KV_alloc_pool *)pool;
+    if (!__atomic_compare_exchange_n(slot, &node, new_node, 0, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE))
+    {
+        free(new_node); // Lost the race; node now holds the winner
+        return node;
+    }
+    return new_node;
 }
 
-void KV_alloc_pool_free(struct KV_alloc_pool *pool)
+// Point every page of [start, start + size) at pool; NULL clears the range without allocating nodes, so it
+// also undoes a set that failed halfway
+static int KV_page_map_set(const void *start, size_t size, struct KV_alloc_pool *pool)
 {
-    if (pool != NULL)
+    uintptr_t first = (uintptr_t)start >> PAGE_MAP_PAGE_SHIFT;
+    uintptr_t last = ((uintptr_t)start + size - 1) >> PAGE_MAP_PAGE_SHIFT;
+
+    if ((last >> (PAGE_MAP_LEVEL_BITS * 3)) != 0)
+    {
+        fprintf(stderr, "KV_page_map_set: address %p is outside the page map\n", start);
+        return -1;
+    }
+
+    for (uintptr_t page = first; page <= last; page++)
     {
-        if (KV_mmap_deallocate(pool->data, pool->size) == -1)
+        void **mid_slot = (void **)&page_map[page >> (PAGE_MAP_LEVEL_BITS * 2)];
+        void ***mid = pool ? KV_page_map_node(mid_slot) : __atomic_load_n(mid_slot, __ATOMIC_ACQUIRE);
+        if (mid == NULL)
         {
-            perror("mmap_deallocate");
+            if (pool == NULL)
+            {
+                continue;
+            }
+            return -1;
         }
-#if ALLOC_DEBUG_STATS
-        printf("Deallocating size=%zu\n", stats->alloc_size);
-        printf("Freelist: Hits=%i, Misses=%i, Size=%zu\n", stats->fr_hits, stats->fr_misses, stats->fr_alloc_size);
-        printf("Small Allocs: Num allocated=%i, Total Size=%zu, Num In Use=%i, In use Size=%zu\n", stats->num_allocs, stats->alloc_size, stats->num_allocs_in_use, stats->allocs_in_use_size);
-        printf("Large Allocs: Num allocated=%i, Size=%zu\n", stats->num_large_allocs, stats->large_allocs_size);
-        mtx_destroy(&pool->stats->lock);
-        free(pool->stats);
-#endif
-        for (size_t i = 0; i < MAX_FREELIST_NUM_CLASSES; i++)
+
+        void **leaf_slot = (void **)&mid[(page >> PAGE_MAP_LEVEL_BITS) & (PAGE_MAP_LEVEL_SIZE - 1)];
+        struct KV_alloc_pool **leaf = pool ? KV_page_map_node(leaf_slot) : __atomic_load_n(leaf_slot, __ATOMIC_ACQUIRE);
+        if (leaf == NULL)
         {
-            mtx_destroy(&pool->alloc_freelist->lock[i]);
+            if (pool == NULL)
+            {
+                continue;
+            }
+            return -1;
         }
-
-        free(pool);
+        __atomic_store_n(&leaf[page & (PAGE_MAP_LEVEL_SIZE - 1)], pool, __ATOMIC_RELEASE);
     }
+    return 0;
 }
 
-static int KV_get_freelist_alloc_class(size_t size)
+struct KV_alloc_pool *KV_pool_of(const void *ptr)
 {
-    size = ALIGN_TO_SIZE(size, ALIGN_MASK(ALLOCATION_CLASSES_INCR_SIZE));
-    if (size < MIN_ALLOCATION_CLASS_SIZE + (ALLOCATION_CLASSES_INCR_SIZE * MAX_FREELIST_NUM_CLASSES))
+    uintptr_t page = (uintptr_t)ptr >> PAGE_MAP_PAGE_SHIFT;
+
+    if ((page >> (PAGE_MAP_LEVEL_BITS * 3)) != 0)
     {
-        return (size - MIN_ALLOCATION_CLASS_SIZE) / ALLOCATION_CLASSES_INCR_SIZE;
+        return NULL;
+    }
+
+    void ***mid = (void ***)__atomic_load_n(&page_map[page >> (PAGE_MAP_LEVEL_BITS * 2)], __ATOMIC_ACQUIRE);
+    if (mid == NULL)
+    {
+        return NULL;
+    }
+
+    struct KV_alloc_pool **leaf = (struct KV_alloc_pool **)__atomic_load_n(&mid[(page >> PAGE_MAP_LEVEL_BITS) & (PAGE_MAP_LEVEL_SIZE - 1)], __ATOMIC_ACQUIRE);
+    if (leaf == NULL)
+    {
+        return NULL;
     }
+    return __atomic_load_n(&leaf[page & (PAGE_MAP_LEVEL_SIZE - 1)], __ATOMIC_ACQUIRE);
+}
+
+#if ALLOC_HAVE_RSEQ
+static inline struct rseq *KV_rseq_area(void)
+{
+    return (struct rseq *)((char *)__builtin_thread_pointer() + __rseq_offset);
+}
+
+// Both sequences commit with their final store of count. If the thread is preempted, migrated or
+// signalled in between, the kernel restarts it at the abort handler and nothing was published.
+// Returns 0 on success, 1 if the class is empty (pop) or full (push), -1 if the sequence aborted
+static inline int KV_rseq_pop(struct rseq *rs, uint32_t cpu, struct KV_percpu_class *cls, char **out)
+{
+    __asm__ __volatile__ goto(
+        ".pushsection __rseq_cs, \"aw\"\n\t"
+        ".balign 32\n\t"
+        "3:\n\t"
+        ".long 0, 0\n\t"
+        ".quad 1f, (2f - 1f), 4f\n\t"
+        ".popsection\n\t"
+        "leaq 3b(%%rip), %%rax\n\t"
+        "movq %%rax, %[rseq_cs]\n\t"
+        "1:\n\t"
+        "cmpl %[cpu], %[cpu_id]\n\t"
+        "jnz %l[aborted]\n\t"
+        "movq %[count], %%rax\n\t"
+        "testq %%rax, %%rax\n\t"
+        "jz %l[empty]\n\t"
+        "movq -8(%[slots], %%rax, 8), %%rcx\n\t"
+        "movq %%rcx, (%[out])\n\t"
+        "decq %%rax\n\t"
+        "movq %%rax, %[count]\n\t"
+        "2:\n\t"
+        ".pushsection __rseq_failure, \"ax\"\n\t"
+        ".byte 0x0f, 0xb9, 0x3d\n\t"
+        ".long 0x53053053\n\t" // RSEQ_SIG registered by glibc
+        "4:\n\t"
+        "jmp %l[aborted]\n\t"
+        ".popsection\n\t"
+        :
+        : [cpu_id] "m"(rs->cpu_id), [rseq_cs] "m"(rs->rseq_cs), [cpu] "r"(cpu),
+          [count] "m"(cls->count), [slots] "r"(cls->slots), [out] "r"(out)
+        : "memory", "cc", "rax", "rcx"
+        : aborted, empty);
+    return 0;
+aborted:
     return -1;
+empty:
+    return 1;
 }
 
-static ALLOC_UNUSED void *KV_remove_from_freelist_head(struct KV_alloc_pool *pool, size_t size)
+static inline int KV_rseq_push(struct rseq *rs, uint32_t cpu, struct KV_percpu_class *cls, char *chunk)
 {
-    assert(IS_ALIGNED(size, ALLOCATION_CLASSES_INCR_SIZE));
-    struct KV_alloc_freelist *alloc_freelist = pool->alloc_freelist;
+    __asm__ __volatile__ goto(
+        ".pushsection __rseq_cs, \"aw\"\n\t"
+        ".balign 32\n\t"
+        "3:\n\t"
+        ".long 0, 0\n\t"
+        ".quad 1f, (2f - 1f), 4f\n\t"
+        ".popsection\n\t"
+        "leaq 3b(%%rip), %%rax\n\t"
+        "movq %%rax, %[rseq_cs]\n\t"
+        "1:\n\t"
+        "cmpl %[cpu], %[cpu_id]\n\t"
+        "jnz %l[aborted]\n\t"
+        "movq %[count], %%rax\n\t"
+        "cmpq %[slots_num], %%rax\n\t"
+        "jae %l[full]\n\t"
+        "movq %[chunk], (%[slots], %%rax, 8)\n\t"
+        "incq %%rax\n\t"
+        "movq %%rax, %[count]\n\t"
+        "2:\n\t"
+        ".pushsection __rseq_failure, \"ax\"\n\t"
+        ".byte 0x0f, 0xb9, 0x3d\n\t"
+        ".long 0x53053053\n\t"
+        "4:\n\t"
+        "jmp %l[aborted]\n\t"
+        ".popsection\n\t"
+        :
+        : [cpu_id] "m"(rs->cpu_id), [rseq_cs] "m"(rs->rseq_cs), [cpu] "r"(cpu),
+          [count] "m"(cls->count), [slots] "r"(cls->slots), [chunk] "r"(chunk),
+          [slots_num] "i"(PERCPU_CACHE_SLOTS)
+        : "memory", "cc", "rax"
+        : aborted, full);
+    return 0;
+aborted:
+    return -1;
+full:
+    return 1;
+}
 
-    char *next_alloc = NULL;
-    int alloc_class = KV_get_freelist_alloc_class(size);
-    assert(alloc_class >= 0 && alloc_class < MAX_FREELIST_NUM_CLASSES);
+// The current CPU for indexing, or -1 when this thread has no rseq area
+static inline int KV_rseq_cpu(struct KV_alloc_pool *pool, struct rseq *rs)
+{
+    int32_t cpu = (int32_t)__atomic_load_n(&rs->cpu_id, __ATOMIC_RELAXED);
+    return (cpu < 0 || cpu >= pool->num_cpus) ? -1 : cpu;
+}
+#endif
 
-    alloc_lock(pool, alloc_class);
-    char *alloc_class_head = alloc_freelist->freelist[alloc_class];
+static void KV_percpu_init(struct KV_alloc_pool *pool)
+{
+#if ALLOC_HAVE_RSEQ
+    long num_cpus = sysconf(_SC_NPROCESSORS_CONF);
+    if (__rseq_size == 0 || num_cpus <= 0)
+    {
+        return; // glibc did not register rseq; stay on the class locks
+    }
 
-    // TODO: Implement best fit strategy
-    if (!alloc_class_head)
+    size_t size = num_cpus * sizeof(struct KV_percpu_cache);
+    pool->percpu = aligned_alloc(_Alignof(struct KV_percpu_cache), size);
+    if (pool->percpu == NULL)
     {
-        alloc_unlock(pool, alloc_class);
-#if ALLOC_DEBUG_STATS
-        s_lock(pool, &stats->lock);
-        stats->fr_misses += 1;
-        s_unlock(pool, &stats->lock);
-#endif
-        return NULL;
+        fprintf(stderr, "KV_percpu_init: unable to allocate per-CPU caches: %s\n", strerror(errno));
+        return;
     }
+    memset(pool->percpu, 0, size);
+    pool->num_cpus = num_cpus;
+#endif
+}
 
-    if (size <= MAX_ALLOCATION_OVERHEAD)
+static char *KV_percpu_pop(struct KV_alloc_pool *pool ALLOC_UNUSED, size_t size ALLOC_UNUSED)
+{
+#if ALLOC_HAVE_RSEQ
+    if (pool->percpu == NULL)
     {
-        next_alloc = *(char **)(alloc_class_head + 8);
-        alloc_freelist->freelist[alloc_class] = next_alloc;
+        return NULL;
     }
-    else
+
+    struct rseq *rs = KV_rseq_area();
+    int alloc_class = KV_get_freelist_alloc_class(size);
+    char *alloc = NULL;
+
+    for (int i = 0; i < PERCPU_RSEQ_RETRIES; i++)
     {
-        assert(*(char **)(alloc_class_head + 8) == NULL); // Ensure we have the head
+        int cpu = KV_rseq_cpu(pool, rs);
+        if (cpu < 0)
+        {
+            return NULL;
+        }
 
-        // Replace head with next alloc chunk
-        next_alloc = *(char **)(alloc_class_head + 16);
-        if (next_alloc)
+        int ret = KV_rseq_pop(rs, cpu, &pool->percpu[cpu].classes[alloc_class], &alloc);
+        if (ret >= 0)
         {
-            *(char **)(next_alloc + 8) = NULL; // Previous chunk
+            return ret == 0 ? alloc : NULL;
         }
-        alloc_freelist->freelist[alloc_class] = next_alloc;
     }
-    alloc_unlock(pool, alloc_class);
-
-#if ALLOC_DEBUG_STATS
-    s_lock(pool, &stats->lock);
-    stats->fr_hits += 1;
-    stats->fr_alloc_size -= size;
-    s_unlock(pool, &stats->lock);
 #endif
-
-    return alloc_class_head;
+    return NULL;
 }
 
-static ALLOC_UNUSED void KV_add_to_freelist(struct KV_alloc_pool *pool, char *alloc_start, size_t size)
+// Returns false when the chunk has to go to the shared freelist instead
+static bool KV_percpu_push(struct KV_alloc_pool *pool ALLOC_UNUSED, char *alloc_start ALLOC_UNUSED, size_t size ALLOC_UNUSED)
 {
-    struct KV_alloc_freelist *alloc_freelist = pool->alloc_freelist;
-    char *alloc_class_head = NULL; // First chunk from freelist class
-    int alloc_class = KV_get_freelist_alloc_class(size);
-    assert(alloc_class >= 0 && alloc_class < MAX_FREELIST_NUM_CLASSES);
+#if ALLOC_HAVE_RSEQ
+    if (pool->percpu == NULL)
+    {
+        return false;
+    }
 
-    alloc_lock(pool, alloc_class);
-    alloc_class_head = alloc_freelist->freelist[alloc_class];
+    struct rseq *rs = KV_rseq_area();
+    int alloc_class = KV_get_freelist_alloc_class(size);
 
-    if (size <= MAX_ALLOCATION_OVERHEAD)
+    for (int i = 0; i < PERCPU_RSEQ_RETRIES; i++)
     {
-        if (!alloc_class_head) // Empty
+        int cpu = KV_rseq_cpu(pool, rs);
+        if (cpu < 0)
         {
-            alloc_freelist->freelist[alloc_class] = alloc_start;
-            *(char **)(alloc_start + 8) = NULL; // Next
+            return false;
         }
-        else
-        {
-            alloc_freelist->freelist[alloc_class] = alloc_start;
-            *(char **)(alloc_start + 8) = alloc_class_head; // New head next chunk
 
-            assert(*(char **)(alloc_start + 8) != NULL);
-        }
-    }
-    else
-    {
-        if (!alloc_class_head) // Empty
+        int ret = KV_rseq_push(rs, cpu, &pool->percpu[cpu].classes[alloc_class], alloc_start);
+        if (ret >= 0)
         {
-            alloc_freelist->freelist[alloc_class] = alloc_start;
-            *(char **)(alloc_start + 8) = NULL;
-            *(char **)(alloc_start + 16) = NULL;
+            return ret == 0;
         }
-        else
-        {
-            assert(*(char **)(alloc_class_head + 8) == NULL);
-
-            alloc_freelist->freelist[alloc_class] = alloc_start;
-            *(char **)(alloc_start + 8) = NULL;              // New head previous chunk
-            *(char **)(alloc_start + 16) = alloc_class_head; // New head next chunk
-            *(char **)(alloc_class_head + 8) = alloc_start;  // Old head previous chunk
+    }
+#endif
+    return false;
+}
 
-            assert(*(char **)(alloc_start + 16) != NULL);
-            assert(*(char **)(alloc_class_head + 8) != NULL);
-        }
+static int KV_mmap_flags(struct KV_alloc_pool *pool)
+{
+#if defined(__linux__)
+    if (pool->flags & ALLOC_POOL_PRIVATE)
+    {
+        return MAP_ANONYMOUS | MAP_PRIVATE;
     }
+#endif
+    return MAP_ANONYMOUS | MAP_SHARED;
+}
 
-    alloc_unlock(pool, alloc_class);
+static void *KV_mmap_allocate(size_t size, int flags)
+{
+    void *data = mmap(NULL, size, PROT_READ | PROT_WRITE, flags, -1, 0);
+    if (data == MAP_FAILED)
+    {
+        fprintf(stderr, "mmap_allocate: unable to allocate size=%u: %s\n", (unsigned)size, strerror(errno));
+        return NULL;
+    }
+#if ALLOC_DEBUG_STATS
+    s_lock(pool, &stats->lock);
+    stats->alloc_size += size;
+    s_unlock(pool, &stats->lock);
+#endif
+    return data;
+}
 
+static int KV_mmap_deallocate(void *ptr, size_t size)
+{
+    if (ptr == NULL)
+    {
+        return 0;
+    }
 #if ALLOC_DEBUG_STATS
     s_lock(pool, &stats->lock);
-    stats->fr_alloc_size += size;
+    stats->alloc_size -= size;
     s_unlock(pool, &stats->lock);
 #endif
+    return munmap(ptr, size);
 }
 
-void *KV_malloc(struct KV_alloc_pool *pool, size_t size)
+#if defined(__linux__)
+static struct KV_alloc_pool *pool_list = NULL; // Every live pool, walked by the fork handlers
+static mtx_t pool_list_lock;
+static once_flag pool_list_once = ONCE_FLAG_INIT;
+
+struct KV_thread_cache_entry
 {
-    char *alloc = NULL;
-    uint64_t offset; // Local offset; We assume no share between concurrent threads
+    struct KV_alloc_pool *pool;
+    uint64_t pool_id;
+    char *bump; // Unused part of the chunk this thread claimed from the pool offset
+    char *bump_end;
+    char *deferred; // Batch of KV_free_deferred chunks not yet published to the pool
+    char *deferred_tail;
+    int deferred_count;
+    struct KV_epoch_record *epoch_record;
+    int64_t budget_delta; // Charged or credited here but not yet folded into the pool usage
+};
 
-    if (size <= (MIN_ALLOCATION_CLASS_SIZE - ALLOCATION_SIZE_OVERHEAD))
+struct KV_thread_cache
+{
+    struct KV_thread_cache_entry entries[THREAD_CACHE_NUM_POOLS];
+    int next_victim;
+    bool registered; // Destructor armed for this thread
+};
+
+static _Thread_local struct KV_thread_cache thread_cache;
+static tss_t thread_cache_key;
+
+static void KV_thread_cache_release(void *arg);
+
+// Hold every process-private lock across fork() so the child never inherits one mid-update.
+// Pools with a header are skipped: their freelists stay in a MAP_SHARED mapping that parent and child
+// would both update, so they are no snapshot and the child must not use them
+static void KV_fork_prepare(void)
+{
+    mtx_lock(&pool_list_lock);
+    for (struct KV_alloc_pool *pool = pool_list; pool; pool = pool->next)
+    {
+        if (pool->header != NULL)
+        {
+            continue;
+        }
+
+        // Outermost first: an object pool refills through KV_malloc under its lock, and buddy_lock is held
+        // while the buddy tier carves leftovers into the class freelists
+        for (struct KV_object_pool *opool = pool->object_pools; opool; opool = opool->next)
+        {
+            mtx_lock(&opool->lock);
+        }
+        mtx_lock(&pool->buddy_lock);
+        for (int i = 0; i < MAX_FREELIST_NUM_CLASSES; i++)
+        {
+            mtx_lock(&pool->class_lock[i]);
+        }
+        if (pool->io_free)
+        {
+            mtx_lock(&pool->io_lock);
+        }
+    }
+}
+
+static void KV_fork_parent(void)
+{
+    for (struct KV_alloc_pool *pool = pool_list; pool; pool = pool->next)
+    {
+        if (pool->header != NULL)
+        {
+            continue;
+        }
+
+        if (pool->io_free)
+        {
+            mtx_unlock(&pool->io_lock);
+        }
+        for (int i = MAX_FREELIST_NUM_CLASSES - 1; i >= 0; i--)
+        {
+            mtx_unlock(&pool->class_lock[i]);
+        }
+        mtx_unlock(&pool->buddy_lock);
+        for (struct KV_object_pool *opool = pool->object_pools; opool; opool = opool->next)
+        {
+            mtx_unlock(&opool->lock);
+        }
+    }
+    mtx_unlock(&pool_list_lock);
+}
+
+// Only the forking thread exists in the child; start it off with fresh locks
+static void KV_fork_child(void)
+{
+    for (struct KV_alloc_pool *pool = pool_list; pool; pool = pool->next)
+    {
+        if (pool->header != NULL)
+        {
+            continue;
+        }
+
+        for (int i = 0; i < MAX_FREELIST_NUM_CLASSES; i++)
+        {
+            mtx_init(&pool->class_lock[i], mtx_plain);
+        }
+        mtx_init(&pool->buddy_lock, mtx_plain);
+        if (pool->io_free)
+        {
+            mtx_init(&pool->io_lock, mtx_plain);
+        }
+        for (struct KV_object_pool *opool = pool->object_pools; opool; opool = opool->next)
+        {
+            mtx_init(&opool->lock, mtx_plain);
+        }
+
+        // The reclaimer thread was not copied; deferred chunks are drained by the slow path instead
+        pool->background_running = false;
+
+        // Readers on other threads are gone and would hold the epoch back forever. Their limbo stays with the record
+        for (struct KV_epoch_record *record = pool->epoch_records; record; record = record->next)
+        {
+            bool owned = false;
+            for (int i = 0; i < THREAD_CACHE_NUM_POOLS; i++)
+            {
+                owned |= thread_cache.entries[i].epoch_record == record;
+            }
+
+            if (!owned)
+            {
+                record->state = 0;
+                record->nesting = 0;
+                record->in_use = false;
+            }
+        }
+    }
+    mtx_init(&pool_list_lock, mtx_plain);
+}
+
+static void KV_pool_list_init(void)
+{
+    mtx_init(&pool_list_lock, mtx_plain);
+    tss_create(&thread_cache_key, KV_thread_cache_release);
+    pthread_atfork(KV_fork_prepare, KV_fork_parent, KV_fork_child);
+}
+
+// Caller holds pool_list_lock
+static bool KV_pool_alive(struct KV_alloc_pool *pool, uint64_t id)
+{
+    for (struct KV_alloc_pool *curr = pool_list; curr; curr = curr->next)
+    {
+        if (curr == pool && curr->id == id)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void KV_pool_register(struct KV_alloc_pool *pool)
+{
+    call_once(&pool_list_once, KV_pool_list_init);
+
+    mtx_lock(&pool_list_lock);
+    pool->prev = NULL;
+    pool->next = pool_list;
+    if (pool_list)
+    {
+        pool_list->prev = pool;
+    }
+    pool_list = pool;
+    mtx_unlock(&pool_list_lock);
+}
+
+static void KV_pool_unregister(struct KV_alloc_pool *pool)
+{
+    mtx_lock(&pool_list_lock);
+    if (pool->prev)
     {
-        size = MIN_ALLOCATION_CLASS_SIZE;
+        pool->prev->next = pool->next;
     }
     else
     {
-        size = ALIGN_TO_SIZE(size + ALLOCATION_SIZE_OVERHEAD, ALIGN_MASK(ALLOCATION_CLASSES_INCR_SIZE));
+        pool_list = pool->next;
     }
 
-    if (size > MIN_ALLOCATION_CLASS_SIZE + (ALLOCATION_CLASSES_INCR_SIZE * MAX_FREELIST_NUM_CLASSES))
+    if (pool->next)
     {
-        alloc = KV_mmap_allocate(size);
-        if (alloc == NULL)
+        pool->next->prev = pool->prev;
+    }
+    pool->prev = pool->next = NULL;
+    mtx_unlock(&pool_list_lock);
+}
+
+static void KV_object_pool_register(struct KV_object_pool *opool)
+{
+    mtx_lock(&pool_list_lock);
+    opool->next = opool->parent->object_pools;
+    opool->parent->object_pools = opool;
+    mtx_unlock(&pool_list_lock);
+}
+
+static void KV_object_pool_unregister(struct KV_object_pool *opool)
+{
+    mtx_lock(&pool_list_lock);
+    for (struct KV_object_pool **curr = &opool->parent->object_pools; *curr; curr = &(*curr)->next)
+    {
+        if (*curr == opool)
         {
-            fprintf(stderr, "KV_malloc: mmap_allocate: unable to allocate size= %u: %s\n", (unsigned)size, strerror(errno));
-            return NULL;
+            *curr = opool->next;
+            break;
         }
-        *(uint64_t *)alloc = size;
-#if ALLOC_DEBUG_STATS
-        s_lock(pool, &stats->lock);
-        stats->large_allocs_size += size;
-        stats->num_large_allocs += 1;
-        s_unlock(pool, &stats->lock);
+    }
+    mtx_unlock(&pool_list_lock);
+}
+#else
+static void KV_pool_register(struct KV_alloc_pool *pool ALLOC_UNUSED) {}
+static void KV_pool_unregister(struct KV_alloc_pool *pool ALLOC_UNUSED) {}
+static void KV_object_pool_register(struct KV_object_pool *opool ALLOC_UNUSED) {}
+static void KV_object_pool_unregister(struct KV_object_pool *opool ALLOC_UNUSED) {}
 #endif
-        return (void *)(alloc + ALLOCATION_SIZE_OVERHEAD);
+
+// Every field but the locks, which child pools never take
+static void KV_pool_setup(struct KV_alloc_pool *pool, bool allow_concurrent_access)
+{
+    pool->offset = pool->size = 0;
+    pool->flags = 0;
+    pool->inline_fast_path = false;
+    pool->id = __atomic_fetch_add(&next_pool_id, 1, __ATOMIC_RELAXED);
+    pool->data = NULL;
+    pool->header = NULL;
+    pool->process_shared = false;
+    pool->alloc_freelist = NULL;
+    pool->num_large_allocs = pool->large_allocs_size = 0;
+    pool->object_pools = NULL;
+    pool->deferred = NULL;
+    pool->budget_soft = pool->budget_hard = 0;
+    pool->budget_batch = BUDGET_ACCOUNTING_BATCH;
+    pool->budget_usage = 0;
+    pool->budget_pressure = false;
+    pool->num_budget_callbacks = 0;
+    pool->epoch = 0;
+    pool->epoch_records = NULL;
+    for (int i = 0; i < BUDDY_NUM_ORDERS; i++)
+    {
+        pool->buddy_free[i] = NULL;
+        pool->buddy_count[i] = 0;
+    }
+    pool->buddy_map = NULL;
+    pool->io_buffer_size = 0;
+    pool->io_num_buffers = pool->io_num_free = 0;
+    pool->io_free = NULL;
+    pool->io_in_use = NULL;
+    pool->io_ring_fd = -1;
+    pool->compact_used = NULL;
+    pool->compact_state = NULL;
+    pool->compact_relocate = NULL;
+    pool->compact_arg = NULL;
+    pool->compacting = false;
+#if defined(__linux__)
+    pool->prefault_ahead = false;
+    pool->prefaulted = 0;
+    pool->background_running = false;
+#endif
+    pool->percpu = NULL;
+    pool->num_cpus = 0;
+    pool->latency = NULL;
+    pool->latency_paused = false;
+    pool->tags = NULL;
+    pool->near_map = NULL;
+    pool->parent = NULL;
+    pool->parent_block_size = 0;
+    pool->prev = pool->next = NULL;
+    pool->stats = NULL;
+    pool->allow_concurrent_allocs = allow_concurrent_access;
+}
+
+static struct KV_alloc_pool *KV_pool_create(bool allow_concurrent_access)
+{
+    struct KV_alloc_pool *pool = malloc(sizeof(struct KV_alloc_pool));
+    if (pool == NULL)
+    {
+        fprintf(stderr, "KV_pool_create: malloc: unable to allocate pool: %s\n", strerror(errno));
+        return NULL;
     }
 
-    alloc = KV_remove_from_freelist_head(pool, size);
-    if (alloc)
+    KV_pool_setup(pool, allow_concurrent_access);
+    mtx_init(&pool->buddy_lock, mtx_plain);
+    for (size_t i = 0; i < MAX_FREELIST_NUM_CLASSES; i++)
     {
+        mtx_init(&pool->class_lock[i], mtx_plain);
+    }
+
 #if ALLOC_DEBUG_STATS
-        s_lock(pool, &stats->lock);
-        stats->num_allocs_in_use += 1;
-        stats->allocs_in_use_size += size;
-        s_unlock(pool, &stats->lock);
+    pool->stats = malloc(sizeof(struct alloc_stats));
+    if (pool->stats == NULL)
+    {
+        fprintf(stderr, "KV_alloc_pool_init: unable to allocate stats");
+        return NULL;
+    }
+    memset(pool->stats, 0, sizeof(struct alloc_stats));
+    stats = pool->stats;
+    mtx_init(&pool->stats->lock, mtx_plain);
 #endif
-        return (void *)(alloc + ALLOCATION_SIZE_OVERHEAD);
+
+    return pool;
+}
+
+// Anything that needs a lock, link encoding or bookkeeping on every chunk keeps callers on the library path
+static void KV_pool_update_inline(struct KV_alloc_pool *pool)
+{
+    pool->inline_fast_path = !ALLOC_DEBUG_STATS && !pool->allow_concurrent_allocs && pool->header == NULL &&
+                             pool->percpu == NULL && pool->latency == NULL && pool->io_free == NULL &&
+                             pool->compact_used == NULL && pool->near_map == NULL &&
+                             pool->budget_soft == 0 && pool->budget_hard == 0;
+}
+
+static inline uint64_t *KV_pool_offset(struct KV_alloc_pool *pool)
+{
+    return pool->header ? &pool->header->offset : &pool->offset;
+}
+
+// Pools with a header (file or shared memory) keep freelist links relative to data; everything else uses plain pointers
+static inline char *KV_link_decode(struct KV_alloc_pool *pool, char *link)
+{
+    if (pool->header == NULL || link == NULL)
+    {
+        return link;
     }
+    return pool->data + ((uintptr_t)link - 1);
+}
 
-    if (!pool)
+static inline char *KV_link_encode(struct KV_alloc_pool *pool, char *ptr)
+{
+    if (pool->header == NULL || ptr == NULL)
+    {
+        return ptr;
+    }
+    return (char *)(uintptr_t)(ptr - pool->data + 1);
+}
+
+const char *get_freelist_item(struct KV_alloc_pool *pool, int idx)
+{
+    if (idx < 0 || idx >= MAX_FREELIST_NUM_CLASSES)
     {
-        fprintf(stderr, "KV_malloc: invalid memory pool");
         return NULL;
     }
+    return (const char *)KV_link_decode(pool, pool->alloc_freelist->freelist[idx]);
+}
 
-    if (!pool->data)
+struct KV_alloc_pool *KV_alloc_pool_init(size_t size, bool allow_concurrent_access)
+{
+    return KV_alloc_pool_init_flags(size, allow_concurrent_access, 0);
+}
+
+struct KV_alloc_pool *KV_alloc_pool_init_flags(size_t size, bool allow_concurrent_access, int flags)
+{
+    size = ALIGN_TO_SIZE(size, ALIGN_MASK(MIN_ALLOCATION_POOL_SIZE));
+    struct KV_alloc_pool *pool = NULL;
+
+    pool = KV_pool_create(allow_concurrent_access);
+    if (pool == NULL)
     {
-        fprintf(stderr, "KV_malloc: invalid memory address");
         return NULL;
     }
-    offset = pool->offset;
 
-    if ((offset + size) > pool->size)
+    flags |= __atomic_load_n(&ctl_pool_flags, __ATOMIC_RELAXED);
+    pool->flags = flags;
+#if defined(__linux__)
+    // Faults are taken here, once, instead of on the first pass over the pool
+    pool->data = KV_mmap_allocate(size, KV_mmap_flags(pool) | ((flags & ALLOC_POOL_PREFAULT) ? MAP_POPULATE : 0));
+#else
+    pool->data = KV_mmap_allocate(size, KV_mmap_flags(pool));
+#endif
+    if (pool->data == NULL)
     {
-        fprintf(stderr, "memory limit of current pool exceeded for size=%u\n", (unsigned)size);
+        fprintf(stderr, "KV_alloc_pool_init: mmap_allocate: unable to allocate size=%u: %s\n", (unsigned)size, strerror(errno));
         return NULL;
     }
 
-#ifdef CONCURRENT_ACCESS
-    if (pool->allow_concurrent_allocs)
+    pool->size += size;
+
+    pool->alloc_freelist = malloc(sizeof(struct KV_alloc_freelist));
+    if (pool->alloc_freelist == NULL)
     {
-        while (1)
+        fprintf(stderr, "KV_alloc_pool_init: unable to allocate local freelist array");
+        return NULL;
+    }
+    memset(pool->alloc_freelist, 0, sizeof(struct KV_alloc_freelist));
+
+    if (flags & ALLOC_POOL_COMPACTABLE)
+    {
+        pool->compact_used = calloc(size / COMPACT_REGION_SIZE, sizeof(uint32_t));
+        pool->compact_state = calloc(size / COMPACT_REGION_SIZE, sizeof(uint8_t));
+        if (pool->compact_used == NULL || pool->compact_state == NULL)
         {
-            if (__atomic_compare_exchange_n(&pool->offset, &offset, offset + size, 0, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE))
-            {
-                if (pool->offset > pool->size)
-                {
-                    pool->offset -= size;
-                    fprintf(stderr, "memory limit exceeded for size=%u\n", (unsigned)size);
-                    return NULL;
-                }
-                break;
-            }
+            fprintf(stderr, "KV_alloc_pool_init: unable to allocate compaction regions: %s\n", strerror(errno));
+            free(pool->compact_used);
+            free(pool->compact_state);
+            pool->compact_used = NULL;
+            pool->compact_state = NULL;
         }
+    }
 
-        alloc = pool->data + offset;
+    // Chunks parked in a per-CPU cache look live to compaction but cannot be taken back from another CPU
+    if ((flags & ALLOC_POOL_PERCPU) && pool->compact_used != NULL)
+    {
+        fprintf(stderr, "KV_alloc_pool_init: per-CPU caches are not used by a compactable pool\n");
     }
-    else
+    else if (flags & ALLOC_POOL_PERCPU)
     {
-        pool->offset += size;
-        alloc = pool->data + offset;
+        KV_percpu_init(pool);
+    }
+
+    if (flags & ALLOC_POOL_NEAR)
+    {
+        pool->near_map = calloc(size / (64 * ALLOCATION_CLASSES_INCR_SIZE), sizeof(uint64_t));
+        if (pool->near_map == NULL)
+        {
+            fprintf(stderr, "KV_alloc_pool_init: unable to allocate near map: %s\n", strerror(errno));
+        }
+    }
+
+#if defined(__linux__)
+    if (flags & ALLOC_POOL_LATENCY)
+    {
+        pool->latency = calloc(LATENCY_NUM_KINDS, sizeof(struct KV_latency_histogram));
+        if (pool->latency == NULL)
+        {
+            fprintf(stderr, "KV_alloc_pool_init: unable to allocate latency histograms: %s\n", strerror(errno));
+        }
     }
-#else
-    pool->offset += size;
-    alloc = pool->data + offset;
 #endif
 
-    *(uint64_t *)alloc = size;
-#if ALLOC_DEBUG_STATS
-    s_lock(pool, &stats->lock);
-    stats->num_allocs += 1;
-    stats->num_allocs_in_use += 1;
-    stats->allocs_in_use_size += size;
-    s_unlock(pool, &stats->lock);
+    KV_pool_update_inline(pool);
+    KV_pool_register(pool);
+    if (KV_page_map_set(pool->data, pool->size, pool) == -1)
+    {
+        fprintf(stderr, "KV_alloc_pool_init: unable to add the pool to the page map\n");
+        KV_alloc_pool_free(pool);
+        return NULL;
+    }
+
+#if defined(__linux__)
+    if ((flags & ALLOC_POOL_PREFAULT_AHEAD) && !(flags & ALLOC_POOL_PREFAULT))
+    {
+        if (!allow_concurrent_access)
+        {
+            fprintf(stderr, "KV_alloc_pool_init: prefaulting ahead needs a pool that allows concurrent access\n");
+        }
+        else
+        {
+            pool->prefault_ahead = true;
+            KV_pool_start_reclaimer(pool);
+        }
+    }
 #endif
-    return (void *)(alloc + ALLOCATION_SIZE_OVERHEAD);
+
+    return (struct KV_alloc_pool *)pool;
 }
 
-void KV_free(struct KV_alloc_pool *pool, void *ptr)
+#if defined(__linux__)
+static void KV_pool_header_init(struct KV_pool_header *header, size_t size, uint32_t flags)
 {
-    char *alloc_start = (char *)(ptr)-ALLOCATION_SIZE_OVERHEAD;
-    uint64_t size = *(uint64_t *)alloc_start;
-
-    if (size > MIN_ALLOCATION_CLASS_SIZE + (ALLOCATION_CLASSES_INCR_SIZE * MAX_FREELIST_NUM_CLASSES))
+    header->version = POOL_LAYOUT_VERSION;
+    header->flags = flags;
+    header->header_size = sizeof(struct KV_pool_header);
+    header->lock_size = sizeof(pthread_mutex_t);
+    header->size = size;
+    header->offset = 0;
+    header->root = 0;
+    for (size_t i = 0; i < MAX_FREELIST_NUM_CLASSES; i++)
     {
-#if ALLOC_DEBUG_STATS
-        s_lock(pool, &stats->lock);
-        stats->large_allocs_size -= size;
-        stats->num_large_allocs -= 1;
-        s_unlock(pool, &stats->lock);
-#endif
-        KV_mmap_deallocate(alloc_start, size);
+        header->alloc_freelist.freelist[i] = NULL;
+        header->alloc_freelist.count[i] = 0;
     }
-    else
+
+    if (flags & POOL_HEADER_SHARED)
     {
-        KV_add_to_freelist(pool, alloc_start, size);
-#if ALLOC_DEBUG_STATS
+        pthread_mutexattr_t attr;
+        pthread_mutexattr_init(&attr);
+        pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+        pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+        for (size_t i = 0; i < MAX_FREELIST_NUM_CLASSES; i++)
+        {
+            pthread_mutex_init(&header->shared_lock[i], &attr);
+        }
+        pthread_mutexattr_destroy(&attr);
+    }
+
+    // Openers treat the header as valid once the magic shows up
+    __atomic_store_n(&header->magic, POOL_HEADER_MAGIC, __ATOMIC_RELEASE);
+}
+
+static bool KV_pool_header_valid(struct KV_pool_header *header, size_t map_size, uint32_t flags)
+{
+    return __atomic_load_n(&header->magic, __ATOMIC_ACQUIRE) == POOL_HEADER_MAGIC &&
+           header->version == POOL_LAYOUT_VERSION &&
+           header->header_size == sizeof(struct KV_pool_header) && header->lock_size == sizeof(pthread_mutex_t) &&
+           header->size + POOL_HEADER_SIZE == map_size &&
+           (header->flags & POOL_HEADER_SHARED) == (flags & POOL_HEADER_SHARED);
+}
+
+static struct KV_alloc_pool *KV_pool_attach(struct KV_pool_header *header, bool allow_concurrent_access)
+{
+    struct KV_alloc_pool *pool = KV_pool_create(allow_concurrent_access);
+    if (pool == NULL)
+    {
+        munmap(header, POOL_HEADER_SIZE + header->size);
+        return NULL;
+    }
+
+    pool->header = header;
+    pool->data = (char *)header + POOL_HEADER_SIZE;
+    pool->size = header->size;
+    pool->alloc_freelist = &header->alloc_freelist;
+    pool->process_shared = (header->flags & POOL_HEADER_SHARED) != 0;
+    KV_pool_register(pool);
+    if (KV_page_map_set(pool->data, pool->size, pool) == -1)
+    {
+        fprintf(stderr, "KV_pool_attach: unable to add the pool to the page map\n");
+        KV_alloc_pool_free(pool);
+        return NULL;
+    }
+
+    return pool;
+}
+
+struct KV_alloc_pool *KV_alloc_pool_open(const char *path, size_t size, bool allow_concurrent_access)
+{
+    struct KV_alloc_pool *pool = NULL;
+    struct KV_pool_header *header = NULL;
+    struct stat st;
+    bool created = false;
+    size_t map_size;
+
+    int fd = open(path, O_RDWR | O_CREAT, 0600);
+    if (fd == -1)
+    {
+        fprintf(stderr, "KV_alloc_pool_open: unable to open %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+
+    if (fstat(fd, &st) == -1)
+    {
+        fprintf(stderr, "KV_alloc_pool_open: unable to stat %s: %s\n", path, strerror(errno));
+        close(fd);
+        return NULL;
+    }
+
+    if (st.st_size == 0)
+    {
+        if (size == 0)
+        {
+            fprintf(stderr, "KV_alloc_pool_open: %s does not exist and no size was given\n", path);
+            close(fd);
+            return NULL;
+        }
+
+        size = ALIGN_TO_SIZE(size, ALIGN_MASK(MIN_ALLOCATION_POOL_SIZE));
+        map_size = POOL_HEADER_SIZE + size;
+        if (ftruncate(fd, map_size) == -1)
+        {
+            fprintf(stderr, "KV_alloc_pool_open: unable to size %s to %zu: %s\n", path, map_size, strerror(errno));
+            close(fd);
+            return NULL;
+        }
+        created = true;
+    }
+    else if ((size_t)st.st_size <= POOL_HEADER_SIZE)
+    {
+        fprintf(stderr, "KV_alloc_pool_open: %s is too small to be a pool\n", path);
+        close(fd);
+        return NULL;
+    }
+    else
+    {
+        map_size = st.st_size;
+    }
+
+    // Pages are faulted in lazily through the page cache; nothing is read up front
+    header = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (header == MAP_FAILED)
+    {
+        fprintf(stderr, "KV_alloc_pool_open: mmap: unable to map %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+
+    if (created)
+    {
+        KV_pool_header_init(header, map_size - POOL_HEADER_SIZE, 0);
+    }
+    else if (!KV_pool_header_valid(header, map_size, 0))
+    {
+        fprintf(stderr, "KV_alloc_pool_open: %s has an unknown layout (version=%u)\n", path, (unsigned)header->version);
+        munmap(header, map_size);
+        return NULL;
+    }
+    else if (header->flags & POOL_HEADER_DIRTY)
+    {
+        fprintf(stderr, "KV_alloc_pool_open: %s was not closed cleanly\n", path);
+    }
+
+    pool = KV_pool_attach(header, allow_concurrent_access);
+    if (pool != NULL)
+    {
+        header->flags |= POOL_HEADER_DIRTY;
+    }
+
+    return pool;
+}
+
+struct KV_alloc_pool *KV_alloc_pool_shm_open(const char *name, size_t size)
+{
+    struct KV_pool_header *header = NULL;
+    struct stat st;
+    size_t map_size;
+    bool created = true;
+
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd == -1 && errno == EEXIST)
+    {
+        created = false;
+        fd = shm_open(name, O_RDWR, 0600);
+    }
+
+    if (fd == -1)
+    {
+        fprintf(stderr, "KV_alloc_pool_shm_open: unable to open %s: %s\n", name, strerror(errno));
+        return NULL;
+    }
+
+    if (created)
+    {
+        size = ALIGN_TO_SIZE(size, ALIGN_MASK(MIN_ALLOCATION_POOL_SIZE));
+        map_size = POOL_HEADER_SIZE + size;
+        if (ftruncate(fd, map_size) == -1)
+        {
+            fprintf(stderr, "KV_alloc_pool_shm_open: unable to size %s to %zu: %s\n", name, map_size, strerror(errno));
+            close(fd);
+            shm_unlink(name);
+            return NULL;
+        }
+    }
+    else
+    {
+        // The creator may not have sized the object yet
+        st.st_size = 0;
+        for (int i = 0; i < POOL_SHM_OPEN_RETRIES; i++)
+        {
+            if (fstat(fd, &st) == -1 || st.st_size > 0)
+            {
+                break;
+            }
+            thrd_yield();
+        }
+
+        if ((size_t)st.st_size <= POOL_HEADER_SIZE)
+        {
+            fprintf(stderr, "KV_alloc_pool_shm_open: %s is not a pool\n", name);
+            close(fd);
+            return NULL;
+        }
+        map_size = st.st_size;
+    }
+
+    header = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (header == MAP_FAILED)
+    {
+        fprintf(stderr, "KV_alloc_pool_shm_open: mmap: unable to map %s: %s\n", name, strerror(errno));
+        return NULL;
+    }
+
+    if (created)
+    {
+        KV_pool_header_init(header, map_size - POOL_HEADER_SIZE, POOL_HEADER_SHARED);
+    }
+    else
+    {
+        for (int i = 0; i < POOL_SHM_OPEN_RETRIES && __atomic_load_n(&header->magic, __ATOMIC_ACQUIRE) != POOL_HEADER_MAGIC; i++)
+        {
+            thrd_yield();
+        }
+
+        if (!KV_pool_header_valid(header, map_size, POOL_HEADER_SHARED))
+        {
+            fprintf(stderr, "KV_alloc_pool_shm_open: %s has an unknown layout (version=%u)\n", name, (unsigned)header->version);
+            munmap(header, map_size);
+            return NULL;
+        }
+    }
+
+    // Other processes may be allocating, so the pool is always synchronised
+    return KV_pool_attach(header, true);
+}
+
+int KV_alloc_pool_shm_unlink(const char *name)
+{
+    return shm_unlink(name);
+}
+
+int KV_alloc_pool_sync(struct KV_alloc_pool *pool)
+{
+    if (pool->header == NULL)
+    {
+        return 0;
+    }
+    return msync(pool->header, POOL_HEADER_SIZE + pool->size, MS_SYNC);
+}
+#else
+struct KV_alloc_pool *KV_alloc_pool_open(const char *path, size_t size ALLOC_UNUSED, bool allow_concurrent_access ALLOC_UNUSED)
+{
+    fprintf(stderr, "KV_alloc_pool_open: file-backed pools are not supported on this platform: %s\n", path);
+    return NULL;
+}
+
+struct KV_alloc_pool *KV_alloc_pool_shm_open(const char *name, size_t size ALLOC_UNUSED)
+{
+    fprintf(stderr, "KV_alloc_pool_shm_open: shared-memory pools are not supported on this platform: %s\n", name);
+    return NULL;
+}
+
+int KV_alloc_pool_shm_unlink(const char *name ALLOC_UNUSED)
+{
+    return -1;
+}
+
+int KV_alloc_pool_sync(struct KV_alloc_pool *pool ALLOC_UNUSED)
+{
+    return 0;
+}
+#endif
+
+void KV_pool_set_root(struct KV_alloc_pool *pool, void *ptr)
+{
+    if (pool->header != NULL)
+    {
+        pool->header->root = (uint64_t)(uintptr_t)KV_link_encode(pool, (char *)ptr);
+    }
+}
+
+void *KV_pool_get_root(struct KV_alloc_pool *pool)
+{
+    if (pool->header == NULL)
+    {
+        return NULL;
+    }
+    return (void *)KV_link_decode(pool, (char *)(uintptr_t)pool->header->root);
+}
+
+void KV_alloc_pool_free(struct KV_alloc_pool *pool)
+{
+    if (pool != NULL && pool->parent != NULL)
+    {
+        KV_subpool_free(pool);
+    }
+    else if (pool != NULL)
+    {
+        // Large chunks still queued would otherwise keep their mappings
+        KV_pool_stop_reclaimer(pool);
+        KV_pool_flush_deferred(pool);
+        KV_epoch_records_free(pool);
+
+        KV_pool_unregister(pool);
+        KV_page_map_set(pool->data, pool->size, NULL);
+
+        if (pool->io_free != NULL)
+        {
+#if ALLOC_HAVE_IO_URING
+            // Closing the ring would drop the registration as well; until then the pages stay pinned
+            if (pool->io_ring_fd >= 0 && syscall(__NR_io_uring_register, pool->io_ring_fd, IORING_UNREGISTER_BUFFERS, NULL, 0) == -1)
+            {
+                fprintf(stderr, "KV_alloc_pool_free: io_uring_register: unable to unregister buffers: %s\n", strerror(errno));
+            }
+#endif
+            mtx_destroy(&pool->io_lock);
+            free(pool->io_free);
+            free(pool->io_in_use);
+        }
+
+        for (size_t i = 0; i < MAX_FREELIST_NUM_CLASSES; i++)
+        {
+            mtx_destroy(&pool->class_lock[i]);
+        }
+        mtx_destroy(&pool->buddy_lock);
+
+        if (pool->header != NULL)
+        {
+            if (!pool->process_shared)
+            {
+                pool->header->flags &= ~POOL_HEADER_DIRTY;
+            }
+            if (munmap(pool->header, POOL_HEADER_SIZE + pool->size) == -1)
+            {
+                perror("munmap");
+            }
+        }
+        else if (KV_mmap_deallocate(pool->data, pool->size) == -1)
+        {
+            perror("mmap_deallocate");
+        }
+#if ALLOC_DEBUG_STATS
+        printf("Deallocating size=%zu\n", stats->alloc_size);
+        printf("Freelist: Hits=%i, Misses=%i, Size=%zu\n", stats->fr_hits, stats->fr_misses, stats->fr_alloc_size);
+        printf("Small Allocs: Num allocated=%i, Total Size=%zu, Num In Use=%i, In use Size=%zu\n", stats->num_allocs, stats->alloc_size, stats->num_allocs_in_use, stats->allocs_in_use_size);
+        printf("Large Allocs: Num allocated=%i, Size=%zu\n", stats->num_large_allocs, stats->large_allocs_size);
+        mtx_destroy(&pool->stats->lock);
+        free(pool->stats);
+#endif
+        if (pool->header == NULL)
+        {
+            free(pool->alloc_freelist);
+        }
+        free(pool->percpu);
+        free(pool->latency);
+        free(pool->tags);
+        free(pool->near_map);
+        free(pool->buddy_map);
+        free(pool->compact_used);
+        free(pool->compact_state);
+        free(pool);
+    }
+}
+
+static int KV_get_freelist_alloc_class(size_t size)
+{
+    size = ALIGN_TO_SIZE(size, ALIGN_MASK(ALLOCATION_CLASSES_INCR_SIZE));
+    if (size < MIN_ALLOCATION_CLASS_SIZE + (ALLOCATION_CLASSES_INCR_SIZE * MAX_FREELIST_NUM_CLASSES))
+    {
+        return (size - MIN_ALLOCATION_CLASS_SIZE) / ALLOCATION_CLASSES_INCR_SIZE;
+    }
+    return -1;
+}
+
+// Bits of different classes share words, so they change atomically even under a class lock
+static inline void KV_near_map_update(struct KV_alloc_pool *pool, const char *chunk, bool on_freelist)
+{
+    if (pool->near_map != NULL)
+    {
+        uint64_t bit = (chunk - pool->data) / ALLOCATION_CLASSES_INCR_SIZE;
+        if (on_freelist)
+        {
+            __atomic_fetch_or(&pool->near_map[bit / 64], (uint64_t)1 << (bit % 64), __ATOMIC_RELAXED);
+        }
+        else
+        {
+            __atomic_fetch_and(&pool->near_map[bit / 64], ~((uint64_t)1 << (bit % 64)), __ATOMIC_RELAXED);
+        }
+    }
+}
+
+static inline bool KV_near_map_test(struct KV_alloc_pool *pool, const char *chunk)
+{
+    uint64_t bit = (chunk - pool->data) / ALLOCATION_CLASSES_INCR_SIZE;
+    return __atomic_load_n(&pool->near_map[bit / 64], __ATOMIC_RELAXED) & ((uint64_t)1 << (bit % 64));
+}
+
+static ALLOC_UNUSED void *KV_remove_from_freelist_head(struct KV_alloc_pool *pool, size_t size)
+{
+    assert(IS_ALIGNED(size, ALLOCATION_CLASSES_INCR_SIZE));
+    struct KV_alloc_freelist *alloc_freelist = pool->alloc_freelist;
+
+    char *next_alloc = NULL;
+    int alloc_class = KV_get_freelist_alloc_class(size);
+    assert(alloc_class >= 0 && alloc_class < MAX_FREELIST_NUM_CLASSES);
+
+    alloc_lock(pool, alloc_class);
+    char *alloc_class_head = KV_link_decode(pool, alloc_freelist->freelist[alloc_class]);
+
+    // TODO: Implement best fit strategy
+    if (!alloc_class_head)
+    {
+        alloc_unlock(pool, alloc_class);
+        ALLOC_PROBE2(freelist_miss, pool, alloc_class);
+#if ALLOC_DEBUG_STATS
         s_lock(pool, &stats->lock);
-        stats->num_allocs_in_use -= 1;
-        stats->allocs_in_use_size -= size;
+        stats->fr_misses += 1;
         s_unlock(pool, &stats->lock);
 #endif
+        return NULL;
+    }
+
+    if (size <= MAX_ALLOCATION_OVERHEAD)
+    {
+        next_alloc = KV_link_decode(pool, *(char **)(alloc_class_head + 8));
+        alloc_freelist->freelist[alloc_class] = KV_link_encode(pool, next_alloc);
+    }
+    else
+    {
+        assert(*(char **)(alloc_class_head + 8) == NULL); // Ensure we have the head
+
+        // Replace head with next alloc chunk
+        next_alloc = KV_link_decode(pool, *(char **)(alloc_class_head + 16));
+        if (next_alloc)
+        {
+            *(char **)(next_alloc + 8) = NULL; // Previous chunk
+        }
+        alloc_freelist->freelist[alloc_class] = KV_link_encode(pool, next_alloc);
     }
+    alloc_freelist->count[alloc_class] -= 1;
+    KV_near_map_update(pool, alloc_class_head, false);
+    alloc_unlock(pool, alloc_class);
+    ALLOC_PROBE2(freelist_hit, pool, alloc_class);
+
+#if ALLOC_DEBUG_STATS
+    s_lock(pool, &stats->lock);
+    stats->fr_hits += 1;
+    stats->fr_alloc_size -= size;
+    s_unlock(pool, &stats->lock);
+#endif
+
+    return alloc_class_head;
+}
+
+static inline bool KV_near(const void *a, const void *b, size_t span)
+{
+    return ((uintptr_t)a & ~ALIGN_MASK(span)) == ((uintptr_t)b & ~ALIGN_MASK(span));
+}
+
+// Caller holds the class lock. prev is only needed for class 0, whose chunks have no link back
+static void KV_freelist_unlink_locked(struct KV_alloc_pool *pool, char *chunk, char *prev, size_t size, int alloc_class)
+{
+    struct KV_alloc_freelist *alloc_freelist = pool->alloc_freelist;
+
+    if (size <= MAX_ALLOCATION_OVERHEAD)
+    {
+        if (prev)
+        {
+            *(char **)(prev + 8) = *(char **)(chunk + 8);
+        }
+        else
+        {
+            alloc_freelist->freelist[alloc_class] = *(char **)(chunk + 8);
+        }
+    }
+    else
+    {
+        char *next = KV_link_decode(pool, *(char **)(chunk + 16));
+        prev = KV_link_decode(pool, *(char **)(chunk + 8));
+        if (prev)
+        {
+            *(char **)(prev + 16) = KV_link_encode(pool, next);
+        }
+        else
+        {
+            alloc_freelist->freelist[alloc_class] = KV_link_encode(pool, next);
+        }
+
+        if (next)
+        {
+            *(char **)(next + 8) = KV_link_encode(pool, prev);
+        }
+    }
+    alloc_freelist->count[alloc_class] -= 1;
+    KV_near_map_update(pool, chunk, false);
+}
+
+// A free chunk of the class on the hint's page, looked up in near_map. A set bit only says the chunk is on
+// some freelist, so its header picks the class, and both are checked again under the class lock
+static char *KV_near_map_take(struct KV_alloc_pool *pool, size_t size, int alloc_class, const char *hint)
+{
+    uint64_t start = (hint - pool->data) & ~ALIGN_MASK(NEAR_PAGE_SIZE);
+    uint64_t end = start + NEAR_PAGE_SIZE < pool->size ? start + NEAR_PAGE_SIZE : pool->size;
+    uint64_t words_end = (end / ALLOCATION_CLASSES_INCR_SIZE + 63) / 64;
+
+    for (uint64_t word = start / ALLOCATION_CLASSES_INCR_SIZE / 64; word < words_end; word++)
+    {
+        uint64_t bits = __atomic_load_n(&pool->near_map[word], __ATOMIC_RELAXED);
+        while (bits)
+        {
+            char *chunk = pool->data + (word * 64 + __builtin_ctzll(bits)) * ALLOCATION_CLASSES_INCR_SIZE;
+            bits &= bits - 1;
+            if (__atomic_load_n((uint64_t *)chunk, __ATOMIC_RELAXED) != size)
+            {
+                continue;
+            }
+
+            alloc_lock(pool, alloc_class);
+            if (KV_near_map_test(pool, chunk) && *(uint64_t *)chunk == size)
+            {
+                KV_freelist_unlink_locked(pool, chunk, NULL, size, alloc_class);
+                alloc_unlock(pool, alloc_class);
+                return chunk;
+            }
+            alloc_unlock(pool, alloc_class);
+        }
+    }
+    return NULL;
+}
+
+// Unlink a chunk within span of the hint. Pages are looked up in near_map when the pool keeps one;
+// otherwise only the first NEAR_SCAN_LIMIT chunks of the class are looked at
+static char *KV_remove_from_freelist_near(struct KV_alloc_pool *pool, size_t size, const char *hint, size_t span)
+{
+    struct KV_alloc_freelist *alloc_freelist = pool->alloc_freelist;
+    char *chunk, *chunk_prev = NULL, *found = NULL;
+    int alloc_class = KV_get_freelist_alloc_class(size);
+    assert(alloc_class >= 0 && alloc_class < MAX_FREELIST_NUM_CLASSES);
+
+    if (span == NEAR_PAGE_SIZE && pool->near_map != NULL && size > MAX_ALLOCATION_OVERHEAD)
+    {
+        found = KV_near_map_take(pool, size, alloc_class, hint);
+    }
+    else
+    {
+        alloc_lock(pool, alloc_class);
+        chunk = KV_link_decode(pool, alloc_freelist->freelist[alloc_class]);
+        for (int i = 0; chunk != NULL && i < NEAR_SCAN_LIMIT; i++)
+        {
+            if (KV_near(chunk, hint, span))
+            {
+                KV_freelist_unlink_locked(pool, chunk, chunk_prev, size, alloc_class);
+                found = chunk;
+                break;
+            }
+            chunk_prev = chunk;
+            chunk = KV_link_decode(pool, *(char **)(chunk + (size <= MAX_ALLOCATION_OVERHEAD ? 8 : 16)));
+        }
+        alloc_unlock(pool, alloc_class);
+    }
+
+    if (found == NULL)
+    {
+        return NULL;
+    }
+    ALLOC_PROBE2(freelist_hit, pool, alloc_class);
+
+#if ALLOC_DEBUG_STATS
+    s_lock(pool, &stats->lock);
+    stats->fr_hits += 1;
+    stats->fr_alloc_size -= size;
+    s_unlock(pool, &stats->lock);
+#endif
+
+    return found;
+}
+
+static inline size_t KV_compact_region(struct KV_alloc_pool *pool, const char *chunk)
+{
+    return (chunk - pool->data) / COMPACT_REGION_SIZE;
+}
+
+// Chunks and fillers are counted against the region they start in
+static inline void KV_compact_account(struct KV_alloc_pool *pool, const char *chunk, int64_t size)
+{
+    if (pool->compact_used != NULL)
+    {
+        __atomic_fetch_add(&pool->compact_used[KV_compact_region(pool, chunk)], (uint32_t)size, __ATOMIC_RELAXED);
+    }
+}
+
+// Caller holds the class lock
+static void KV_freelist_push_locked(struct KV_alloc_pool *pool, char *alloc_start, size_t size, int alloc_class)
+{
+    struct KV_alloc_freelist *alloc_freelist = pool->alloc_freelist;
+    char *alloc_class_head = KV_link_decode(pool, alloc_freelist->freelist[alloc_class]); // First chunk from freelist class
+
+    if (size <= MAX_ALLOCATION_OVERHEAD)
+    {
+        if (!alloc_class_head) // Empty
+        {
+            alloc_freelist->freelist[alloc_class] = KV_link_encode(pool, alloc_start);
+            *(char **)(alloc_start + 8) = NULL; // Next
+        }
+        else
+        {
+            alloc_freelist->freelist[alloc_class] = KV_link_encode(pool, alloc_start);
+            *(char **)(alloc_start + 8) = KV_link_encode(pool, alloc_class_head); // New head next chunk
+
+            assert(*(char **)(alloc_start + 8) != NULL);
+        }
+    }
+    else
+    {
+        if (!alloc_class_head) // Empty
+        {
+            alloc_freelist->freelist[alloc_class] = KV_link_encode(pool, alloc_start);
+            *(char **)(alloc_start + 8) = NULL;
+            *(char **)(alloc_start + 16) = NULL;
+        }
+        else
+        {
+            assert(*(char **)(alloc_class_head + 8) == NULL);
+
+            alloc_freelist->freelist[alloc_class] = KV_link_encode(pool, alloc_start);
+            *(char **)(alloc_start + 8) = NULL;                                    // New head previous chunk
+            *(char **)(alloc_start + 16) = KV_link_encode(pool, alloc_class_head); // New head next chunk
+            *(char **)(alloc_class_head + 8) = KV_link_encode(pool, alloc_start);  // Old head previous chunk
+
+            assert(*(char **)(alloc_start + 16) != NULL);
+            assert(*(char **)(alloc_class_head + 8) != NULL);
+        }
+    }
+    alloc_freelist->count[alloc_class] += 1;
+    KV_near_map_update(pool, alloc_start, true);
+}
+
+static ALLOC_UNUSED void KV_add_to_freelist(struct KV_alloc_pool *pool, char *alloc_start, size_t size)
+{
+    int alloc_class = KV_get_freelist_alloc_class(size);
+    assert(alloc_class >= 0 && alloc_class < MAX_FREELIST_NUM_CLASSES);
+
+    alloc_lock(pool, alloc_class);
+    // Compaction owns every free chunk of a region it is emptying; checked under the lock it marks regions with
+    if (pool->compact_state != NULL && pool->compact_state[KV_compact_region(pool, alloc_start)] == COMPACT_REGION_EVACUATING)
+    {
+        *(uint64_t *)alloc_start |= COMPACT_FREE_MARK;
+        alloc_unlock(pool, alloc_class);
+        return;
+    }
+    KV_freelist_push_locked(pool, alloc_start, size, alloc_class);
+    alloc_unlock(pool, alloc_class);
+
+#if ALLOC_DEBUG_STATS
+    s_lock(pool, &stats->lock);
+    stats->fr_alloc_size += size;
+    s_unlock(pool, &stats->lock);
+#endif
+}
+
+// Cut a range that left the bump region unused into class chunks so it is not lost
+static void KV_carve_to_freelist(struct KV_alloc_pool *pool, char *start, size_t size)
+{
+    while (size >= MIN_ALLOCATION_CLASS_SIZE)
+    {
+        size_t chunk_size = size;
+        if (chunk_size > MAX_ALLOCATION_CLASS_SIZE)
+        {
+            // Never leave a sliver too small to become a chunk of its own
+            chunk_size = (size - MAX_ALLOCATION_CLASS_SIZE) < MIN_ALLOCATION_CLASS_SIZE ? size - MIN_ALLOCATION_CLASS_SIZE : MAX_ALLOCATION_CLASS_SIZE;
+        }
+
+        *(uint64_t *)start = chunk_size;
+        KV_add_to_freelist(pool, start, chunk_size);
+        start += chunk_size;
+        size -= chunk_size;
+    }
+
+    if (size == ALLOCATION_SIZE_OVERHEAD && pool->compact_used != NULL)
+    {
+        // Filler; counted as used so the region still adds up when compaction walks it
+        *(uint64_t *)start = ALLOCATION_SIZE_OVERHEAD;
+        KV_compact_account(pool, start, ALLOCATION_SIZE_OVERHEAD);
+    }
+}
+
+// Where a class chunk of size claimed at offset has to start so it does not cross a compaction region
+static inline uint64_t KV_compact_skip(struct KV_alloc_pool *pool, uint64_t offset, size_t size)
+{
+    uint64_t region_end = (offset & ~ALIGN_MASK(COMPACT_REGION_SIZE)) + COMPACT_REGION_SIZE;
+    if (pool->compact_used == NULL || size > MAX_ALLOCATION_CLASS_SIZE || offset + size <= region_end)
+    {
+        return offset;
+    }
+    return region_end;
+}
+
+// Carve size bytes off the top of the pool. Returns NULL without complaint when it does not fit
+static char *KV_bump_claim(struct KV_alloc_pool *pool, size_t size)
+{
+    uint64_t *pool_offset = KV_pool_offset(pool);
+    uint64_t offset, start;
+
+#ifdef CONCURRENT_ACCESS
+    if (pool->allow_concurrent_allocs)
+    {
+        offset = __atomic_load_n(pool_offset, __ATOMIC_ACQUIRE);
+        while (1)
+        {
+            start = KV_compact_skip(pool, offset, size);
+            if ((start + size) > pool->size)
+            {
+                return NULL;
+            }
+
+            if (__atomic_compare_exchange_n(pool_offset, &offset, start + size, 0, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE))
+            {
+                break;
+            }
+            ALLOC_PROBE2(bump_cas_retry, pool, offset);
+        }
+    }
+    else
+#endif
+    {
+        offset = *pool_offset;
+        start = KV_compact_skip(pool, offset, size);
+        if ((start + size) > pool->size)
+        {
+            return NULL;
+        }
+        *pool_offset = start + size;
+    }
+
+    KV_carve_to_freelist(pool, pool->data + offset, start - offset);
+    return pool->data + start;
+}
+
+static char *KV_bump_allocate(struct KV_alloc_pool *pool, size_t size)
+{
+    char *alloc = KV_bump_claim(pool, size);
+    if (alloc == NULL)
+    {
+        fprintf(stderr, "memory limit of current pool exceeded for size=%u\n", (unsigned)size);
+    }
+    return alloc;
+}
+
+// Like KV_bump_claim, but the block starts at a multiple of size from data. *gap gets the start of
+// the bytes skipped to get there, which the caller must hand out
+static char *KV_bump_claim_aligned(struct KV_alloc_pool *pool, size_t size, char **gap)
+{
+    uint64_t *pool_offset = KV_pool_offset(pool);
+    uint64_t offset = __atomic_load_n(pool_offset, __ATOMIC_ACQUIRE);
+    uint64_t aligned;
+
+    while (1)
+    {
+        aligned = ALIGN_TO_SIZE(offset, ALIGN_MASK(size));
+        if ((aligned + size) > pool->size)
+        {
+            return NULL;
+        }
+
+#ifdef CONCURRENT_ACCESS
+        if (pool->allow_concurrent_allocs)
+        {
+            if (__atomic_compare_exchange_n(pool_offset, &offset, aligned + size, 0, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE))
+            {
+                break;
+            }
+            ALLOC_PROBE2(bump_cas_retry, pool, offset);
+            continue;
+        }
+#endif
+        *pool_offset = aligned + size;
+        break;
+    }
+
+    *gap = pool->data + offset;
+    return pool->data + aligned;
+}
+
+// Buddy tier for chunks too big for a class and no bigger than BUDDY_MAX_BLOCK_SIZE. Blocks are aligned to their
+// size relative to data, so a block's buddy is one offset bit away. Only the first page of a free block is marked
+// in buddy_map; a block can merge when its buddy's entry says free with the same order.
+// Links are plain pointers, so pools with a header keep serving these sizes with mmap
+static inline bool KV_buddy_enabled(struct KV_alloc_pool *pool)
+{
+    return pool->header == NULL;
+}
+
+static inline bool KV_buddy_owns(struct KV_alloc_pool *pool, const char *alloc_start)
+{
+    return alloc_start >= pool->data && alloc_start < pool->data + pool->size;
+}
+
+static inline int KV_buddy_order(size_t size)
+{
+    int order = 0;
+    while ((BUDDY_MIN_BLOCK_SIZE << order) < size)
+    {
+        order++;
+    }
+    return order;
+}
+
+static inline uint8_t *KV_buddy_map_entry(struct KV_alloc_pool *pool, const char *block)
+{
+    return &pool->buddy_map[(block - pool->data) >> BUDDY_MIN_BLOCK_SHIFT];
+}
+
+// Caller holds buddy_lock for this and KV_buddy_unlink
+static void KV_buddy_push(struct KV_alloc_pool *pool, char *block, int order)
+{
+    char *head = pool->buddy_free[order];
+
+    *(char **)(block + 8) = NULL;  // Previous block
+    *(char **)(block + 16) = head; // Next block
+    if (head)
+    {
+        *(char **)(head + 8) = block;
+    }
+    pool->buddy_free[order] = block;
+    pool->buddy_count[order] += 1;
+    *KV_buddy_map_entry(pool, block) = BUDDY_BLOCK_FREE | order;
+}
+
+static void KV_buddy_unlink(struct KV_alloc_pool *pool, char *block, int order)
+{
+    char *prev = *(char **)(block + 8);
+    char *next = *(char **)(block + 16);
+
+    if (prev)
+    {
+        *(char **)(prev + 16) = next;
+    }
+    else
+    {
+        pool->buddy_free[order] = next;
+    }
+
+    if (next)
+    {
+        *(char **)(next + 8) = prev;
+    }
+    pool->buddy_count[order] -= 1;
+    *KV_buddy_map_entry(pool, block) = 0;
+}
+
+// Claim the largest block, up to 1/BUDDY_GROW_POOL_FRACTION of the pool, that still fits in the bump region.
+// Whole pages skipped to align it become smaller free blocks, the sub-page remainder class chunks. Caller holds buddy_lock
+static bool KV_buddy_grow(struct KV_alloc_pool *pool, int min_order)
+{
+    int max_order = BUDDY_NUM_ORDERS - 1;
+    while (max_order > min_order && (BUDDY_MIN_BLOCK_SIZE << max_order) > pool->size / BUDDY_GROW_POOL_FRACTION)
+    {
+        max_order--;
+    }
+
+    for (int order = max_order; order >= min_order; order--)
+    {
+        char *gap = NULL;
+        char *block = KV_bump_claim_aligned(pool, BUDDY_MIN_BLOCK_SIZE << order, &gap);
+        if (block == NULL)
+        {
+            continue;
+        }
+
+        uint64_t start = gap - pool->data;
+        uint64_t end = block - pool->data;
+        uint64_t page = ALIGN_TO_SIZE(start, ALIGN_MASK(BUDDY_MIN_BLOCK_SIZE));
+        KV_carve_to_freelist(pool, gap, page - start);
+
+        while (page < end)
+        {
+            int gap_order = order - 1;
+            size_t gap_size = BUDDY_MIN_BLOCK_SIZE << gap_order;
+            while (!IS_ALIGNED(page, gap_size) || page + gap_size > end)
+            {
+                gap_order--;
+                gap_size >>= 1;
+            }
+            KV_buddy_push(pool, pool->data + page, gap_order);
+            page += gap_size;
+        }
+
+        KV_buddy_push(pool, block, order);
+        return true;
+    }
+    return false;
+}
+
+// Hand the pages of an unused range back to the kernel; they read as zero when touched again
+static void KV_pages_release(struct KV_alloc_pool *pool ALLOC_UNUSED, char *start ALLOC_UNUSED, size_t size ALLOC_UNUSED)
+{
+#if defined(__linux__)
+    // Pages of a shared mapping stay in the shmem object until they are punched out
+    int advice = (pool->flags & ALLOC_POOL_PRIVATE) ? MADV_DONTNEED : MADV_REMOVE;
+    if (madvise(start, size, advice) == -1)
+    {
+        fprintf(stderr, "KV_pages_release: madvise: %s\n", strerror(errno));
+    }
+#endif
+}
+
+// Caller holds buddy_lock
+static int KV_buddy_map_init(struct KV_alloc_pool *pool)
+{
+    if (pool->buddy_map == NULL)
+    {
+        pool->buddy_map = calloc(pool->size >> BUDDY_MIN_BLOCK_SHIFT, sizeof(uint8_t));
+        if (pool->buddy_map == NULL)
+        {
+            fprintf(stderr, "KV_buddy_map_init: calloc: unable to allocate page map: %s\n", strerror(errno));
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// size is a power of two between BUDDY_MIN_BLOCK_SIZE and BUDDY_MAX_BLOCK_SIZE. Returns NULL when the pool is full
+static char *KV_buddy_allocate(struct KV_alloc_pool *pool, size_t size)
+{
+    int order = KV_buddy_order(size);
+    int curr = order;
+    char *block = NULL;
+
+    s_lock(pool, &pool->buddy_lock);
+    if (KV_buddy_map_init(pool) == -1)
+    {
+        s_unlock(pool, &pool->buddy_lock);
+        return NULL;
+    }
+
+    while (curr < BUDDY_NUM_ORDERS && pool->buddy_free[curr] == NULL)
+    {
+        curr++;
+    }
+
+    if (curr == BUDDY_NUM_ORDERS)
+    {
+        if (!KV_buddy_grow(pool, order))
+        {
+            s_unlock(pool, &pool->buddy_lock);
+            return NULL;
+        }
+
+        for (curr = order; pool->buddy_free[curr] == NULL; curr++)
+            ;
+    }
+
+    block = pool->buddy_free[curr];
+    KV_buddy_unlink(pool, block, curr);
+
+    // Keep the lower half and free the upper one until the block is the right size
+    while (curr > order)
+    {
+        curr--;
+        KV_buddy_push(pool, block + (BUDDY_MIN_BLOCK_SIZE << curr), curr);
+    }
+    s_unlock(pool, &pool->buddy_lock);
+
+    *(uint64_t *)block = size;
+    return block;
+}
+
+static void KV_buddy_free(struct KV_alloc_pool *pool, char *block, size_t size)
+{
+    int order = KV_buddy_order(size);
+
+    s_lock(pool, &pool->buddy_lock);
+    if (KV_buddy_map_init(pool) == -1)
+    {
+        s_unlock(pool, &pool->buddy_lock);
+        return; // Only compaction frees blocks the tier never handed out; the range is simply not reused
+    }
+    while (order < BUDDY_NUM_ORDERS - 1)
+    {
+        uint64_t buddy_offset = (block - pool->data) ^ (BUDDY_MIN_BLOCK_SIZE << order);
+        if (buddy_offset >= pool->size)
+        {
+            break;
+        }
+
+        char *buddy = pool->data + buddy_offset;
+        if (*KV_buddy_map_entry(pool, buddy) != (BUDDY_BLOCK_FREE | order))
+        {
+            break;
+        }
+
+        KV_buddy_unlink(pool, buddy, order);
+        block = buddy < block ? buddy : block;
+        order++;
+    }
+    KV_buddy_push(pool, block, order);
+    s_unlock(pool, &pool->buddy_lock);
+}
+
+#if defined(__linux__)
+// Splice the thread's whole batch onto the pool's list with a single CAS. Drainers take the list
+// with an exchange and never pop single chunks, so there is no ABA window
+static void KV_deferred_publish(struct KV_alloc_pool *pool, struct KV_thread_cache_entry *entry)
+{
+    if (entry->deferred == NULL)
+    {
+        return;
+    }
+
+    char *head = __atomic_load_n(&pool->deferred, __ATOMIC_RELAXED);
+    do
+    {
+        *(char **)(entry->deferred_tail + 8) = head;
+    } while (!__atomic_compare_exchange_n(&pool->deferred, &head, entry->deferred, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    entry->deferred = entry->deferred_tail = NULL;
+    entry->deferred_count = 0;
+}
+
+// The calling thread's partial batch for pool, so its own slow paths do not leave it parked
+static void KV_deferred_publish_own(struct KV_alloc_pool *pool)
+{
+    for (int i = 0; i < THREAD_CACHE_NUM_POOLS; i++)
+    {
+        struct KV_thread_cache_entry *entry = &thread_cache.entries[i];
+        if (entry->pool == pool && entry->pool_id == pool->id)
+        {
+            KV_deferred_publish(pool, entry);
+        }
+    }
+}
+
+static void KV_epoch_record_release(struct KV_thread_cache_entry *entry)
+{
+    if (entry->epoch_record != NULL)
+    {
+        __atomic_store_n(&entry->epoch_record->state, 0, __ATOMIC_RELEASE);
+        __atomic_store_n(&entry->epoch_record->in_use, false, __ATOMIC_RELEASE);
+        entry->epoch_record = NULL;
+    }
+}
+
+// Hand the rest of a thread's bump chunk back to the offset if nothing was carved after it,
+// otherwise cut it into class chunks so it is not lost
+static void KV_thread_bump_retire(struct KV_alloc_pool *pool, struct KV_thread_cache_entry *entry)
+{
+    char *tail = entry->bump;
+    size_t tail_size = entry->bump_end - entry->bump;
+    uint64_t end = entry->bump_end - pool->data;
+
+    entry->bump = entry->bump_end = NULL;
+    if (tail_size == 0)
+    {
+        return;
+    }
+
+    if (__atomic_compare_exchange_n(KV_pool_offset(pool), &end, tail - pool->data, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+    {
+        return;
+    }
+    KV_carve_to_freelist(pool, tail, tail_size);
+}
+
+static void KV_thread_cache_evict(struct KV_thread_cache_entry *entry)
+{
+    if (entry->pool != NULL)
+    {
+        // The pool may have been freed since this thread last used it
+        mtx_lock(&pool_list_lock);
+        if (KV_pool_alive(entry->pool, entry->pool_id))
+        {
+            KV_thread_bump_retire(entry->pool, entry);
+            KV_deferred_publish(entry->pool, entry);
+            KV_epoch_record_release(entry);
+            __atomic_fetch_add(&entry->pool->budget_usage, entry->budget_delta, __ATOMIC_RELAXED);
+        }
+        mtx_unlock(&pool_list_lock);
+    }
+    memset(entry, 0, sizeof(struct KV_thread_cache_entry));
+}
+
+static void KV_thread_cache_release(void *arg)
+{
+    struct KV_thread_cache *cache = (struct KV_thread_cache *)arg;
+    for (int i = 0; i < THREAD_CACHE_NUM_POOLS; i++)
+    {
+        KV_thread_cache_evict(&cache->entries[i]);
+    }
+    cache->registered = false;
+}
+
+static struct KV_thread_cache_entry *KV_thread_cache_lookup(struct KV_alloc_pool *pool)
+{
+    struct KV_thread_cache *cache = &thread_cache;
+    struct KV_thread_cache_entry *entry = NULL;
+
+    for (int i = 0; i < THREAD_CACHE_NUM_POOLS; i++)
+    {
+        if (cache->entries[i].pool == pool)
+        {
+            if (cache->entries[i].pool_id == pool->id)
+            {
+                return &cache->entries[i];
+            }
+
+            // A freed pool's address was reused; whatever the entry held went with it
+            entry = &cache->entries[i];
+            break;
+        }
+
+        if (entry == NULL && cache->entries[i].pool == NULL)
+        {
+            entry = &cache->entries[i];
+        }
+    }
+
+    if (!cache->registered)
+    {
+        tss_set(thread_cache_key, cache);
+        cache->registered = true;
+    }
+
+    if (entry == NULL)
+    {
+        // Never take the epoch record away from a thread that is inside a section
+        for (int i = 0; i < THREAD_CACHE_NUM_POOLS; i++)
+        {
+            entry = &cache->entries[cache->next_victim];
+            cache->next_victim = (cache->next_victim + 1) % THREAD_CACHE_NUM_POOLS;
+            if (entry->epoch_record == NULL || entry->epoch_record->nesting == 0)
+            {
+                break;
+            }
+        }
+        KV_thread_cache_evict(entry);
+    }
+
+    memset(entry, 0, sizeof(struct KV_thread_cache_entry));
+    entry->pool = pool;
+    entry->pool_id = pool->id;
+    return entry;
+}
+
+// Threads sharing a pool claim THREAD_BUMP_CHUNK_SIZE at a time with one CAS and carve it without atomics
+static char *KV_thread_bump_allocate(struct KV_alloc_pool *pool, size_t size)
+{
+    struct KV_thread_cache_entry *entry = NULL;
+    char *alloc = NULL;
+
+    // Compaction has no way to see the unused part of another thread's chunk, and a file image would keep
+    // the tails of every chunk handed out before it was closed
+    if (!pool->allow_concurrent_allocs || pool->process_shared || pool->header != NULL || pool->compact_used != NULL)
+    {
+        return KV_bump_allocate(pool, size);
+    }
+
+    entry = KV_thread_cache_lookup(pool);
+    if ((size_t)(entry->bump_end - entry->bump) < size)
+    {
+        KV_thread_bump_retire(pool, entry);
+
+        alloc = KV_bump_claim(pool, THREAD_BUMP_CHUNK_SIZE);
+        if (alloc == NULL)
+        {
+            return KV_bump_allocate(pool, size); // Nearly full; carve exactly what was asked for
+        }
+        entry->bump = alloc;
+        entry->bump_end = alloc + THREAD_BUMP_CHUNK_SIZE;
+    }
+
+    alloc = entry->bump;
+    entry->bump += size;
+    return alloc;
+}
+#else
+static char *KV_thread_bump_allocate(struct KV_alloc_pool *pool, size_t size)
+{
+    return KV_bump_allocate(pool, size);
+}
+
+static void KV_deferred_publish_own(struct KV_alloc_pool *pool ALLOC_UNUSED) {}
+#endif
+
+static inline bool KV_budget_enabled(struct KV_alloc_pool *pool)
+{
+    return pool->budget_soft != 0 || pool->budget_hard != 0;
+}
+
+// This thread's share of the usage that has not reached the pool counter yet
+static int64_t *KV_budget_delta(struct KV_alloc_pool *pool ALLOC_UNUSED)
+{
+#if defined(__linux__)
+    return &KV_thread_cache_lookup(pool)->budget_delta;
+#else
+    return NULL;
+#endif
+}
+
+static void KV_budget_notify(struct KV_alloc_pool *pool, int64_t usage)
+{
+    if (budget_notifying)
+    {
+        return;
+    }
+
+    budget_notifying = true;
+    for (int i = 0; i < pool->num_budget_callbacks; i++)
+    {
+        pool->budget_callbacks[i].fn(pool, usage < 0 ? 0 : usage, pool->budget_soft, pool->budget_callbacks[i].arg);
+    }
+    budget_notifying = false;
+}
+
+// Charges are batched per thread, so the soft limit is noticed up to budget_batch bytes per thread late
+static void KV_budget_update(struct KV_alloc_pool *pool, int64_t size)
+{
+    int64_t *delta = KV_budget_delta(pool);
+    if (delta != NULL)
+    {
+        *delta += size;
+        if (*delta < pool->budget_batch && *delta > -pool->budget_batch)
+        {
+            return;
+        }
+        size = *delta;
+        *delta = 0;
+    }
+
+    int64_t usage = __atomic_add_fetch(&pool->budget_usage, size, __ATOMIC_RELAXED);
+    if (pool->budget_soft == 0)
+    {
+        return;
+    }
+
+    // Edge triggered: callbacks run once per crossing, not on every allocation above the limit
+    if (usage > (int64_t)pool->budget_soft)
+    {
+        if (!__atomic_exchange_n(&pool->budget_pressure, true, __ATOMIC_ACQ_REL))
+        {
+            KV_budget_notify(pool, usage);
+        }
+    }
+    else if (__atomic_load_n(&pool->budget_pressure, __ATOMIC_RELAXED))
+    {
+        __atomic_store_n(&pool->budget_pressure, false, __ATOMIC_RELAXED);
+    }
+}
+
+// Includes the caller's pending delta, so a single thread never goes past the hard limit
+static int64_t KV_budget_projected(struct KV_alloc_pool *pool, size_t size)
+{
+    int64_t *delta = KV_budget_delta(pool);
+    return __atomic_load_n(&pool->budget_usage, __ATOMIC_RELAXED) + (delta ? *delta : 0) + (int64_t)size;
+}
+
+static int KV_budget_charge(struct KV_alloc_pool *pool, size_t size)
+{
+    if (pool->budget_hard != 0 && KV_budget_projected(pool, size) > (int64_t)pool->budget_hard)
+    {
+        // Last chance for the owner to evict before the allocation fails
+        KV_budget_notify(pool, KV_budget_projected(pool, 0));
+        if (KV_budget_projected(pool, size) > (int64_t)pool->budget_hard)
+        {
+            fprintf(stderr, "KV_malloc: hard budget of %llu bytes exceeded for size=%u\n", (unsigned long long)pool->budget_hard, (unsigned)size);
+            return -1;
+        }
+    }
+
+    KV_budget_update(pool, size);
+    return 0;
+}
+
+// Pool struct, freelist heads and buddy page map of a child, kept at the end of its block
+static inline size_t KV_subpool_meta_size(size_t block_size)
+{
+    return ALIGN_TO_SIZE(sizeof(struct KV_alloc_pool), ALIGN_MASK(64)) + ALIGN_TO_SIZE(sizeof(struct KV_alloc_freelist), ALIGN_MASK(64)) +
+           ALIGN_TO_SIZE((block_size >> BUDDY_MIN_BLOCK_SHIFT), ALIGN_MASK(64));
+}
+
+// A single-threaded pool in one buddy block of the parent. Creating one takes no syscall and no malloc, and
+// KV_subpool_free hands the whole block back at once, whatever is still allocated in it. Requests that do not
+// fit in the block fail instead of mapping memory. The block's pages name the child in the address map, so
+// KV_free_any and KV_pool_of find it; the parent already has map nodes there, so that allocates nothing either
+struct KV_alloc_pool *KV_subpool_init(struct KV_alloc_pool *parent, size_t size)
+{
+    size_t block_size = BUDDY_MIN_BLOCK_SIZE;
+
+    if (!parent || !parent->data)
+    {
+        fprintf(stderr, "KV_subpool_init: invalid memory pool");
+        return NULL;
+    }
+
+    if (!KV_buddy_enabled(parent) || parent->io_free != NULL)
+    {
+        fprintf(stderr, "KV_subpool_init: parent pool has no buddy tier to carve from\n");
+        return NULL;
+    }
+
+    while (block_size < size + KV_subpool_meta_size(block_size) && block_size <= BUDDY_MAX_BLOCK_SIZE)
+    {
+        block_size <<= 1;
+    }
+    if (block_size > BUDDY_MAX_BLOCK_SIZE)
+    {
+        fprintf(stderr, "KV_subpool_init: size=%u does not fit in a buddy block\n", (unsigned)size);
+        return NULL;
+    }
+
+    if (KV_budget_enabled(parent) && KV_budget_charge(parent, block_size) == -1)
+    {
+        return NULL;
+    }
+
+    char *block = KV_buddy_allocate(parent, block_size);
+    if (block == NULL)
+    {
+        if (KV_budget_enabled(parent))
+        {
+            KV_budget_update(parent, -(int64_t)block_size);
+        }
+        fprintf(stderr, "KV_subpool_init: no room for %u bytes in the parent pool\n", (unsigned)block_size);
+        return NULL;
+    }
+
+    char *meta = block + block_size - KV_subpool_meta_size(block_size);
+    struct KV_alloc_pool *pool = (struct KV_alloc_pool *)meta;
+    KV_pool_setup(pool, false);
+    pool->data = block;
+    pool->size = meta - block;
+    pool->parent = parent;
+    pool->parent_block_size = block_size;
+
+    // A single-threaded pool never takes the class locks, so they are left uninitialised
+    pool->alloc_freelist = (struct KV_alloc_freelist *)(meta + ALIGN_TO_SIZE(sizeof(struct KV_alloc_pool), ALIGN_MASK(64)));
+    memset(pool->alloc_freelist, 0, sizeof(struct KV_alloc_freelist));
+    pool->buddy_map = (uint8_t *)pool->alloc_freelist + ALIGN_TO_SIZE(sizeof(struct KV_alloc_freelist), ALIGN_MASK(64));
+    memset(pool->buddy_map, 0, pool->size >> BUDDY_MIN_BLOCK_SHIFT);
+
+    KV_pool_update_inline(pool);
+    if (KV_page_map_set(block, block_size, pool) == -1)
+    {
+        fprintf(stderr, "KV_subpool_init: unable to add the pool to the page map\n");
+        KV_page_map_set(block, block_size, parent);
+        KV_buddy_free(parent, block, block_size);
+        if (KV_budget_enabled(parent))
+        {
+            KV_budget_update(parent, -(int64_t)block_size);
+        }
+        return NULL;
+    }
+    return pool;
+}
+
+void KV_subpool_free(struct KV_alloc_pool *pool)
+{
+    if (pool == NULL || pool->parent == NULL)
+    {
+        return;
+    }
+
+    struct KV_alloc_pool *parent = pool->parent;
+    uint64_t block_size = pool->parent_block_size;
+    char *block = pool->data;
+
+    KV_epoch_records_free(pool);
+    free(pool->tags);
+
+    // The struct is part of the block, so nothing of it is read past here
+    KV_page_map_set(block, block_size, parent);
+    KV_buddy_free(parent, block, block_size);
+    if (KV_budget_enabled(parent))
+    {
+        KV_budget_update(parent, -(int64_t)block_size);
+    }
+}
+
+#if ALLOC_HAVE_IO_URING
+// One iovec per buffer, so a buffer's index in the pool is also its fixed-buffer index for IORING_OP_{READ,WRITE}_FIXED
+static int KV_io_register(struct KV_alloc_pool *pool)
+{
+    struct iovec *iov = malloc(pool->io_num_buffers * sizeof(struct iovec));
+    if (iov == NULL)
+    {
+        fprintf(stderr, "KV_io_register: malloc: unable to allocate iovecs: %s\n", strerror(errno));
+        return -1;
+    }
+
+    for (uint32_t i = 0; i < pool->io_num_buffers; i++)
+    {
+        iov[i].iov_base = pool->data + i * pool->io_buffer_size;
+        iov[i].iov_len = pool->io_buffer_size;
+    }
+
+    int ret = syscall(__NR_io_uring_register, pool->io_ring_fd, IORING_REGISTER_BUFFERS, iov, pool->io_num_buffers);
+    if (ret == -1)
+    {
+        fprintf(stderr, "KV_io_register: io_uring_register: unable to register %u buffers: %s\n", (unsigned)pool->io_num_buffers, strerror(errno));
+    }
+    free(iov);
+    return ret;
+}
+#endif
+
+// Fixed-size, page-aligned buffers taking up the start of the pool, optionally registered once with ring_fd.
+// Allocating and freeing only moves an index on and off a stack; the registration is never touched again
+struct KV_alloc_pool *KV_io_pool_init(size_t buffer_size, size_t num_buffers, int ring_fd, bool allow_concurrent_access)
+{
+    buffer_size = ALIGN_TO_SIZE(buffer_size, ALIGN_MASK(IO_BUFFER_ALIGN));
+    if (buffer_size == 0 || num_buffers == 0 || num_buffers > IO_MAX_BUFFERS)
+    {
+        fprintf(stderr, "KV_io_pool_init: invalid buffers, size=%u num=%u\n", (unsigned)buffer_size, (unsigned)num_buffers);
+        return NULL;
+    }
+
+#if !ALLOC_HAVE_IO_URING
+    if (ring_fd >= 0)
+    {
+        fprintf(stderr, "KV_io_pool_init: io_uring is not supported on this platform\n");
+        return NULL;
+    }
+#endif
+
+    struct KV_alloc_pool *pool = KV_alloc_pool_init(buffer_size * num_buffers, allow_concurrent_access);
+    if (pool == NULL)
+    {
+        return NULL;
+    }
+
+    pool->io_free = malloc(num_buffers * sizeof(uint32_t));
+    pool->io_in_use = calloc((num_buffers + 63) / 64, sizeof(uint64_t));
+    if (pool->io_free == NULL || pool->io_in_use == NULL)
+    {
+        fprintf(stderr, "KV_io_pool_init: malloc: unable to allocate buffer indices: %s\n", strerror(errno));
+        free(pool->io_free);
+        free(pool->io_in_use);
+        pool->io_free = NULL; // io_lock is not initialised yet, so the pool must not look like an I/O pool
+        pool->io_in_use = NULL;
+        KV_alloc_pool_free(pool);
+        return NULL;
+    }
+
+    // Lowest index on top, so buffers are handed out in address order
+    for (size_t i = 0; i < num_buffers; i++)
+    {
+        pool->io_free[i] = num_buffers - 1 - i;
+    }
+    pool->io_buffer_size = buffer_size;
+    pool->io_num_buffers = pool->io_num_free = num_buffers;
+    *KV_pool_offset(pool) = pool->size; // Nothing is left for the bump path
+    mtx_init(&pool->io_lock, mtx_plain);
+    KV_pool_update_inline(pool);
+
+#if ALLOC_HAVE_IO_URING
+    if (ring_fd >= 0)
+    {
+        pool->io_ring_fd = ring_fd;
+        if (KV_io_register(pool) == -1)
+        {
+            pool->io_ring_fd = -1;
+            KV_alloc_pool_free(pool);
+            return NULL;
+        }
+    }
+#endif
+
+    return pool;
+}
+
+// Returns -1 for anything that is not the start of one of the pool's buffers
+int KV_io_buffer_index(struct KV_alloc_pool *pool, const void *ptr)
+{
+    if (pool->io_free == NULL || (const char *)ptr < pool->data)
+    {
+        return -1;
+    }
+
+    uint64_t offset = (const char *)ptr - pool->data;
+    if (offset % pool->io_buffer_size != 0 || offset / pool->io_buffer_size >= pool->io_num_buffers)
+    {
+        return -1;
+    }
+    return (int)(offset / pool->io_buffer_size);
+}
+
+// Buffer for an index reported back by the kernel
+void *KV_io_buffer(struct KV_alloc_pool *pool, int index)
+{
+    if (pool->io_free == NULL || index < 0 || (uint32_t)index >= pool->io_num_buffers)
+    {
+        return NULL;
+    }
+    return pool->data + index * pool->io_buffer_size;
+}
+
+static void *KV_io_buffer_get(struct KV_alloc_pool *pool, size_t size)
+{
+    if (size > pool->io_buffer_size)
+    {
+        fprintf(stderr, "KV_malloc: size=%u does not fit an I/O buffer of %u bytes\n", (unsigned)size, (unsigned)pool->io_buffer_size);
+        return NULL;
+    }
+
+    s_lock(pool, &pool->io_lock);
+    if (pool->io_num_free == 0)
+    {
+        s_unlock(pool, &pool->io_lock);
+        fprintf(stderr, "KV_malloc: all %u I/O buffers are in use\n", (unsigned)pool->io_num_buffers);
+        return NULL;
+    }
+    uint32_t index = pool->io_free[--pool->io_num_free];
+    pool->io_in_use[index / 64] |= 1ULL << (index % 64);
+    s_unlock(pool, &pool->io_lock);
+
+    return pool->data + index * pool->io_buffer_size;
+}
+
+static void KV_io_buffer_put(struct KV_alloc_pool *pool, void *ptr)
+{
+    int index = KV_io_buffer_index(pool, ptr);
+    if (index == -1)
+    {
+        fprintf(stderr, "KV_free: %p is not an I/O buffer of this pool\n", ptr);
+        return;
+    }
+
+    s_lock(pool, &pool->io_lock);
+    // A buffer that is not out, or a full stack, means a double free; pushing it would hand it out twice
+    if (!(pool->io_in_use[index / 64] & (1ULL << (index % 64))) || pool->io_num_free >= pool->io_num_buffers)
+    {
+        s_unlock(pool, &pool->io_lock);
+        fprintf(stderr, "KV_free: double free of I/O buffer %d at %p\n", index, ptr);
+        return;
+    }
+    pool->io_in_use[index / 64] &= ~(1ULL << (index % 64));
+    pool->io_free[pool->io_num_free++] = index;
+    s_unlock(pool, &pool->io_lock);
+}
+
+// Shared counters for tagged chunks, allocated by whichever thread tags one first
+static struct KV_tag_shard *KV_tag_shards(struct KV_alloc_pool *pool)
+{
+    struct KV_tag_shard *tags = __atomic_load_n(&pool->tags, __ATOMIC_ACQUIRE);
+    if (tags == NULL)
+    {
+        struct KV_tag_shard *expected = NULL;
+        tags = calloc(ALLOC_TAG_SHARDS, sizeof(struct KV_tag_shard));
+        if (tags == NULL)
+        {
+            fprintf(stderr, "KV_malloc_tagged: unable to allocate tag counters: %s\n", strerror(errno));
+            return NULL;
+        }
+
+        if (!__atomic_compare_exchange_n(&pool->tags, &expected, tags, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        {
+            free(tags);
+            tags = expected;
+        }
+    }
+    return tags;
+}
+
+// Only reached for chunks that carry a tag, so the counters exist
+static inline void KV_tag_account(struct KV_alloc_pool *pool, int tag, int64_t size, int64_t count)
+{
+    struct KV_tag_shard *tags = __atomic_load_n(&pool->tags, __ATOMIC_ACQUIRE);
+    if (tag_shard < 0)
+    {
+        tag_shard = __atomic_fetch_add(&next_tag_shard, 1, __ATOMIC_RELAXED) % ALLOC_TAG_SHARDS;
+    }
+    __atomic_fetch_add(&tags[tag_shard].bytes[tag], size, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&tags[tag_shard].count[tag], count, __ATOMIC_RELAXED);
+}
+
+// Requested size to chunk size, header included
+static inline size_t KV_chunk_size(size_t size)
+{
+    if (size <= (MIN_ALLOCATION_CLASS_SIZE - ALLOCATION_SIZE_OVERHEAD))
+    {
+        return MIN_ALLOCATION_CLASS_SIZE;
+    }
+    return ALIGN_TO_SIZE(size + ALLOCATION_SIZE_OVERHEAD, ALIGN_MASK(ALLOCATION_CLASSES_INCR_SIZE));
+}
+
+void *KV_malloc(struct KV_alloc_pool *pool, size_t size)
+{
+    char *alloc = NULL;
+
+    ALLOC_PROBE2(malloc, pool, size);
+
+    if (pool->io_free != NULL)
+    {
+        return KV_io_buffer_get(pool, size);
+    }
+
+    size = KV_chunk_size(size);
+
+    bool buddy = size > MAX_ALLOCATION_CLASS_SIZE && size <= BUDDY_MAX_BLOCK_SIZE && KV_buddy_enabled(pool);
+    if (buddy)
+    {
+        size = BUDDY_MIN_BLOCK_SIZE << KV_buddy_order(size); // Charged and recorded as the whole block
+    }
+
+    if (KV_budget_enabled(pool) && KV_budget_charge(pool, size) == -1)
+    {
+        return NULL;
+    }
+
+    if (buddy)
+    {
+        alloc = KV_buddy_allocate(pool, size);
+        if (alloc == NULL && KV_deferred_drain(pool) > 0)
+        {
+            alloc = KV_buddy_allocate(pool, size);
+        }
+
+        if (alloc)
+        {
+#if ALLOC_DEBUG_STATS
+            s_lock(pool, &stats->lock);
+            stats->num_allocs_in_use += 1;
+            stats->allocs_in_use_size += size;
+            s_unlock(pool, &stats->lock);
+#endif
+            return (void *)(alloc + ALLOCATION_SIZE_OVERHEAD);
+        }
+        // Pool is full; a mapping of its own still keeps the caller going
+    }
+
+    if (size > MAX_ALLOCATION_CLASS_SIZE && pool->parent != NULL)
+    {
+        // A child keeps to the block it was carved from
+        if (KV_budget_enabled(pool))
+        {
+            KV_budget_update(pool, -(int64_t)size);
+        }
+        return NULL;
+    }
+
+    if (size > MAX_ALLOCATION_CLASS_SIZE)
+    {
+        KV_deferred_drain(pool); // Already paying for a syscall; return queued mappings first
+
+        uint64_t start = KV_latency_start(pool);
+        alloc = KV_mmap_allocate(size, KV_mmap_flags(pool));
+        KV_latency_end(pool, LATENCY_MMAP, start);
+        ALLOC_PROBE3(large_mmap, pool, alloc, size);
+        if (alloc == NULL)
+        {
+            if (KV_budget_enabled(pool))
+            {
+                KV_budget_update(pool, -(int64_t)size);
+            }
+            fprintf(stderr, "KV_malloc: mmap_allocate: unable to allocate size= %u: %s\n", (unsigned)size, strerror(errno));
+            return NULL;
+        }
+        *(uint64_t *)alloc = size;
+        if (KV_page_map_set(alloc, size, pool) == -1)
+        {
+            // KV_free_any could never find it again
+            KV_page_map_set(alloc, size, NULL);
+            KV_mmap_deallocate(alloc, size);
+            if (KV_budget_enabled(pool))
+            {
+                KV_budget_update(pool, -(int64_t)size);
+            }
+            fprintf(stderr, "KV_malloc: unable to add size=%u to the page map\n", (unsigned)size);
+            return NULL;
+        }
+        __atomic_fetch_add(&pool->num_large_allocs, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&pool->large_allocs_size, size, __ATOMIC_RELAXED);
+#if ALLOC_DEBUG_STATS
+        s_lock(pool, &stats->lock);
+        stats->large_allocs_size += size;
+        stats->num_large_allocs += 1;
+        s_unlock(pool, &stats->lock);
+#endif
+        return (void *)(alloc + ALLOCATION_SIZE_OVERHEAD);
+    }
+
+    alloc = KV_percpu_pop(pool, size);
+    if (alloc == NULL)
+    {
+        alloc = KV_remove_from_freelist_head(pool, size);
+    }
+
+    if (alloc == NULL && KV_deferred_drain(pool) > 0)
+    {
+        // Deferred frees may have refilled this class
+        alloc = KV_percpu_pop(pool, size);
+        if (alloc == NULL)
+        {
+            alloc = KV_remove_from_freelist_head(pool, size);
+        }
+    }
+
+    if (alloc)
+    {
+        KV_compact_account(pool, alloc, size);
+#if ALLOC_DEBUG_STATS
+        s_lock(pool, &stats->lock);
+        stats->num_allocs_in_use += 1;
+        stats->allocs_in_use_size += size;
+        s_unlock(pool, &stats->lock);
+#endif
+        return (void *)(alloc + ALLOCATION_SIZE_OVERHEAD);
+    }
+
+    if (!pool)
+    {
+        fprintf(stderr, "KV_malloc: invalid memory pool");
+        return NULL;
+    }
+
+    if (!pool->data)
+    {
+        fprintf(stderr, "KV_malloc: invalid memory address");
+        return NULL;
+    }
+    alloc = KV_thread_bump_allocate(pool, size);
+    if (alloc == NULL)
+    {
+        if (KV_budget_enabled(pool))
+        {
+            KV_budget_update(pool, -(int64_t)size);
+        }
+        return NULL;
+    }
+
+    *(uint64_t *)alloc = size;
+    KV_compact_account(pool, alloc, size);
+#if ALLOC_DEBUG_STATS
+    s_lock(pool, &stats->lock);
+    stats->num_allocs += 1;
+    stats->num_allocs_in_use += 1;
+    stats->allocs_in_use_size += size;
+    s_unlock(pool, &stats->lock);
+#endif
+    return (void *)(alloc + ALLOCATION_SIZE_OVERHEAD);
+}
+
+void KV_free(struct KV_alloc_pool *pool, void *ptr)
+{
+    char *alloc_start = (char *)(ptr)-ALLOCATION_SIZE_OVERHEAD;
+    uint64_t size;
+
+    ALLOC_PROBE2(free, pool, ptr);
+    if (pool->io_free != NULL)
+    {
+        KV_io_buffer_put(pool, ptr); // Buffers have no header in front of them
+        return;
+    }
+
+    uint64_t header = *(uint64_t *)alloc_start;
+    size = header & ALLOC_SIZE_MASK;
+    if (header != size)
+    {
+        KV_tag_account(pool, (int)(header >> ALLOC_TAG_SHIFT), -(int64_t)size, -1);
+        *(uint64_t *)alloc_start = size; // Freelists and compaction expect a bare size
+    }
+
+    if (KV_budget_enabled(pool))
+    {
+        KV_budget_update(pool, -(int64_t)size);
+    }
+
+    if (size > MAX_ALLOCATION_CLASS_SIZE && KV_buddy_owns(pool, alloc_start))
+    {
+        KV_buddy_free(pool, alloc_start, size);
+#if ALLOC_DEBUG_STATS
+        s_lock(pool, &stats->lock);
+        stats->num_allocs_in_use -= 1;
+        stats->allocs_in_use_size -= size;
+        s_unlock(pool, &stats->lock);
+#endif
+    }
+    else if (size > MAX_ALLOCATION_CLASS_SIZE)
+    {
+        __atomic_fetch_sub(&pool->num_large_allocs, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_sub(&pool->large_allocs_size, size, __ATOMIC_RELAXED);
+#if ALLOC_DEBUG_STATS
+        s_lock(pool, &stats->lock);
+        stats->large_allocs_size -= size;
+        stats->num_large_allocs -= 1;
+        s_unlock(pool, &stats->lock);
+#endif
+        KV_page_map_set(alloc_start, size, NULL);
+
+        uint64_t start = KV_latency_start(pool);
+        KV_mmap_deallocate(alloc_start, size);
+        KV_latency_end(pool, LATENCY_MUNMAP, start);
+        ALLOC_PROBE3(large_munmap, pool, alloc_start, size);
+    }
+    else
+    {
+        KV_compact_account(pool, alloc_start, -(int64_t)size);
+        if (!KV_percpu_push(pool, alloc_start, size))
+        {
+            KV_add_to_freelist(pool, alloc_start, size);
+        }
+#if ALLOC_DEBUG_STATS
+        s_lock(pool, &stats->lock);
+        stats->num_allocs_in_use -= 1;
+        stats->allocs_in_use_size -= size;
+        s_unlock(pool, &stats->lock);
+#endif
+    }
+}
+
+// The tag rides in the chunk header, so KV_free needs nothing extra to credit it back
+void *KV_malloc_tagged(struct KV_alloc_pool *pool, size_t size, int tag)
+{
+    if (tag == 0)
+    {
+        return KV_malloc(pool, size);
+    }
+
+    if (tag < 0 || tag >= ALLOC_NUM_TAGS)
+    {
+        fprintf(stderr, "KV_malloc_tagged: tag=%d is out of range\n", tag);
+        return NULL;
+    }
+
+    // Counters live in this process only; a pool image outlives them
+    if (pool->io_free != NULL || pool->header != NULL)
+    {
+        fprintf(stderr, "KV_malloc_tagged: pool does not support tagged allocations\n");
+        return NULL;
+    }
+
+    if (KV_tag_shards(pool) == NULL)
+    {
+        return NULL;
+    }
+
+    char *ptr = (char *)KV_malloc(pool, size);
+    if (ptr != NULL)
+    {
+        uint64_t *header = (uint64_t *)(ptr - ALLOCATION_SIZE_OVERHEAD);
+        KV_tag_account(pool, tag, *header, 1);
+        *header |= (uint64_t)tag << ALLOC_TAG_SHIFT;
+    }
+    return ptr;
+}
+
+// Take the top of the bump region if it is within span of the hint
+static char *KV_bump_claim_near(struct KV_alloc_pool *pool, size_t size, const char *hint, size_t span)
+{
+    char *alloc = NULL;
+    if (KV_near(pool->data + __atomic_load_n(KV_pool_offset(pool), __ATOMIC_RELAXED), hint, span))
+    {
+        alloc = KV_bump_claim(pool, size);
+    }
+
+    if (alloc)
+    {
+        *(uint64_t *)alloc = size;
+    }
+    return alloc;
+}
+
+// Nodes of a linked structure allocated next to the node pointing at them share cache lines, pages and TLB
+// entries. Tries a free chunk on the hint's page, the bump region there, then the same two on its huge page;
+// anything else, or a hint outside the pool, is an ordinary KV_malloc
+void *KV_malloc_near(struct KV_alloc_pool *pool, size_t size, const void *hint)
+{
+    size_t chunk_size = KV_chunk_size(size);
+    char *alloc = NULL;
+
+    if (hint == NULL || pool->io_free != NULL || chunk_size > MAX_ALLOCATION_CLASS_SIZE ||
+        (const char *)hint < pool->data || (const char *)hint >= pool->data + pool->size)
+    {
+        return KV_malloc(pool, size);
+    }
+
+    if (KV_budget_enabled(pool) && KV_budget_charge(pool, chunk_size) == -1)
+    {
+        return NULL;
+    }
+
+    const size_t spans[] = {NEAR_PAGE_SIZE, NEAR_HUGE_PAGE_SIZE};
+    for (size_t i = 0; alloc == NULL && i < sizeof(spans) / sizeof(spans[0]); i++)
+    {
+        alloc = KV_remove_from_freelist_near(pool, chunk_size, hint, spans[i]);
+        if (alloc == NULL)
+        {
+            alloc = KV_bump_claim_near(pool, chunk_size, hint, spans[i]);
+        }
+    }
+
+    if (alloc == NULL)
+    {
+        if (KV_budget_enabled(pool))
+        {
+            KV_budget_update(pool, -(int64_t)chunk_size);
+        }
+        return KV_malloc(pool, size);
+    }
+
+    KV_compact_account(pool, alloc, chunk_size);
+#if ALLOC_DEBUG_STATS
+    s_lock(pool, &stats->lock);
+    stats->num_allocs_in_use += 1;
+    stats->allocs_in_use_size += chunk_size;
+    s_unlock(pool, &stats->lock);
+#endif
+    return (void *)(alloc + ALLOCATION_SIZE_OVERHEAD);
+}
+
+void KV_free_any(void *ptr)
+{
+    if (ptr == NULL)
+    {
+        return;
+    }
+
+    struct KV_alloc_pool *pool = KV_pool_of(ptr);
+    if (pool == NULL)
+    {
+        fprintf(stderr, "KV_free_any: %p does not belong to any pool\n", ptr);
+        return;
+    }
+    KV_free(pool, ptr);
+}
+
+// Handles are payload offsets from data in 8-byte units. They stay valid wherever a file or shared-memory
+// pool is mapped, and only cover class chunks and buddy blocks, not mmap'd large allocations
+uint32_t KV_ptr_to_handle(struct KV_alloc_pool *pool, const void *ptr)
+{
+    if (ptr == NULL || (const char *)ptr < pool->data || (const char *)ptr >= pool->data + pool->size)
+    {
+        return KV_HANDLE_NULL;
+    }
+
+    uint64_t offset = (const char *)ptr - pool->data;
+    if ((offset >> HANDLE_SHIFT) > UINT32_MAX || !IS_ALIGNED(offset, (1UL << HANDLE_SHIFT)))
+    {
+        return KV_HANDLE_NULL;
+    }
+    return (uint32_t)(offset >> HANDLE_SHIFT);
+}
+
+void *KV_handle_to_ptr(struct KV_alloc_pool *pool, uint32_t handle)
+{
+    if (handle == KV_HANDLE_NULL)
+    {
+        return NULL;
+    }
+    return pool->data + ((uint64_t)handle << HANDLE_SHIFT);
+}
+
+uint32_t KV_malloc_handle(struct KV_alloc_pool *pool, size_t size)
+{
+    // Buffer 0 sits at offset 0, which is KV_HANDLE_NULL; KV_io_buffer_index is the handle there
+    if (pool->io_free != NULL)
+    {
+        fprintf(stderr, "KV_malloc_handle: I/O buffer pools hand out buffer indices, not handles\n");
+        return KV_HANDLE_NULL;
+    }
+
+    if (KV_chunk_size(size) > (KV_buddy_enabled(pool) ? BUDDY_MAX_BLOCK_SIZE : MAX_ALLOCATION_CLASS_SIZE))
+    {
+        fprintf(stderr, "KV_malloc_handle: size=%u is served outside the pool and has no handle\n", (unsigned)size);
+        return KV_HANDLE_NULL;
+    }
+
+    void *ptr = KV_malloc(pool, size);
+    if (ptr == NULL)
+    {
+        return KV_HANDLE_NULL;
+    }
+
+    uint32_t handle = KV_ptr_to_handle(pool, ptr);
+    if (handle == KV_HANDLE_NULL)
+    {
+        fprintf(stderr, "KV_malloc_handle: %p is outside the pool or beyond the reach of a 32-bit handle\n", ptr);
+        KV_free(pool, ptr);
+    }
+    return handle;
+}
+
+void KV_free_handle(struct KV_alloc_pool *pool, uint32_t handle)
+{
+    if (handle != KV_HANDLE_NULL)
+    {
+        KV_free(pool, KV_handle_to_ptr(pool, handle));
+    }
+}
+
+// Returns the number of chunks freed
+// Also publishes what the calling thread still holds, since every slow path comes through here
+static size_t KV_deferred_drain(struct KV_alloc_pool *pool)
+{
+    size_t num_freed = 0;
+
+    KV_deferred_publish_own(pool);
+    if (__atomic_load_n(&pool->deferred, __ATOMIC_RELAXED) == NULL)
+    {
+        return 0;
+    }
+
+    char *chunk = __atomic_exchange_n(&pool->deferred, NULL, __ATOMIC_ACQUIRE);
+    while (chunk)
+    {
+        char *next = *(char **)(chunk + 8); // KV_free reuses the link words
+        KV_free(pool, chunk + ALLOCATION_SIZE_OVERHEAD);
+        chunk = next;
+        num_freed++;
+    }
+    return num_freed;
+}
+
+#if defined(__linux__)
+// Only a few stores on the calling thread; the batch is published once it holds DEFERRED_FREE_BATCH_SIZE
+// chunks, on the thread's next slow path, when it exits, or on KV_pool_flush_deferred. A chunk past the
+// classes publishes it at once: an idle thread must not keep a mapping or buddy block from the reclaimer
+void KV_free_deferred(struct KV_alloc_pool *pool, void *ptr)
+{
+    if (ptr == NULL)
+    {
+        return;
+    }
+
+    // No header to link through; putting a buffer back is a short critical section anyway
+    if (pool->io_free != NULL)
+    {
+        KV_io_buffer_put(pool, ptr);
+        return;
+    }
+
+    char *alloc_start = (char *)(ptr)-ALLOCATION_SIZE_OVERHEAD;
+    struct KV_thread_cache_entry *entry = KV_thread_cache_lookup(pool);
+
+    *(char **)(alloc_start + 8) = entry->deferred;
+    if (entry->deferred == NULL)
+    {
+        entry->deferred_tail = alloc_start;
+    }
+    entry->deferred = alloc_start;
+
+    if (++entry->deferred_count >= DEFERRED_FREE_BATCH_SIZE || (*(uint64_t *)alloc_start & ALLOC_SIZE_MASK) > MAX_ALLOCATION_CLASS_SIZE)
+    {
+        KV_deferred_publish(pool, entry);
+    }
+}
+
+// Publishes the calling thread's batch and frees everything queued so far. Other threads' partial
+// batches hold class chunks only and are seen on their next slow path or when they exit
+void KV_pool_flush_deferred(struct KV_alloc_pool *pool)
+{
+    KV_deferred_drain(pool);
+}
+
+// MADV_POPULATE_WRITE faults pages in without changing their contents, so it is safe while threads carve them
+static void KV_prefault_ahead(struct KV_alloc_pool *pool)
+{
+#ifdef MADV_POPULATE_WRITE
+    uint64_t offset = __atomic_load_n(KV_pool_offset(pool), __ATOMIC_RELAXED);
+    uint64_t target = ALIGN_TO_SIZE(offset + PREFAULT_AHEAD_SIZE, ALIGN_MASK(1UL << PAGE_MAP_PAGE_SHIFT));
+
+    if (target > pool->size)
+    {
+        target = pool->size;
+    }
+    if (pool->prefaulted < offset)
+    {
+        pool->prefaulted = offset & ~ALIGN_MASK(1UL << PAGE_MAP_PAGE_SHIFT); // Fell behind; the carved part is already faulted
+    }
+
+    while (pool->prefaulted < target && __atomic_load_n(&pool->background_running, __ATOMIC_RELAXED))
+    {
+        size_t len = target - pool->prefaulted < PREFAULT_STEP_SIZE ? target - pool->prefaulted : PREFAULT_STEP_SIZE;
+        if (madvise(pool->data + pool->prefaulted, len, MADV_POPULATE_WRITE) == -1)
+        {
+            fprintf(stderr, "KV_prefault_ahead: madvise: %s; prefaulting stopped\n", strerror(errno));
+            pool->prefault_ahead = false;
+            return;
+        }
+        pool->prefaulted += len;
+    }
+#else
+    pool->prefault_ahead = false;
+#endif
+}
+
+static void *KV_background_main(void *arg)
+{
+    struct KV_alloc_pool *pool = (struct KV_alloc_pool *)arg;
+    struct timespec deadline;
+
+    pthread_mutex_lock(&pool->background_lock);
+    while (pool->background_running)
+    {
+        pthread_mutex_unlock(&pool->background_lock);
+        KV_deferred_drain(pool);
+        if (pool->prefault_ahead)
+        {
+            KV_prefault_ahead(pool);
+        }
+        pthread_mutex_lock(&pool->background_lock);
+
+        // Publishers never signal, so they stay lock-free; the timeout paces the passes
+        uint64_t interval = __atomic_load_n(&ctl_reclaim_interval_ns, __ATOMIC_RELAXED);
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += interval / 1000000000UL;
+        deadline.tv_nsec += interval % 1000000000UL;
+        if (deadline.tv_nsec >= 1000000000L)
+        {
+            deadline.tv_sec += 1;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        if (pool->background_running)
+        {
+            pthread_cond_timedwait(&pool->background_cond, &pool->background_lock, &deadline);
+        }
+    }
+    pthread_mutex_unlock(&pool->background_lock);
+
+    return NULL;
+}
+
+int KV_pool_start_reclaimer(struct KV_alloc_pool *pool)
+{
+    if (!pool || !pool->allow_concurrent_allocs)
+    {
+        fprintf(stderr, "KV_pool_start_reclaimer: pool does not allow concurrent access\n");
+        return -1;
+    }
+
+    if (pool->background_running)
+    {
+        return 0;
+    }
+
+    pthread_mutex_init(&pool->background_lock, NULL);
+    pthread_cond_init(&pool->background_cond, NULL);
+    pool->background_running = true;
+
+    int err = pthread_create(&pool->background, NULL, KV_background_main, pool);
+    if (err != 0)
+    {
+        fprintf(stderr, "KV_pool_start_reclaimer: unable to start reclaimer thread: %s\n", strerror(err));
+        pool->background_running = false;
+        pthread_cond_destroy(&pool->background_cond);
+        pthread_mutex_destroy(&pool->background_lock);
+        return -1;
+    }
+    return 0;
+}
+
+void KV_pool_stop_reclaimer(struct KV_alloc_pool *pool)
+{
+    if (!pool || !pool->background_running)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&pool->background_lock);
+    __atomic_store_n(&pool->background_running, false, __ATOMIC_RELAXED);
+    pthread_cond_signal(&pool->background_cond);
+    pthread_mutex_unlock(&pool->background_lock);
+
+    pthread_join(pool->background, NULL);
+    pthread_cond_destroy(&pool->background_cond);
+    pthread_mutex_destroy(&pool->background_lock);
+}
+
+static struct KV_epoch_record *KV_epoch_record_get(struct KV_alloc_pool *pool)
+{
+    struct KV_thread_cache_entry *entry = KV_thread_cache_lookup(pool);
+    struct KV_epoch_record *record = NULL;
+
+    if (entry->epoch_record != NULL)
+    {
+        return entry->epoch_record;
+    }
+
+    // Adopt a record left behind by an exited thread, together with whatever it still had in limbo
+    for (record = __atomic_load_n(&pool->epoch_records, __ATOMIC_ACQUIRE); record; record = record->next)
+    {
+        bool in_use = false;
+        if (__atomic_compare_exchange_n(&record->in_use, &in_use, true, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        {
+            entry->epoch_record = record;
+            return record;
+        }
+    }
+
+    record = calloc(1, sizeof(struct KV_epoch_record));
+    if (record == NULL)
+    {
+        fprintf(stderr, "KV_epoch_record_get: unable to allocate epoch record: %s\n", strerror(errno));
+        return NULL;
+    }
+    record->in_use = true;
+
+    record->next = __atomic_load_n(&pool->epoch_records, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&pool->epoch_records, &record->next, record, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+    {
+    }
+
+    entry->epoch_record = record;
+    return record;
+}
+
+void KV_epoch_enter(struct KV_alloc_pool *pool)
+{
+    struct KV_epoch_record *record = KV_epoch_record_get(pool);
+    if (record == NULL || record->nesting++ > 0)
+    {
+        return;
+    }
+
+    // A full barrier: the announcement must be visible before any shared pointer is loaded
+    uint64_t epoch = __atomic_load_n(&pool->epoch, __ATOMIC_SEQ_CST);
+    __atomic_exchange_n(&record->state, (epoch << 1) | 1, __ATOMIC_SEQ_CST);
+}
+
+void KV_epoch_exit(struct KV_alloc_pool *pool)
+{
+    struct KV_epoch_record *record = KV_epoch_record_get(pool);
+    if (record == NULL || record->nesting == 0 || --record->nesting > 0)
+    {
+        return;
+    }
+    __atomic_store_n(&record->state, 0, __ATOMIC_RELEASE);
+}
+
+// Returns the current epoch after moving it forward if no active reader lags behind
+static uint64_t KV_epoch_try_advance(struct KV_alloc_pool *pool)
+{
+    uint64_t epoch = __atomic_load_n(&pool->epoch, __ATOMIC_SEQ_CST);
+
+    for (struct KV_epoch_record *record = __atomic_load_n(&pool->epoch_records, __ATOMIC_ACQUIRE); record; record = record->next)
+    {
+        uint64_t state = __atomic_load_n(&record->state, __ATOMIC_SEQ_CST);
+        if ((state & 1) && (state >> 1) != epoch)
+        {
+            return epoch;
+        }
+    }
+
+    if (__atomic_compare_exchange_n(&pool->epoch, &epoch, epoch + 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+    {
+        return epoch + 1;
+    }
+    return epoch; // Someone else advanced it
+}
+
+static size_t KV_epoch_free_bucket(struct KV_alloc_pool *pool, struct KV_epoch_record *record, int bucket)
+{
+    char *chunk = record->limbo[bucket];
+    size_t num_freed = 0;
+
+    record->limbo[bucket] = NULL;
+    while (chunk)
+    {
+        char *next = *(char **)(chunk + 8);
+        KV_free(pool, chunk + ALLOCATION_SIZE_OVERHEAD);
+        chunk = next;
+        num_freed++;
+    }
+    return num_freed;
+}
+
+// Buckets retired two epochs ago can no longer be reached by any reader
+static size_t KV_epoch_collect(struct KV_alloc_pool *pool, struct KV_epoch_record *record, uint64_t epoch)
+{
+    size_t num_freed = 0;
+
+    for (int i = 0; i < EPOCH_NUM_BUCKETS; i++)
+    {
+        if (record->limbo[i] != NULL && record->limbo_epoch[i] + 2 <= epoch)
+        {
+            num_freed += KV_epoch_free_bucket(pool, record, i);
+        }
+    }
+    return num_freed;
+}
+
+void KV_retire(struct KV_alloc_pool *pool, void *ptr)
+{
+    if (ptr == NULL)
+    {
+        return;
+    }
+
+    if (pool->io_free != NULL)
+    {
+        fprintf(stderr, "KV_retire: I/O buffers have no header to queue %p by; it stays allocated\n", ptr);
+        return;
+    }
+
+    struct KV_epoch_record *record = KV_epoch_record_get(pool);
+    if (record == NULL)
+    {
+        return; // Leaked rather than freed under a reader
+    }
+
+    char *alloc_start = (char *)(ptr)-ALLOCATION_SIZE_OVERHEAD;
+    uint64_t epoch = __atomic_load_n(&pool->epoch, __ATOMIC_ACQUIRE);
+    int bucket = epoch % EPOCH_NUM_BUCKETS;
+
+    if (record->limbo_epoch[bucket] != epoch)
+    {
+        // Whatever is left in the bucket was retired at least three epochs ago
+        KV_epoch_free_bucket(pool, record, bucket);
+        record->limbo_epoch[bucket] = epoch;
+    }
+
+    *(char **)(alloc_start + 8) = record->limbo[bucket];
+    record->limbo[bucket] = alloc_start;
+
+    if (++record->retired_since_scan >= EPOCH_RETIRE_SCAN_INTERVAL)
+    {
+        record->retired_since_scan = 0;
+        KV_epoch_collect(pool, record, KV_epoch_try_advance(pool));
+    }
+}
+
+size_t KV_epoch_reclaim(struct KV_alloc_pool *pool)
+{
+    struct KV_epoch_record *record = KV_epoch_record_get(pool);
+    if (record == NULL)
+    {
+        return 0;
+    }
+
+    record->retired_since_scan = 0;
+    return KV_epoch_collect(pool, record, KV_epoch_try_advance(pool));
+}
+
+// No reader may be left when the pool goes away, so everything in limbo is freed
+static void KV_epoch_records_free(struct KV_alloc_pool *pool)
+{
+    struct KV_epoch_record *record = pool->epoch_records;
+    while (record)
+    {
+        struct KV_epoch_record *next = record->next;
+        for (int i = 0; i < EPOCH_NUM_BUCKETS; i++)
+        {
+            KV_epoch_free_bucket(pool, record, i);
+        }
+        free(record);
+        record = next;
+    }
+    pool->epoch_records = NULL;
+
+    for (int i = 0; i < THREAD_CACHE_NUM_POOLS; i++)
+    {
+        if (thread_cache.entries[i].pool == pool && thread_cache.entries[i].pool_id == pool->id)
+        {
+            thread_cache.entries[i].epoch_record = NULL;
+        }
+    }
+}
+#else
+void KV_free_deferred(struct KV_alloc_pool *pool, void *ptr)
+{
+    if (ptr != NULL)
+    {
+        KV_free(pool, ptr);
+    }
+}
+
+void KV_pool_flush_deferred(struct KV_alloc_pool *pool)
+{
+    KV_deferred_drain(pool);
+}
+
+int KV_pool_start_reclaimer(struct KV_alloc_pool *pool ALLOC_UNUSED)
+{
+    fprintf(stderr, "KV_pool_start_reclaimer: background reclaim is not supported on this platform\n");
+    return -1;
+}
+
+void KV_pool_stop_reclaimer(struct KV_alloc_pool *pool ALLOC_UNUSED) {}
+
+void KV_epoch_enter(struct KV_alloc_pool *pool ALLOC_UNUSED) {}
+void KV_epoch_exit(struct KV_alloc_pool *pool ALLOC_UNUSED) {}
+
+void KV_retire(struct KV_alloc_pool *pool ALLOC_UNUSED, void *ptr)
+{
+    // Without per-thread records there is no way to tell when readers are done; leak rather than free early
+    fprintf(stderr, "KV_retire: epoch reclamation is not supported on this platform: %p\n", ptr);
+}
+
+size_t KV_epoch_reclaim(struct KV_alloc_pool *pool ALLOC_UNUSED)
+{
+    return 0;
+}
+
+static void KV_epoch_records_free(struct KV_alloc_pool *pool ALLOC_UNUSED) {}
+#endif
+
+// Carve count chunks for requests of size into their class freelist, so first use finds them there
+// instead of on the bump path. Writing the headers faults the pages in as well
+int KV_pool_reserve(struct KV_alloc_pool *pool, size_t size, size_t count)
+{
+    if (!pool || !pool->data)
+    {
+        fprintf(stderr, "KV_pool_reserve: invalid memory pool");
+        return -1;
+    }
+
+    size_t chunk_size = KV_chunk_size(size);
+    if (KV_get_freelist_alloc_class(chunk_size) < 0)
+    {
+        fprintf(stderr, "KV_pool_reserve: size=%u is not served from a freelist class\n", (unsigned)size);
+        return -1;
+    }
+
+    if (count == 0)
+    {
+        return 0;
+    }
+
+    // Checked before multiplying, so a huge count cannot wrap chunk_size * count into a small claim
+    if (count > pool->size / chunk_size)
+    {
+        fprintf(stderr, "KV_pool_reserve: %u chunks of size=%u do not fit in the pool\n", (unsigned)count, (unsigned)chunk_size);
+        return -1;
+    }
+
+    if (pool->compact_used != NULL)
+    {
+        // One claim at a time, so none of the chunks crosses a compaction region
+        for (size_t i = 0; i < count; i++)
+        {
+            char *chunk = KV_bump_claim(pool, chunk_size);
+            if (chunk == NULL)
+            {
+                fprintf(stderr, "KV_pool_reserve: %u chunks of size=%u do not fit in the pool\n", (unsigned)count, (unsigned)chunk_size);
+                return -1;
+            }
+            *(uint64_t *)chunk = chunk_size;
+            KV_add_to_freelist(pool, chunk, chunk_size);
+        }
+        return 0;
+    }
+
+    char *start = KV_bump_claim(pool, chunk_size * count);
+    if (start == NULL)
+    {
+        fprintf(stderr, "KV_pool_reserve: %u chunks of size=%u do not fit in the pool\n", (unsigned)count, (unsigned)chunk_size);
+        return -1;
+    }
+
+    // Pushed from the top down so the lowest address is handed out first
+    for (size_t i = count; i > 0; i--)
+    {
+        char *chunk = start + (i - 1) * chunk_size;
+        *(uint64_t *)chunk = chunk_size;
+        KV_add_to_freelist(pool, chunk, chunk_size);
+    }
+    return 0;
+}
+
+int KV_pool_set_relocate(struct KV_alloc_pool *pool, KV_relocate_fn fn, void *arg)
+{
+    if (!pool || !pool->data)
+    {
+        fprintf(stderr, "KV_pool_set_relocate: invalid memory pool");
+        return -1;
+    }
+
+    if (pool->compact_used == NULL)
+    {
+        fprintf(stderr, "KV_pool_set_relocate: pool was not created with ALLOC_POOL_COMPACTABLE\n");
+        return -1;
+    }
+
+    pool->compact_arg = arg;
+    pool->compact_relocate = fn;
+    return 0;
+}
+
+static void KV_compact_lock_all(struct KV_alloc_pool *pool)
+{
+    for (int i = 0; i < MAX_FREELIST_NUM_CLASSES; i++)
+    {
+        alloc_lock(pool, i);
+    }
+}
+
+static void KV_compact_unlock_all(struct KV_alloc_pool *pool)
+{
+    for (int i = MAX_FREELIST_NUM_CLASSES - 1; i >= 0; i--)
+    {
+        alloc_unlock(pool, i);
+    }
+}
+
+// Caller holds every class lock. Takes the class's chunks in evacuating regions off its list and marks
+// them, keeping the order of the rest; with region_free it only adds up free bytes per region
+static void KV_compact_scan_class(struct KV_alloc_pool *pool, int alloc_class, uint32_t *region_free)
+{
+    struct KV_alloc_freelist *alloc_freelist = pool->alloc_freelist;
+    size_t chunk_size = MIN_ALLOCATION_CLASS_SIZE + (alloc_class * ALLOCATION_CLASSES_INCR_SIZE);
+    bool doubly_linked = chunk_size > MAX_ALLOCATION_OVERHEAD;
+    size_t next_link = doubly_linked ? 16 : 8;
+    char *chunk = KV_link_decode(pool, alloc_freelist->freelist[alloc_class]);
+    char *tail = NULL;
+
+    if (region_free != NULL)
+    {
+        for (; chunk; chunk = KV_link_decode(pool, *(char **)(chunk + next_link)))
+        {
+            region_free[KV_compact_region(pool, chunk)] += chunk_size;
+        }
+        return;
+    }
+
+    alloc_freelist->freelist[alloc_class] = NULL;
+    while (chunk)
+    {
+        char *next = KV_link_decode(pool, *(char **)(chunk + next_link));
+        if (pool->compact_state[KV_compact_region(pool, chunk)] == COMPACT_REGION_EVACUATING)
+        {
+            *(uint64_t *)chunk |= COMPACT_FREE_MARK;
+            alloc_freelist->count[alloc_class] -= 1;
+            KV_near_map_update(pool, chunk, false);
+        }
+        else
+        {
+            if (doubly_linked)
+            {
+                *(char **)(chunk + 8) = KV_link_encode(pool, tail);
+            }
+            *(char **)(chunk + next_link) = NULL;
+            if (tail)
+            {
+                *(char **)(tail + next_link) = KV_link_encode(pool, chunk);
+            }
+            else
+            {
+                alloc_freelist->freelist[alloc_class] = KV_link_encode(pool, chunk);
+            }
+            tail = chunk;
+        }
+        chunk = next;
+    }
+}
+
+// Copy every live chunk of the region out and offer the move to the relocation callback.
+// Returns the number of chunks that stay behind
+static size_t KV_compact_evacuate(struct KV_alloc_pool *pool, char *region)
+{
+    size_t num_pinned = 0;
+
+    for (char *chunk = region; chunk < region + COMPACT_REGION_SIZE;)
+    {
+        uint64_t header = *(uint64_t *)chunk;
+        uint64_t size = header & ALLOC_SIZE_MASK;
+        assert(size >= ALLOCATION_SIZE_OVERHEAD && size <= MAX_ALLOCATION_CLASS_SIZE);
+
+        if (!(header & COMPACT_FREE_MARK) && size > ALLOCATION_SIZE_OVERHEAD)
+        {
+            size_t payload = size - ALLOCATION_SIZE_OVERHEAD;
+            char *copy = KV_malloc_tagged(pool, payload, (int)(header >> ALLOC_TAG_SHIFT)); // Keeps the tag
+            if (copy == NULL)
+            {
+                num_pinned++;
+            }
+            else
+            {
+                memcpy(copy, chunk + ALLOCATION_SIZE_OVERHEAD, payload);
+                if (pool->compact_relocate(pool, chunk + ALLOCATION_SIZE_OVERHEAD, copy, payload, pool->compact_arg) == 0)
+                {
+                    KV_free(pool, chunk + ALLOCATION_SIZE_OVERHEAD); // Lands marked, the region is still evacuating
+                }
+                else
+                {
+                    KV_free(pool, copy);
+                    num_pinned++;
+                }
+            }
+        }
+        chunk += size;
+    }
+    return num_pinned;
+}
+
+// Caller holds every class lock. Puts the marked free chunks of a region that could not be emptied back
+static void KV_compact_restore(struct KV_alloc_pool *pool, char *region)
+{
+    for (char *chunk = region; chunk < region + COMPACT_REGION_SIZE;)
+    {
+        uint64_t header = *(uint64_t *)chunk;
+        uint64_t size = header & ALLOC_SIZE_MASK; // A pinned tagged chunk keeps its tag bits
+        if (header & COMPACT_FREE_MARK)
+        {
+            int alloc_class = KV_get_freelist_alloc_class(size);
+            assert(alloc_class >= 0 && alloc_class < MAX_FREELIST_NUM_CLASSES);
+            *(uint64_t *)chunk = size;
+            KV_freelist_push_locked(pool, chunk, size, alloc_class);
+        }
+        chunk += size;
+    }
+}
+
+static void KV_compact_release(struct KV_alloc_pool *pool, char *region)
+{
+    KV_pages_release(pool, region, COMPACT_REGION_SIZE);
+    KV_buddy_free(pool, region, COMPACT_REGION_SIZE);
+}
+
+// Empty up to max_regions (0 for no limit) regions that are at most 1/COMPACT_MAX_LIVE_FRACTION live
+// and hand them to the buddy tier. Class locks are only held while regions are picked and settled; the
+// callback runs without them. Returns the number of bytes released
+size_t KV_pool_compact(struct KV_alloc_pool *pool, size_t max_regions)
+{
+    size_t num_regions, num_candidates = 0, released = 0;
+    uint32_t *region_free = NULL;
+    size_t *candidates = NULL, *pinned = NULL;
+
+    if (!pool || !pool->data)
+    {
+        fprintf(stderr, "KV_pool_compact: invalid memory pool");
+        return 0;
+    }
+
+    if (pool->compact_used == NULL || pool->compact_relocate == NULL)
+    {
+        return 0;
+    }
+
+    if (__atomic_exchange_n(&pool->compacting, true, __ATOMIC_ACQUIRE))
+    {
+        return 0; // Someone else is already at it
+    }
+
+    KV_deferred_drain(pool); // Queued chunks still look live
+
+    num_regions = __atomic_load_n(KV_pool_offset(pool), __ATOMIC_ACQUIRE) / COMPACT_REGION_SIZE;
+    if (num_regions > pool->size / COMPACT_REGION_SIZE)
+    {
+        num_regions = pool->size / COMPACT_REGION_SIZE;
+    }
+    region_free = calloc(num_regions + 1, sizeof(uint32_t));
+    candidates = calloc(num_regions + 1, sizeof(size_t));
+    pinned = calloc(num_regions + 1, sizeof(size_t));
+    if (region_free == NULL || candidates == NULL || pinned == NULL)
+    {
+        fprintf(stderr, "KV_pool_compact: calloc: %s\n", strerror(errno));
+        goto out;
+    }
+
+    KV_compact_lock_all(pool);
+    for (int i = 0; i < MAX_FREELIST_NUM_CLASSES; i++)
+    {
+        KV_compact_scan_class(pool, i, region_free);
+    }
+
+    // A region whose live and free bytes do not add up has a chunk in flight or holds memory that is not
+    // class chunks (buddy blocks, object pool slabs); either way it is left alone
+    for (size_t r = 0; r < num_regions && (max_regions == 0 || num_candidates < max_regions); r++)
+    {
+        uint32_t used = __atomic_load_n(&pool->compact_used[r], __ATOMIC_RELAXED);
+        if (pool->compact_state[r] == 0 && region_free[r] > 0 && used + region_free[r] == COMPACT_REGION_SIZE &&
+            used <= COMPACT_REGION_SIZE / COMPACT_MAX_LIVE_FRACTION)
+        {
+            pool->compact_state[r] = COMPACT_REGION_EVACUATING;
+            candidates[num_candidates++] = r;
+        }
+    }
+
+    if (num_candidates > 0)
+    {
+        for (int i = 0; i < MAX_FREELIST_NUM_CLASSES; i++)
+        {
+            KV_compact_scan_class(pool, i, NULL);
+        }
+    }
+    KV_compact_unlock_all(pool);
+
+    for (size_t i = 0; i < num_candidates; i++)
+    {
+        pinned[i] = KV_compact_evacuate(pool, pool->data + candidates[i] * COMPACT_REGION_SIZE);
+    }
+
+    KV_compact_lock_all(pool);
+    for (size_t i = 0; i < num_candidates; i++)
+    {
+        size_t r = candidates[i];
+        if (pinned[i] == 0)
+        {
+            __atomic_store_n(&pool->compact_used[r], 0, __ATOMIC_RELAXED);
+        }
+        else
+        {
+            KV_compact_restore(pool, pool->data + r * COMPACT_REGION_SIZE);
+        }
+        pool->compact_state[r] = 0;
+    }
+    KV_compact_unlock_all(pool);
+
+    // Emptied regions are out of every freelist and below the bump offset, so nothing else can reach them
+    for (size_t i = 0; i < num_candidates; i++)
+    {
+        if (pinned[i] == 0)
+        {
+            KV_compact_release(pool, pool->data + candidates[i] * COMPACT_REGION_SIZE);
+            released += COMPACT_REGION_SIZE;
+        }
+    }
+
+out:
+    free(region_free);
+    free(candidates);
+    free(pinned);
+    __atomic_store_n(&pool->compacting, false, __ATOMIC_RELEASE);
+    return released;
+}
+
+// Bytes carved off the pool and not on a freelist, plus mapped large chunks. The unused tails of other
+// threads' bump chunks count as live, so the estimate errs high
+static int64_t KV_pool_live_bytes(struct KV_alloc_pool *pool)
+{
+    struct KV_pool_report report;
+
+#if defined(__linux__)
+    // The caller's own tail goes back first, and its stale share of the old usage is dropped
+    struct KV_thread_cache_entry *entry = KV_thread_cache_lookup(pool);
+    KV_thread_bump_retire(pool, entry);
+    entry->budget_delta = 0;
+#endif
+    KV_pool_report(pool, &report);
+    return (int64_t)(report.bump_used - report.free_bytes - report.buddy_free_bytes + report.large_allocs_size);
+}
+
+// Frees are only credited while a budget is set, so switching one on seeds usage with what is live right now
+// instead of starting from zero. Chunks other threads allocate or free during the switch may be miscounted
+int KV_pool_set_budget(struct KV_alloc_pool *pool, uint64_t soft_limit, uint64_t hard_limit)
+{
+    if (!pool)
+    {
+        fprintf(stderr, "KV_pool_set_budget: invalid memory pool");
+        return -1;
+    }
+
+    if (hard_limit != 0 && soft_limit > hard_limit)
+    {
+        fprintf(stderr, "KV_pool_set_budget: soft limit %llu is above hard limit %llu\n", (unsigned long long)soft_limit, (unsigned long long)hard_limit);
+        return -1;
+    }
+
+    if (!KV_budget_enabled(pool) && (soft_limit != 0 || hard_limit != 0))
+    {
+        __atomic_store_n(&pool->budget_usage, KV_pool_live_bytes(pool), __ATOMIC_RELAXED);
+        __atomic_store_n(&pool->budget_pressure, false, __ATOMIC_RELAXED);
+    }
+
+    uint64_t limit = soft_limit ? soft_limit : hard_limit;
+    pool->budget_soft = soft_limit;
+    pool->budget_hard = hard_limit;
+    KV_pool_update_inline(pool);
+    // Keep the per-thread slack small next to the limit itself
+    pool->budget_batch = (limit != 0 && (int64_t)(limit / 64) < BUDGET_ACCOUNTING_BATCH) ? (int64_t)(limit / 64) + 1 : BUDGET_ACCOUNTING_BATCH;
+    return 0;
+}
+
+int KV_pool_add_pressure_callback(struct KV_alloc_pool *pool, KV_pressure_fn fn, void *arg)
+{
+    if (pool->num_budget_callbacks >= BUDGET_MAX_CALLBACKS)
+    {
+        fprintf(stderr, "KV_pool_add_pressure_callback: at most %d callbacks per pool\n", BUDGET_MAX_CALLBACKS);
+        return -1;
+    }
+
+    pool->budget_callbacks[pool->num_budget_callbacks].fn = fn;
+    pool->budget_callbacks[pool->num_budget_callbacks].arg = arg;
+    pool->num_budget_callbacks++;
+    return 0;
+}
+
+// Exact for the calling thread; other threads may hold up to budget_batch bytes each that are not counted yet
+uint64_t KV_pool_usage(struct KV_alloc_pool *pool)
+{
+    int64_t usage = KV_budget_projected(pool, 0);
+    return usage < 0 ? 0 : (uint64_t)usage;
+}
+
+int KV_pool_report(struct KV_alloc_pool *pool, struct KV_pool_report *report)
+{
+    if (!pool || !pool->data)
+    {
+        fprintf(stderr, "KV_pool_report: invalid memory pool");
+        return -1;
+    }
+
+    memset(report, 0, sizeof(struct KV_pool_report));
+    report->size = pool->size;
+    report->bump_used = __atomic_load_n(KV_pool_offset(pool), __ATOMIC_ACQUIRE);
+    if (report->bump_used > report->size)
+    {
+        report->bump_used = report->size;
+    }
+    report->bump_free = report->size - report->bump_used;
+    report->largest_free = report->bump_free;
+    report->num_large_allocs = __atomic_load_n(&pool->num_large_allocs, __ATOMIC_RELAXED);
+    report->large_allocs_size = __atomic_load_n(&pool->large_allocs_size, __ATOMIC_RELAXED);
+
+    // Counts are kept up to date on every push and pop, so each class lock is held for one read
+    for (int i = 0; i < MAX_FREELIST_NUM_CLASSES; i++)
+    {
+        struct KV_pool_class_report *class_report = &report->classes[i];
+        class_report->chunk_size = MIN_ALLOCATION_CLASS_SIZE + (i * ALLOCATION_CLASSES_INCR_SIZE);
+
+        alloc_lock(pool, i);
+        class_report->free_count = pool->alloc_freelist->count[i];
+        alloc_unlock(pool, i);
+
+        for (int cpu = 0; cpu < pool->num_cpus && pool->percpu; cpu++)
+        {
+            class_report->free_count += __atomic_load_n(&pool->percpu[cpu].classes[i].count, __ATOMIC_RELAXED);
+        }
+
+        class_report->free_bytes = class_report->free_count * class_report->chunk_size;
+        report->free_count += class_report->free_count;
+        report->free_bytes += class_report->free_bytes;
+        if (class_report->free_count > 0 && class_report->chunk_size > report->largest_free)
+        {
+            report->largest_free = class_report->chunk_size;
+        }
+    }
+
+    s_lock(pool, &pool->buddy_lock);
+    for (int order = 0; order < BUDDY_NUM_ORDERS; order++)
+    {
+        uint64_t block_size = BUDDY_MIN_BLOCK_SIZE << order;
+        report->buddy_free_count += pool->buddy_count[order];
+        report->buddy_free_bytes += pool->buddy_count[order] * block_size;
+        if (pool->buddy_count[order] > 0 && block_size > report->largest_free)
+        {
+            report->largest_free = block_size;
+        }
+    }
+    s_unlock(pool, &pool->buddy_lock);
+
+    struct KV_tag_shard *tags = __atomic_load_n(&pool->tags, __ATOMIC_ACQUIRE);
+    for (int tag = 1; tag < ALLOC_NUM_TAGS && tags; tag++)
+    {
+        int64_t count = 0, bytes = 0;
+        for (int shard = 0; shard < ALLOC_TAG_SHARDS; shard++)
+        {
+            count += __atomic_load_n(&tags[shard].count[tag], __ATOMIC_RELAXED);
+            bytes += __atomic_load_n(&tags[shard].bytes[tag], __ATOMIC_RELAXED);
+        }
+        report->tags[tag].live_count = count > 0 ? count : 0;
+        report->tags[tag].live_bytes = bytes > 0 ? bytes : 0;
+    }
+
+    struct KV_latency_histogram *latency = __atomic_load_n(&pool->latency, __ATOMIC_ACQUIRE);
+    for (int kind = 0; kind < LATENCY_NUM_KINDS && latency; kind++)
+    {
+        struct KV_latency_histogram *hist = &latency[kind];
+        report->latency[kind].count = __atomic_load_n(&hist->count, __ATOMIC_RELAXED);
+        report->latency[kind].total_ns = __atomic_load_n(&hist->total_ns, __ATOMIC_RELAXED);
+        report->latency[kind].max_ns = __atomic_load_n(&hist->max_ns, __ATOMIC_RELAXED);
+        for (int i = 0; i < LATENCY_HIST_BUCKETS; i++)
+        {
+            report->latency[kind].buckets[i] = __atomic_load_n(&hist->buckets[i], __ATOMIC_RELAXED);
+        }
+    }
+
+    report->bump_utilization = report->size ? (double)report->bump_used / report->size : 0;
+    uint64_t free_total = report->free_bytes + report->buddy_free_bytes + report->bump_free;
+    if (free_total > 0)
+    {
+        report->fragmentation = 1.0 - ((double)report->largest_free / free_total);
+    }
+
+    return 0;
+}
+
+int KV_pool_walk(struct KV_alloc_pool *pool, KV_pool_walk_fn fn, void *arg)
+{
+    uint64_t offset;
+    int ret = 0;
+
+    if (!pool || !pool->data)
+    {
+        fprintf(stderr, "KV_pool_walk: invalid memory pool");
+        return -1;
+    }
+
+    // One class at a time, then the buddy tier; callbacks must not allocate from or free into what is being walked
+    for (int i = 0; i < MAX_FREELIST_NUM_CLASSES && ret == 0; i++)
+    {
+        size_t chunk_size = MIN_ALLOCATION_CLASS_SIZE + (i * ALLOCATION_CLASSES_INCR_SIZE);
+        size_t next_link = chunk_size <= MAX_ALLOCATION_OVERHEAD ? 8 : 16;
+
+        alloc_lock(pool, i);
+        char *chunk = KV_link_decode(pool, pool->alloc_freelist->freelist[i]);
+        while (chunk && ret == 0)
+        {
+            ret = fn(chunk, chunk_size, i, arg);
+            chunk = KV_link_decode(pool, *(char **)(chunk + next_link));
+        }
+        alloc_unlock(pool, i);
+    }
+
+    s_lock(pool, &pool->buddy_lock);
+    for (int order = 0; order < BUDDY_NUM_ORDERS && ret == 0; order++)
+    {
+        for (char *block = pool->buddy_free[order]; block && ret == 0; block = *(char **)(block + 16))
+        {
+            ret = fn(block, BUDDY_MIN_BLOCK_SIZE << order, -2, arg);
+        }
+    }
+    s_unlock(pool, &pool->buddy_lock);
+
+    offset = __atomic_load_n(KV_pool_offset(pool), __ATOMIC_ACQUIRE);
+    if (ret == 0 && offset < pool->size)
+    {
+        ret = fn(pool->data + offset, pool->size - offset, -1, arg);
+    }
+
+    return ret;
+}
+
+// Pools are named by id. The pool must not be freed while a call on it runs, as with every other pool call
+static struct KV_alloc_pool *KV_ctl_pool(uint64_t id ALLOC_UNUSED)
+{
+    struct KV_alloc_pool *found = NULL;
+#if defined(__linux__)
+    call_once(&pool_list_once, KV_pool_list_init);
+    mtx_lock(&pool_list_lock);
+    for (struct KV_alloc_pool *pool = pool_list; pool && found == NULL; pool = pool->next)
+    {
+        found = pool->id == id ? pool : NULL;
+    }
+    mtx_unlock(&pool_list_lock);
+#endif
+    return found;
+}
+
+// Everything a pool can give back without help from its users: queued frees, retired objects whose epoch has
+// passed, sparse regions when it is compactable, and all pages but the first of every free buddy block
+static size_t KV_pool_purge(struct KV_alloc_pool *pool)
+{
+    size_t released = 0;
+
+    KV_pool_flush_deferred(pool);
+    if (__atomic_load_n(&pool->epoch_records, __ATOMIC_ACQUIRE) != NULL)
+    {
+        KV_epoch_reclaim(pool);
+    }
+    released += KV_pool_compact(pool, 0);
+
+    s_lock(pool, &pool->buddy_lock);
+    for (int order = 1; order < BUDDY_NUM_ORDERS; order++)
+    {
+        size_t tail_size = (BUDDY_MIN_BLOCK_SIZE << order) - BUDDY_MIN_BLOCK_SIZE; // The first page holds the links
+        for (char *block = pool->buddy_free[order]; block; block = *(char **)(block + 16))
+        {
+            KV_pages_release(pool, block + BUDDY_MIN_BLOCK_SIZE, tail_size);
+            released += tail_size;
+        }
+    }
+    s_unlock(pool, &pool->buddy_lock);
+    return released;
+}
+
+#define CTL_VOID 0 // Action; oldp and newp are ignored
+#define CTL_BOOL 1
+#define CTL_INT 2
+#define CTL_UINT64 3
+#define CTL_REPORT 4 // struct KV_pool_report
+
+struct KV_ctl_entry
+{
+    const char *name;
+    int type;
+    bool writable;
+    // Reads into val when write is false, applies val otherwise
+    int (*fn)(struct KV_alloc_pool *pool, void *val, bool write);
+};
+
+static int KV_ctl_pool_flags(struct KV_alloc_pool *pool ALLOC_UNUSED, void *val, bool write)
+{
+    if (write)
+    {
+        __atomic_store_n(&ctl_pool_flags, *(int *)val, __ATOMIC_RELAXED);
+    }
+    else
+    {
+        *(int *)val = __atomic_load_n(&ctl_pool_flags, __ATOMIC_RELAXED);
+    }
+    return 0;
+}
+
+static int KV_ctl_reclaim_interval(struct KV_alloc_pool *pool ALLOC_UNUSED, void *val, bool write)
+{
+    if (write)
+    {
+        if (*(uint64_t *)val == 0)
+        {
+            return -1;
+        }
+        __atomic_store_n(&ctl_reclaim_interval_ns, *(uint64_t *)val, __ATOMIC_RELAXED);
+    }
+    else
+    {
+        *(uint64_t *)val = __atomic_load_n(&ctl_reclaim_interval_ns, __ATOMIC_RELAXED);
+    }
+    return 0;
+}
+
+// Bump chunk tails, deferred batches and budget charges the calling thread holds for any pool
+static int KV_ctl_thread_flush(struct KV_alloc_pool *pool ALLOC_UNUSED, void *val ALLOC_UNUSED, bool write ALLOC_UNUSED)
+{
+#if defined(__linux__)
+    for (int i = 0; i < THREAD_CACHE_NUM_POOLS; i++)
+    {
+        if (thread_cache.entries[i].epoch_record == NULL || thread_cache.entries[i].epoch_record->nesting == 0)
+        {
+            KV_thread_cache_evict(&thread_cache.entries[i]);
+        }
+    }
+#endif
+    return 0;
+}
+
+static int KV_ctl_num_pools(struct KV_alloc_pool *pool ALLOC_UNUSED, void *val, bool write ALLOC_UNUSED)
+{
+    uint64_t num_pools = 0;
+#if defined(__linux__)
+    call_once(&pool_list_once, KV_pool_list_init);
+    mtx_lock(&pool_list_lock);
+    for (struct KV_alloc_pool *curr = pool_list; curr; curr = curr->next)
+    {
+        num_pools++;
+    }
+    mtx_unlock(&pool_list_lock);
+#endif
+    *(uint64_t *)val = num_pools;
+    return 0;
+}
+
+static int KV_ctl_report(struct KV_alloc_pool *pool, void *val, bool write ALLOC_UNUSED)
+{
+    return KV_pool_report(pool, (struct KV_pool_report *)val);
+}
+
+static int KV_ctl_usage(struct KV_alloc_pool *pool, void *val, bool write ALLOC_UNUSED)
+{
+    *(uint64_t *)val = KV_pool_usage(pool);
+    return 0;
+}
+
+static int KV_ctl_purge(struct KV_alloc_pool *pool, void *val, bool write ALLOC_UNUSED)
+{
+    size_t released = KV_pool_purge(pool);
+    if (val != NULL)
+    {
+        *(uint64_t *)val = released;
+    }
+    return 0;
+}
+
+static int KV_ctl_budget_soft(struct KV_alloc_pool *pool, void *val, bool write)
+{
+    if (write)
+    {
+        return KV_pool_set_budget(pool, *(uint64_t *)val, pool->budget_hard);
+    }
+    *(uint64_t *)val = pool->budget_soft;
+    return 0;
+}
+
+static int KV_ctl_budget_hard(struct KV_alloc_pool *pool, void *val, bool write)
+{
+    if (write)
+    {
+        return KV_pool_set_budget(pool, pool->budget_soft, *(uint64_t *)val);
+    }
+    *(uint64_t *)val = pool->budget_hard;
+    return 0;
+}
+
+// Histograms are allocated the first time timing is switched on and kept until the pool is freed
+static int KV_ctl_latency(struct KV_alloc_pool *pool, void *val, bool write)
+{
+    if (!write)
+    {
+        *(bool *)val = KV_latency_on(pool);
+        return 0;
+    }
+
+#if defined(__linux__)
+    if (*(bool *)val && __atomic_load_n(&pool->latency, __ATOMIC_ACQUIRE) == NULL)
+    {
+        struct KV_latency_histogram *expected = NULL;
+        struct KV_latency_histogram *latency = calloc(LATENCY_NUM_KINDS, sizeof(struct KV_latency_histogram));
+        if (latency == NULL)
+        {
+            fprintf(stderr, "KV_alloc_ctl: unable to allocate latency histograms: %s\n", strerror(errno));
+            return -1;
+        }
+
+        if (!__atomic_compare_exchange_n(&pool->latency, &expected, latency, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        {
+            free(latency);
+        }
+    }
+    __atomic_store_n(&pool->latency_paused, !*(bool *)val, __ATOMIC_RELAXED);
+    return 0;
+#else
+    return *(bool *)val ? -1 : 0;
+#endif
+}
+
+#if defined(__linux__)
+static int KV_ctl_reclaimer(struct KV_alloc_pool *pool, void *val, bool write)
+{
+    if (!write)
+    {
+        *(bool *)val = pool->background_running;
+        return 0;
+    }
+
+    if (*(bool *)val)
+    {
+        return KV_pool_start_reclaimer(pool);
+    }
+    KV_pool_stop_reclaimer(pool);
+    return 0;
+}
+#endif
+
+static const struct KV_ctl_entry ctl_entries[] = {
+    {"opt.pool_flags", CTL_INT, true, KV_ctl_pool_flags},
+    {"opt.reclaim_interval_ns", CTL_UINT64, true, KV_ctl_reclaim_interval},
+    {"thread.flush", CTL_VOID, true, KV_ctl_thread_flush},
+    {"stats.pools", CTL_UINT64, false, KV_ctl_num_pools},
+};
+
+// Looked up after a "pool.<id>." prefix
+static const struct KV_ctl_entry ctl_pool_entries[] = {
+    {"report", CTL_REPORT, false, KV_ctl_report},
+    {"usage", CTL_UINT64, false, KV_ctl_usage},
+    {"purge", CTL_VOID, true, KV_ctl_purge},
+    {"budget.soft", CTL_UINT64, true, KV_ctl_budget_soft},
+    {"budget.hard", CTL_UINT64, true, KV_ctl_budget_hard},
+    {"latency", CTL_BOOL, true, KV_ctl_latency},
+#if defined(__linux__)
+    {"reclaimer", CTL_BOOL, true, KV_ctl_reclaimer},
+#endif
+};
+
+static const struct KV_ctl_entry *KV_ctl_find(const struct KV_ctl_entry *entries, size_t num_entries, const char *name)
+{
+    for (size_t i = 0; i < num_entries; i++)
+    {
+        if (strcmp(entries[i].name, name) == 0)
+        {
+            return &entries[i];
+        }
+    }
+    return NULL;
+}
+
+// Reads the current value into oldp and then applies newp; either may be NULL. The type behind both follows
+// from the name, see ctl_entries. Actions take neither, except that pool.<id>.purge reports the bytes it
+// released into oldp. Returns 0 on success and -1 for unknown names, read-only names given newp and
+// values that are rejected
+int KV_alloc_ctl(const char *name, void *oldp, void *newp)
+{
+    const struct KV_ctl_entry *entry = NULL;
+    struct KV_alloc_pool *pool = NULL;
+
+    if (name == NULL)
+    {
+        fprintf(stderr, "KV_alloc_ctl: no name given\n");
+        return -1;
+    }
+
+    if (strncmp(name, "pool.", 5) == 0)
+    {
+        char *end = NULL;
+        uint64_t id = strtoull(name + 5, &end, 10);
+        if (end == name + 5 || *end != '.' || (pool = KV_ctl_pool(id)) == NULL)
+        {
+            fprintf(stderr, "KV_alloc_ctl: %s: no such pool\n", name);
+            return -1;
+        }
+        entry = KV_ctl_find(ctl_pool_entries, sizeof(ctl_pool_entries) / sizeof(ctl_pool_entries[0]), end + 1);
+    }
+    else
+    {
+        entry = KV_ctl_find(ctl_entries, sizeof(ctl_entries) / sizeof(ctl_entries[0]), name);
+    }
+
+    if (entry == NULL)
+    {
+        fprintf(stderr, "KV_alloc_ctl: %s: unknown name\n", name);
+        return -1;
+    }
+
+    if (entry->type == CTL_VOID)
+    {
+        return entry->fn(pool, oldp, true);
+    }
+
+    if (newp != NULL && !entry->writable)
+    {
+        fprintf(stderr, "KV_alloc_ctl: %s is read-only\n", name);
+        return -1;
+    }
+
+    // Taken before the old value is read, so oldp and newp may point at the same variable
+    union
+    {
+        bool b;
+        int i;
+        uint64_t u;
+    } new_value;
+    if (newp != NULL)
+    {
+        memcpy(&new_value, newp, entry->type == CTL_BOOL ? sizeof(bool) : entry->type == CTL_INT ? sizeof(int) : sizeof(uint64_t));
+    }
+
+    if (oldp != NULL && entry->fn(pool, oldp, false) == -1)
+    {
+        return -1;
+    }
+
+    if (newp != NULL && entry->fn(pool, &new_value, true) == -1)
+    {
+        fprintf(stderr, "KV_alloc_ctl: %s: value rejected\n", name);
+        return -1;
+    }
+    return 0;
+}
+
+// Only names that exist before any pool does make sense here; values are integers, 0/1 for booleans
+static void KV_alloc_ctl_apply(const char *name, const char *value)
+{
+    const struct KV_ctl_entry *entry = KV_ctl_find(ctl_entries, sizeof(ctl_entries) / sizeof(ctl_entries[0]), name);
+    char *end = NULL;
+    uint64_t num = strtoull(value, &end, 0);
+
+    if (entry == NULL || !entry->writable || end == value || *end != '\0')
+    {
+        fprintf(stderr, "KV_alloc_ctl: %s: ignoring %s:%s\n", ALLOC_CTL_ENV, name, value);
+        return;
+    }
+
+    int int_value = (int)num;
+    bool bool_value = num != 0;
+    switch (entry->type)
+    {
+    case CTL_VOID:
+        KV_alloc_ctl(name, NULL, NULL);
+        break;
+    case CTL_BOOL:
+        KV_alloc_ctl(name, NULL, &bool_value);
+        break;
+    case CTL_INT:
+        KV_alloc_ctl(name, NULL, &int_value);
+        break;
+    default:
+        KV_alloc_ctl(name, NULL, &num);
+        break;
+    }
+}
+
+__attribute__((constructor)) static void KV_alloc_ctl_env(void)
+{
+    const char *conf = getenv(ALLOC_CTL_ENV);
+    char name[ALLOC_CTL_NAME_MAX];
+
+    while (conf != NULL && *conf != '\0')
+    {
+        size_t len = strcspn(conf, ",");
+        const char *sep = memchr(conf, ':', len);
+        if (sep != NULL && (size_t)(sep - conf) < sizeof(name) && len - (sep - conf) < sizeof(name))
+        {
+            char value[ALLOC_CTL_NAME_MAX];
+            memcpy(name, conf, sep - conf);
+            name[sep - conf] = '\0';
+            memcpy(value, sep + 1, len - (sep - conf) - 1);
+            value[len - (sep - conf) - 1] = '\0';
+            KV_alloc_ctl_apply(name, value);
+        }
+        else if (len > 0)
+        {
+            fprintf(stderr, "KV_alloc_ctl: %s: ignoring malformed entry\n", ALLOC_CTL_ENV);
+        }
+        conf += len + (conf[len] == ',');
+    }
+}
+
+struct KV_object_pool *KV_object_pool_init(struct KV_alloc_pool *parent, size_t obj_size, size_t align)
+{
+    struct KV_object_pool *opool = NULL;
+
+    if (!parent || !parent->data)
+    {
+        fprintf(stderr, "KV_object_pool_init: invalid memory pool");
+        return NULL;
+    }
+
+    if (align < sizeof(char *))
+    {
+        align = sizeof(char *);
+    }
+
+    if (!IS_ALIGNED(align, align))
+    {
+        fprintf(stderr, "KV_object_pool_init: alignment must be a power of 2, align=%u\n", (unsigned)align);
+        return NULL;
+    }
+
+    opool = malloc(sizeof(struct KV_object_pool));
+    if (opool == NULL)
+    {
+        fprintf(stderr, "KV_object_pool_init: malloc: unable to allocate object pool: %s\n", strerror(errno));
+        return NULL;
+    }
+
+    // Every object must be able to hold the free list link and keep its successor aligned
+    if (obj_size < sizeof(char *))
+    {
+        obj_size = sizeof(char *);
+    }
+    opool->obj_size = ALIGN_TO_SIZE(obj_size, ALIGN_MASK(align));
+    opool->align = align;
+    opool->slab_size = opool->obj_size > OBJECT_POOL_SLAB_SIZE ? opool->obj_size : OBJECT_POOL_SLAB_SIZE;
+    opool->free_list = NULL;
+    opool->slab = opool->slab_end = NULL;
+    opool->parent = parent;
+    opool->next = NULL;
+    mtx_init(&opool->lock, mtx_plain);
+    KV_object_pool_register(opool);
+
+    return opool;
+}
+
+void KV_object_pool_free(struct KV_object_pool *opool)
+{
+    // Slabs stay carved in the parent pool until the parent itself is freed
+    if (opool != NULL)
+    {
+        KV_object_pool_unregister(opool);
+        mtx_destroy(&opool->lock);
+        free(opool);
+    }
+}
+
+static int KV_object_pool_refill(struct KV_object_pool *opool)
+{
+    // Over-carve by the alignment so the first object can be aligned; the parent only guarantees 8 bytes
+    size_t carve_size = opool->slab_size + (opool->align > ALLOCATION_CLASSES_INCR_SIZE ? opool->align : 0);
+    char *slab = KV_bump_allocate(opool->parent, carve_size);
+    if (slab == NULL)
+    {
+        return -1;
+    }
+
+    opool->slab = (char *)ALIGN_TO_SIZE((uintptr_t)slab, ALIGN_MASK((uintptr_t)opool->align));
+    opool->slab_end = slab + carve_size;
+    return 0;
+}
+
+void *KV_object_alloc(struct KV_object_pool *opool)
+{
+    char *obj = NULL;
+
+    s_lock(opool->parent, &opool->lock);
+    obj = opool->free_list;
+    if (obj)
+    {
+        opool->free_list = *(char **)obj;
+        s_unlock(opool->parent, &opool->lock);
+        return (void *)obj;
+    }
+
+    if ((size_t)(opool->slab_end - opool->slab) < opool->obj_size)
+    {
+        if (KV_object_pool_refill(opool) == -1)
+        {
+            s_unlock(opool->parent, &opool->lock);
+            fprintf(stderr, "KV_object_alloc: unable to carve slab for object size=%u\n", (unsigned)opool->obj_size);
+            return NULL;
+        }
+    }
+
+    obj = opool->slab;
+    opool->slab += opool->obj_size;
+    s_unlock(opool->parent, &opool->lock);
+
+    return (void *)obj;
+}
+
+void KV_object_free(struct KV_object_pool *opool, void *ptr)
+{
+    if (ptr == NULL)
+    {
+        return;
+    }
+
+    s_lock(opool->parent, &opool->lock);
+    *(char **)ptr = opool->free_list;
+    opool->free_list = (char *)ptr;
+    s_unlock(opool->parent, &opool->lock);
 }
@@ -8,40 +8,253 @@
 
 #include "threading.h"
 
+#if defined(__linux__)
+#include <pthread.h>
+#endif
+
 #define MAX_FREELIST_NUM_CLASSES (int)32
 #define MAX_ALLOCATION_POOL_SIZE (1UL) << (64)
 #define MIN_ALLOCATION_POOL_SIZE ((1UL) << (20)) // 1MB
 #define MAX_ALLOCATION_OVERHEAD (int)16
-#define MAX_ALLOCATION_POOLS_NUM (int)10
 #define ALLOCATION_CLASSES_INCR_SIZE (int)8
 #define MIN_ALLOCATION_CLASS_SIZE (int)16
+#define MAX_ALLOCATION_CLASS_SIZE (MIN_ALLOCATION_CLASS_SIZE + (ALLOCATION_CLASSES_INCR_SIZE * (MAX_FREELIST_NUM_CLASSES - 1)))
 #define ALLOCATION_SIZE_OVERHEAD (uint64_t)8
+#define PAGE_MAP_PAGE_SHIFT (int)12 // Granularity of the address-to-pool map
+#define PAGE_MAP_LEVEL_BITS (int)12 // Three levels cover a 48-bit address space
+#define PAGE_MAP_LEVEL_SIZE ((1UL) << (PAGE_MAP_LEVEL_BITS))
+#define POOL_HEADER_MAGIC (uint64_t)0x314b4f4c4c41564b // "KVALLOK1"
+#define POOL_LAYOUT_VERSION (uint32_t)4
+#define POOL_HEADER_SIZE ((1UL) << (12)) // Data of a file-backed pool starts one page into the file
+#define POOL_HEADER_DIRTY 0x1 // Set while a process has the pool open
+#define POOL_HEADER_SHARED 0x2 // Shared-memory pool; classes are guarded by process-shared locks
+#define POOL_SHM_OPEN_RETRIES (int)100000
+#define THREAD_CACHE_NUM_POOLS (int)8 // Pools a thread keeps a bump chunk for at the same time
+#define THREAD_BUMP_CHUNK_SIZE ((1UL) << (14)) // 16KB claimed from a shared pool offset per CAS
+#define PERCPU_CACHE_SLOTS (int)32 // Chunks each CPU caches per class before spilling to the shared freelist
+#define PERCPU_RSEQ_RETRIES (int)8
+#define DEFERRED_FREE_BATCH_SIZE (int)64 // Chunks a thread collects before publishing them to the pool with one CAS
+#define DEFERRED_RECLAIM_INTERVAL_NS (long)1000000 // 1ms between background thread passes
+#define PREFAULT_AHEAD_SIZE ((1UL) << (22)) // 4MB kept populated past the bump offset
+#define PREFAULT_STEP_SIZE ((1UL) << (20)) // Populated per madvise call so a stop request is not held up
+#define EPOCH_NUM_BUCKETS (int)3 // Retired chunks are safe to free two epochs after they were retired
+#define EPOCH_RETIRE_SCAN_INTERVAL (int)64 // Retires between attempts to advance the pool epoch
+#define BUDGET_ACCOUNTING_BATCH (int64_t)65536 // Bytes a thread may charge or credit before folding them into the pool
+#define BUDGET_MAX_CALLBACKS (int)4
+#define LATENCY_HIST_BUCKETS (int)32 // Bucket i counts waits of [2^i, 2^(i+1)) nanoseconds
+#define LATENCY_LOCK_WAIT 0 // Waiting for a contended class lock
+#define LATENCY_MMAP 1      // Mapping a large allocation
+#define LATENCY_MUNMAP 2
+#define LATENCY_NUM_KINDS 3
+#define HANDLE_SHIFT (int)3 // Chunks are 8-byte aligned, so a 32-bit handle reaches 32GB into the pool
+#define KV_HANDLE_NULL (uint32_t)0 // The first payload starts 8 bytes in, so no live handle is 0
+#define OBJECT_POOL_SLAB_SIZE ((1UL) << (16)) // 64KB carved from the parent pool per refill
+#define BUDDY_MIN_BLOCK_SHIFT (int)12 // Smallest buddy block is one 4KB page
+#define BUDDY_MIN_BLOCK_SIZE ((1UL) << (BUDDY_MIN_BLOCK_SHIFT))
+#define BUDDY_NUM_ORDERS (int)10 // 4KB .. 2MB, header included
+#define BUDDY_MAX_BLOCK_SIZE (BUDDY_MIN_BLOCK_SIZE << (BUDDY_NUM_ORDERS - 1))
+#define BUDDY_GROW_POOL_FRACTION (int)8 // Blocks claimed from the bump region are at most 1/8 of the pool, so small pools keep room for the classes
+#define BUDDY_BLOCK_FREE 0x80 // Page map entry of the first page of a free block, or'ed with its order
+#define IO_BUFFER_ALIGN ((1UL) << (12)) // I/O buffers are whole pages so they can be used with O_DIRECT
+#define IO_MAX_BUFFERS (int)16384 // io_uring's limit on registered buffers
+#define COMPACT_REGION_SIZE ((1UL) << (16)) // Unit of compaction; class chunks of a compactable pool never cross one
+#define COMPACT_MAX_LIVE_FRACTION (int)4 // Regions at most 1/4 live are evacuated
+#define COMPACT_REGION_EVACUATING 0x1
+#define COMPACT_FREE_MARK ((uint64_t)1 << 63) // Header bit of a free chunk compaction took off its freelist
+#define ALLOC_TAG_SHIFT (int)48 // Header bits above the size hold the tag of a KV_malloc_tagged chunk
+#define ALLOC_SIZE_MASK (((uint64_t)1 << ALLOC_TAG_SHIFT) - 1)
+#define ALLOC_NUM_TAGS (int)64 // Tag 0 is untagged and not counted
+#define ALLOC_TAG_SHARDS (int)16 // Threads spread their tag counter updates over this many cache lines
+#define ALLOC_CTL_ENV "KV_ALLOC_CONF" // "name:value,..." written through KV_alloc_ctl when the library is loaded
+#define ALLOC_CTL_NAME_MAX (int)128
+#define NEAR_SCAN_LIMIT (int)64 // Freelist chunks KV_malloc_near looks at for one close to its hint
+#define NEAR_PAGE_SIZE ((1UL) << (12))
+#define NEAR_HUGE_PAGE_SIZE ((1UL) << (21)) // One TLB entry when the pool is backed by transparent huge pages
 
 #define ALLOC_UNUSED __attribute__((unused))
 
+#define ALLOC_POOL_PRIVATE 0x1 // MAP_PRIVATE; a fork()ed child gets a copy-on-write snapshot of the pool
+#define ALLOC_POOL_PERCPU 0x2  // Per-CPU class caches updated with rseq; uses the class locks when rseq is unavailable
+#define ALLOC_POOL_LATENCY 0x4 // Time slow paths into the histograms of KV_pool_report (Linux only)
+#define ALLOC_POOL_PREFAULT 0x8 // Populate the whole pool at init with MAP_POPULATE (Linux only)
+#define ALLOC_POOL_PREFAULT_AHEAD 0x10 // Background thread keeps PREFAULT_AHEAD_SIZE past the bump offset populated (Linux only)
+#define ALLOC_POOL_COMPACTABLE 0x20 // Track live bytes per region for KV_pool_compact; no thread bump chunks or per-CPU caches
+#define ALLOC_POOL_NEAR 0x40 // Map free chunks by address so KV_malloc_near finds any on the hint's page; no inline fast path
+
 #define CONCURRENT_ACCESS 1
 
 #define ALLOC_DEBUG_VERBOSE 0
 #define ALLOC_DEBUG_STATS 0
 
+// Plain data only, so it can be stored in a pool header; the class locks are in struct KV_alloc_pool
 struct KV_alloc_freelist
 {
     char *freelist[MAX_FREELIST_NUM_CLASSES];
-    mtx_t lock[MAX_FREELIST_NUM_CLASSES];
+    uint64_t count[MAX_FREELIST_NUM_CLASSES]; // Chunks in each class; maintained under the class lock
+};
+
+// First page of a file-backed or shared-memory pool. Pointers in here and in freelist chunks are stored as
+// (offset from data + 1) so the image stays valid wherever the file is mapped next time
+struct KV_pool_header
+{
+    uint64_t magic;
+    uint32_t version;
+    uint32_t flags;
+    uint32_t header_size; // sizeof(struct KV_pool_header) and sizeof(pthread_mutex_t) of the build that wrote it;
+    uint32_t lock_size;   // shared_lock follows libc's ABI, which the layout version does not cover
+    uint64_t size; // Size of the data region following the header page
+    uint64_t offset;
+    uint64_t root; // Entry point into the structures kept in the pool
+    struct KV_alloc_freelist alloc_freelist;
+#if defined(__linux__)
+    pthread_mutex_t shared_lock[MAX_FREELIST_NUM_CLASSES];
+#endif
+};
+
+struct KV_percpu_cache;
+struct KV_epoch_record;
+struct KV_tag_shard;
+struct KV_alloc_pool;
+
+// old_ptr has been copied to new_ptr. Return 0 once every reference points at new_ptr, and old_ptr is freed;
+// anything else keeps the object where it is. Objects the store no longer references, such as ones queued with
+// KV_retire or KV_free_deferred, must be refused
+typedef int (*KV_relocate_fn)(struct KV_alloc_pool *pool, void *old_ptr, void *new_ptr, size_t size, void *arg);
+
+// Runs on the allocating thread that pushed usage past the soft limit, or that is about to hit the hard limit.
+// It may free into the pool; allocations made from it are not budget checked again
+typedef void (*KV_pressure_fn)(struct KV_alloc_pool *pool, uint64_t usage, uint64_t soft_limit, void *arg);
+
+struct KV_latency_histogram
+{
+    uint64_t count;
+    uint64_t total_ns;
+    uint64_t max_ns;
+    uint64_t buckets[LATENCY_HIST_BUCKETS];
+};
+
+struct KV_pressure_callback
+{
+    KV_pressure_fn fn;
+    void *arg;
 };
 
 struct KV_alloc_pool
 {
     bool allow_concurrent_allocs;
+    bool process_shared; // Lives in shared memory mapped by other processes
+    bool inline_fast_path; // alloc_inline.h may pop and push the class freelists without calling in
+    int flags;
+    uint64_t id; // Unique for the life of the process; tells a reused pool address apart
     uint64_t offset;
     uint64_t size;
     char *data; // Base address of memory
+    struct KV_pool_header *header; // NULL unless the pool is backed by a file or shared memory
     struct alloc_stats *stats;
     struct KV_alloc_freelist *alloc_freelist;
-    // struct KV_alloc_pool *prev;
-    // struct KV_alloc_pool *next;
+    struct KV_percpu_cache *percpu; // One per possible CPU; NULL unless ALLOC_POOL_PERCPU and rseq is available
+    int num_cpus;
+    struct KV_latency_histogram *latency; // LATENCY_NUM_KINDS histograms; NULL unless ALLOC_POOL_LATENCY
+    bool latency_paused; // Timing switched off through KV_alloc_ctl; the histograms keep what they have
+    struct KV_tag_shard *tags; // ALLOC_TAG_SHARDS sets of per-tag counters; allocated on the first tagged allocation
+    uint64_t *near_map; // ALLOC_POOL_NEAR: bit per 8 bytes of data, set at the start of every chunk on a class freelist
+    struct KV_alloc_pool *parent; // Set for a pool from KV_subpool_init, which lives in a buddy block of its parent
+    uint64_t parent_block_size;
+    uint64_t num_large_allocs; // Live mmap'd allocations; updated atomically
+    uint64_t large_allocs_size;
+    struct KV_object_pool *object_pools; // Carved from this pool; quiesced with it across fork()
+    char *deferred; // Chunks published by KV_free_deferred, chained through their payload; drained with one exchange
+    uint64_t budget_soft; // 0 when unset
+    uint64_t budget_hard;
+    int64_t budget_batch;
+    int64_t budget_usage; // Live bytes handed out by KV_malloc, less what threads have not folded in yet
+    bool budget_pressure; // Above the soft limit since the callbacks last ran
+    struct KV_pressure_callback budget_callbacks[BUDGET_MAX_CALLBACKS];
+    int num_budget_callbacks;
+    char *buddy_free[BUDDY_NUM_ORDERS]; // Free blocks of BUDDY_MIN_BLOCK_SIZE << order; linked like the classes
+    uint64_t buddy_count[BUDDY_NUM_ORDERS];
+    uint8_t *buddy_map; // One entry per page of data; allocated on the first buddy allocation
+    mtx_t buddy_lock;
+    mtx_t class_lock[MAX_FREELIST_NUM_CLASSES]; // Guards alloc_freelist; process memory even when the heads are in a header
+    uint64_t io_buffer_size; // Non-zero for a pool from KV_io_pool_init; every KV_malloc hands out one whole buffer
+    uint32_t io_num_buffers;
+    uint32_t io_num_free;
+    uint32_t *io_free; // Stack of free buffer indices; NULL unless this is an I/O buffer pool
+    uint64_t *io_in_use; // One bit per buffer handed out, so a second free is caught before it reaches the stack
+    int io_ring_fd; // io_uring the buffers are registered with as fixed buffers; -1 if none
+    mtx_t io_lock;
+    uint32_t *compact_used; // Per region: bytes of live chunks and fillers starting in it; NULL unless ALLOC_POOL_COMPACTABLE
+    uint8_t *compact_state;
+    KV_relocate_fn compact_relocate;
+    void *compact_arg;
+    bool compacting;
+    uint64_t epoch; // Advanced once every reader inside an epoch section has observed the current value
+    struct KV_epoch_record *epoch_records; // One per thread that used the epoch API; reused after the thread exits
+#if defined(__linux__)
+    bool prefault_ahead;
+    uint64_t prefaulted; // Populated up to here; only the background thread touches it
+    bool background_running;
+    pthread_t background; // Drains deferred frees and prefaults ahead of the bump offset
+    pthread_mutex_t background_lock;
+    pthread_cond_t background_cond;
+#endif
+    struct KV_alloc_pool *prev;
+    struct KV_alloc_pool *next;
 };
 
+// Fixed-size objects with no header. Free objects are chained through their first word.
+// Must be freed before its parent pool, and objects only go back through KV_object_free
+struct KV_object_pool
+{
+    size_t obj_size;
+    size_t align;
+    size_t slab_size;
+    char *free_list;
+    char *slab; // Next uncarved object in the current slab
+    char *slab_end;
+    struct KV_alloc_pool *parent;
+    struct KV_object_pool *next; // Sibling carved from the same parent
+    mtx_t lock;
+};
+
+struct KV_pool_class_report
+{
+    uint64_t chunk_size;
+    uint64_t free_count;
+    uint64_t free_bytes;
+};
+
+struct KV_pool_tag_report
+{
+    uint64_t live_count; // Allocations made with the tag and not freed yet
+    uint64_t live_bytes; // Chunk sizes, header included, as charged against a budget
+};
+
+// Snapshot of how pool memory is split. Each class is read under its own lock, so the
+// report is not atomic across classes while other threads keep allocating
+struct KV_pool_report
+{
+    uint64_t size;
+    uint64_t bump_used; // Carved off the bump region: in use, on a freelist or held by a thread's bump chunk
+    uint64_t bump_free;
+    uint64_t free_count; // All freelist classes
+    uint64_t free_bytes;
+    uint64_t buddy_free_count; // Free blocks of the page-granular tier
+    uint64_t buddy_free_bytes;
+    uint64_t largest_free; // Largest chunk that could be handed out without growing the pool
+    uint64_t num_large_allocs;
+    uint64_t large_allocs_size;
+    double bump_utilization; // bump_used / size
+    double fragmentation;    // 1 - largest_free / (free_bytes + buddy_free_bytes + bump_free); 0 when nothing is free
+    struct KV_pool_class_report classes[MAX_FREELIST_NUM_CLASSES];
+    struct KV_latency_histogram latency[LATENCY_NUM_KINDS]; // All zero unless the pool was created with ALLOC_POOL_LATENCY
+    struct KV_pool_tag_report tags[ALLOC_NUM_TAGS]; // Shards are summed one after another, so a moving tag may be off briefly
+};
+
+// Return non-zero to stop the walk. alloc_class is -1 for the unused bump region and -2 for a free buddy block.
+// Chunks sitting in per-CPU caches are counted by KV_pool_report but not walked
+typedef int (*KV_pool_walk_fn)(const char *start, size_t size, int alloc_class, void *arg);
+
 struct alloc_stats
 {
     int32_t fr_hits; // freelist only allocations
@@ -57,10 +270,52 @@ struct alloc_stats
 };
 
 struct KV_alloc_pool *KV_alloc_pool_init(size_t size, bool allow_concurrent_access);
+struct KV_alloc_pool *KV_alloc_pool_init_flags(size_t size, bool allow_concurrent_access, int flags);
 void KV_alloc_pool_free(struct KV_alloc_pool *pool);
+struct KV_alloc_pool *KV_subpool_init(struct KV_alloc_pool *parent, size_t size);
+void KV_subpool_free(struct KV_alloc_pool *pool);
+struct KV_alloc_pool *KV_io_pool_init(size_t buffer_size, size_t num_buffers, int ring_fd, bool allow_concurrent_access);
+int KV_io_buffer_index(struct KV_alloc_pool *pool, const void *ptr);
+void *KV_io_buffer(struct KV_alloc_pool *pool, int index);
+// The file stays MAP_SHARED: a fork()ed child sees the parent's pool, not a snapshot, and must not use it
+struct KV_alloc_pool *KV_alloc_pool_open(const char *path, size_t size, bool allow_concurrent_access);
+struct KV_alloc_pool *KV_alloc_pool_shm_open(const char *name, size_t size);
+int KV_alloc_pool_shm_unlink(const char *name);
+int KV_alloc_pool_sync(struct KV_alloc_pool *pool);
+void KV_pool_set_root(struct KV_alloc_pool *pool, void *ptr);
+void *KV_pool_get_root(struct KV_alloc_pool *pool);
 void *KV_malloc(struct KV_alloc_pool *pool, size_t size);
+void *KV_malloc_tagged(struct KV_alloc_pool *pool, size_t size, int tag);
+void *KV_malloc_near(struct KV_alloc_pool *pool, size_t size, const void *hint);
 void KV_free(struct KV_alloc_pool *pool, void *ptr);
+void KV_free_any(void *ptr);
+uint32_t KV_malloc_handle(struct KV_alloc_pool *pool, size_t size);
+void KV_free_handle(struct KV_alloc_pool *pool, uint32_t handle);
+void *KV_handle_to_ptr(struct KV_alloc_pool *pool, uint32_t handle);
+uint32_t KV_ptr_to_handle(struct KV_alloc_pool *pool, const void *ptr);
+void KV_free_deferred(struct KV_alloc_pool *pool, void *ptr);
+void KV_pool_flush_deferred(struct KV_alloc_pool *pool);
+int KV_pool_start_reclaimer(struct KV_alloc_pool *pool);
+void KV_pool_stop_reclaimer(struct KV_alloc_pool *pool);
+void KV_epoch_enter(struct KV_alloc_pool *pool);
+void KV_epoch_exit(struct KV_alloc_pool *pool);
+void KV_retire(struct KV_alloc_pool *pool, void *ptr);
+size_t KV_epoch_reclaim(struct KV_alloc_pool *pool);
+int KV_pool_reserve(struct KV_alloc_pool *pool, size_t size, size_t count);
+int KV_pool_set_budget(struct KV_alloc_pool *pool, uint64_t soft_limit, uint64_t hard_limit);
+int KV_pool_add_pressure_callback(struct KV_alloc_pool *pool, KV_pressure_fn fn, void *arg);
+uint64_t KV_pool_usage(struct KV_alloc_pool *pool);
+int KV_pool_set_relocate(struct KV_alloc_pool *pool, KV_relocate_fn fn, void *arg);
+size_t KV_pool_compact(struct KV_alloc_pool *pool, size_t max_regions);
+struct KV_alloc_pool *KV_pool_of(const void *ptr);
+struct KV_object_pool *KV_object_pool_init(struct KV_alloc_pool *parent, size_t obj_size, size_t align);
+void KV_object_pool_free(struct KV_object_pool *opool);
+void *KV_object_alloc(struct KV_object_pool *opool);
+void KV_object_free(struct KV_object_pool *opool, void *ptr);
+int KV_pool_report(struct KV_alloc_pool *pool, struct KV_pool_report *report);
+int KV_pool_walk(struct KV_alloc_pool *pool, KV_pool_walk_fn fn, void *arg);
 const char* get_freelist_item(struct KV_alloc_pool *pool, int idx);
+int KV_alloc_ctl(const char *name, void *oldp, void *newp);
 
 void memory_barrier(void);
 
@@ -0,0 +1,78 @@
+#ifndef _ALLOC_INLINE_H
+#define _ALLOC_INLINE_H
+
+// Optional header-only fast path for the small-class freelists. Pools qualify when they are
+// single threaded, heap backed and carry no per-CPU caches, budgets or latency tracking
+// (see inline_fast_path); everything else, and every freelist miss, goes to the library
+
+#include "alloc.h"
+
+static inline void *KV_malloc_inline(struct KV_alloc_pool *pool, size_t size)
+{
+    if (pool->inline_fast_path && size <= (size_t)(MAX_ALLOCATION_CLASS_SIZE - ALLOCATION_SIZE_OVERHEAD))
+    {
+        size_t chunk_size = size <= (MIN_ALLOCATION_CLASS_SIZE - ALLOCATION_SIZE_OVERHEAD) ? (size_t)MIN_ALLOCATION_CLASS_SIZE : (size + ALLOCATION_SIZE_OVERHEAD + (ALLOCATION_CLASSES_INCR_SIZE - 1)) & ~(size_t)(ALLOCATION_CLASSES_INCR_SIZE - 1);
+        int alloc_class = (chunk_size - MIN_ALLOCATION_CLASS_SIZE) / ALLOCATION_CLASSES_INCR_SIZE;
+        struct KV_alloc_freelist *alloc_freelist = pool->alloc_freelist;
+        char *head = alloc_freelist->freelist[alloc_class];
+
+        if (head != NULL)
+        {
+            if (chunk_size <= MAX_ALLOCATION_OVERHEAD)
+            {
+                alloc_freelist->freelist[alloc_class] = *(char **)(head + 8);
+            }
+            else
+            {
+                char *next = *(char **)(head + 16);
+                if (next)
+                {
+                    *(char **)(next + 8) = NULL; // Previous chunk
+                }
+                alloc_freelist->freelist[alloc_class] = next;
+            }
+            alloc_freelist->count[alloc_class] -= 1;
+            return (void *)(head + ALLOCATION_SIZE_OVERHEAD);
+        }
+    }
+    return KV_malloc(pool, size);
+}
+
+static inline void KV_free_inline(struct KV_alloc_pool *pool, void *ptr)
+{
+    char *alloc_start = (char *)(ptr)-ALLOCATION_SIZE_OVERHEAD;
+
+    // Checked before the header is read; I/O buffer pools have none
+    uint64_t size = pool->inline_fast_path ? *(uint64_t *)alloc_start : 0;
+    if (size != 0 && size <= (uint64_t)MAX_ALLOCATION_CLASS_SIZE)
+    {
+        int alloc_class = (size - MIN_ALLOCATION_CLASS_SIZE) / ALLOCATION_CLASSES_INCR_SIZE;
+        struct KV_alloc_freelist *alloc_freelist = pool->alloc_freelist;
+        char *head = alloc_freelist->freelist[alloc_class];
+
+        if (size <= MAX_ALLOCATION_OVERHEAD)
+        {
+            *(char **)(alloc_start + 8) = head; // Next
+        }
+        else
+        {
+            *(char **)(alloc_start + 8) = NULL;  // Previous
+            *(char **)(alloc_start + 16) = head; // Next
+            if (head)
+            {
+                *(char **)(head + 8) = alloc_start;
+            }
+        }
+        alloc_freelist->freelist[alloc_class] = alloc_start;
+        alloc_freelist->count[alloc_class] += 1;
+        return;
+    }
+    KV_free(pool, ptr);
+}
+
+static inline void *KV_handle_to_ptr_inline(struct KV_alloc_pool *pool, uint32_t handle)
+{
+    return handle == KV_HANDLE_NULL ? NULL : pool->data + ((uint64_t)handle << HANDLE_SHIFT);
+}
+
+#endif // _ALLOC_INLINE_H
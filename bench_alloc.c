@@ -7,10 +7,32 @@
 
 #include "threading.h"
 #include "alloc.h"
+#include "alloc_inline.h"
 
 const int64_t alloc_num = 100000000;
 const int alloc_size = 24;
 const int num_threads = 8;
+const int64_t medium_alloc_num = 1000000;
+const int medium_alloc_size = 64 * 1024 - 8; // One 64KB buddy block with its header
+const int64_t scope_num = 100000;
+const int scope_alloc_num = 16; // Allocations made in each short-lived pool
+const int scope_pool_size = 64 * 1024;
+const int chase_num_chains = 32;
+const int64_t chase_chain_len = 32768;
+const int chase_rounds = 20;
+
+struct chase_node
+{
+    struct chase_node *next;
+    uint64_t value;
+};
+
+struct chase_state
+{
+    struct KV_alloc_pool *pool;
+    struct chase_node **heads;
+    bool near;
+};
 
 static int random0(int min, int max)
 {
@@ -33,6 +55,170 @@ static __attribute__((noinline)) int pool_alloc_free(void *arg)
     return EXIT_SUCCESS;
 }
 
+// Allocation-heavy startup: every allocation comes off the bump region
+static __attribute__((noinline)) int pool_alloc_no_free(void *arg)
+{
+    for (size_t i = 0; i < alloc_num / 16; i++)
+    {
+        char *alloc = KV_malloc((struct KV_alloc_pool *)arg, alloc_size);
+        assert(alloc != NULL);
+    }
+    return EXIT_SUCCESS;
+}
+
+static __attribute__((noinline)) int pool_alloc_free_inline(void *arg)
+{
+    for (size_t i = 0; i < alloc_num; i++)
+    {
+        char *alloc = KV_malloc_inline((struct KV_alloc_pool *)arg, alloc_size);
+        assert(alloc != NULL);
+        KV_free_inline((struct KV_alloc_pool *)arg, alloc);
+    }
+    return EXIT_SUCCESS;
+}
+
+static __attribute__((noinline)) int pool_alloc_free_deferred(void *arg)
+{
+    for (size_t i = 0; i < alloc_num; i++)
+    {
+        char *alloc = KV_malloc((struct KV_alloc_pool *)arg, alloc_size);
+        assert(alloc != NULL);
+        KV_free_deferred((struct KV_alloc_pool *)arg, alloc);
+    }
+    return EXIT_SUCCESS;
+}
+
+// Splits a free 2MB block down to 64KB and merges it back on every iteration
+static __attribute__((noinline)) int pool_alloc_free_medium(void *arg)
+{
+    for (size_t i = 0; i < medium_alloc_num; i++)
+    {
+        char *alloc = KV_malloc((struct KV_alloc_pool *)arg, medium_alloc_size);
+        assert(alloc != NULL);
+        KV_free((struct KV_alloc_pool *)arg, alloc);
+    }
+    return EXIT_SUCCESS;
+}
+
+// A pool per scope (connection, transaction) that is thrown away with everything still in it
+static __attribute__((noinline)) int pool_scopes(void *arg ALLOC_UNUSED)
+{
+    for (size_t i = 0; i < scope_num; i++)
+    {
+        struct KV_alloc_pool *pool = KV_alloc_pool_init(scope_pool_size, false);
+        for (int j = 0; j < scope_alloc_num; j++)
+        {
+            char *alloc = KV_malloc(pool, alloc_size);
+            assert(alloc != NULL);
+        }
+        KV_alloc_pool_free(pool);
+    }
+    return EXIT_SUCCESS;
+}
+
+static __attribute__((noinline)) int subpool_scopes(void *arg)
+{
+    for (size_t i = 0; i < scope_num; i++)
+    {
+        struct KV_alloc_pool *pool = KV_subpool_init((struct KV_alloc_pool *)arg, scope_pool_size);
+        for (int j = 0; j < scope_alloc_num; j++)
+        {
+            char *alloc = KV_malloc(pool, alloc_size);
+            assert(alloc != NULL);
+        }
+        KV_subpool_free(pool);
+    }
+    return EXIT_SUCCESS;
+}
+
+// Appends to every chain in turn, like hash chains filled by interleaved inserts
+static __attribute__((noinline)) int chase_build(void *arg)
+{
+    struct chase_state *state = (struct chase_state *)arg;
+    struct chase_node **tails = calloc(chase_num_chains, sizeof(struct chase_node *));
+
+    for (int64_t i = 0; i < chase_chain_len; i++)
+    {
+        for (int c = 0; c < chase_num_chains; c++)
+        {
+            struct chase_node *node = state->near ? KV_malloc_near(state->pool, sizeof(struct chase_node), tails[c])
+                                                  : KV_malloc(state->pool, sizeof(struct chase_node));
+            assert(node != NULL);
+            node->next = NULL;
+            node->value = i;
+            if (tails[c])
+            {
+                tails[c]->next = node;
+            }
+            else
+            {
+                state->heads[c] = node;
+            }
+            tails[c] = node;
+        }
+    }
+    free(tails);
+    return EXIT_SUCCESS;
+}
+
+static __attribute__((noinline)) int chase_drop(void *arg)
+{
+    struct chase_state *state = (struct chase_state *)arg;
+
+    for (int c = 0; c < chase_num_chains; c++)
+    {
+        struct chase_node *node = state->heads[c];
+        while (node)
+        {
+            struct chase_node *next = node->next;
+            KV_free(state->pool, node);
+            node = next;
+        }
+        state->heads[c] = NULL;
+    }
+    return EXIT_SUCCESS;
+}
+
+static __attribute__((noinline)) int chase_traverse(void *arg)
+{
+    struct chase_state *state = (struct chase_state *)arg;
+    uint64_t sum = 0;
+
+    for (int r = 0; r < chase_rounds; r++)
+    {
+        for (int c = 0; c < chase_num_chains; c++)
+        {
+            for (struct chase_node *node = state->heads[c]; node; node = node->next)
+            {
+                sum += node->value;
+            }
+        }
+    }
+    return sum == (uint64_t)chase_rounds * chase_num_chains * (chase_chain_len * (chase_chain_len - 1) / 2) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// The chains are rebuilt on the freelists an earlier generation of them left behind; only traversal is timed
+static double pool_chase(bool near)
+{
+    clock_t start, end;
+    size_t size = 128 * 1024 * 1024;
+    struct chase_node *heads[chase_num_chains];
+    struct chase_state state = {KV_alloc_pool_init_flags(size, false, ALLOC_POOL_NEAR), heads, false};
+
+    chase_build(&state);
+    chase_drop(&state);
+    state.near = near;
+    chase_build(&state);
+
+    start = clock();
+    int ret = chase_traverse(&state);
+    end = clock();
+    assert(ret == EXIT_SUCCESS);
+
+    KV_alloc_pool_free(state.pool);
+    return ((double)(end - start)) / CLOCKS_PER_SEC;
+}
+
 static __attribute__((noinline)) int pool_alloc_free_rand_size(void *arg)
 {
     int alloc_size = random0(8, 256);
@@ -45,6 +231,17 @@ static __attribute__((noinline)) int pool_alloc_free_rand_size(void *arg)
     return EXIT_SUCCESS;
 }
 
+static __attribute__((noinline)) int object_pool_alloc_free(void *arg)
+{
+    for (size_t i = 0; i < alloc_num; i++)
+    {
+        char *alloc = KV_object_alloc((struct KV_object_pool *)arg);
+        assert(alloc != NULL);
+        KV_object_free((struct KV_object_pool *)arg, alloc);
+    }
+    return EXIT_SUCCESS;
+}
+
 static __attribute__((noinline)) int pool_malloc_free(void *arg ALLOC_UNUSED)
 {
     for (size_t i = 0; i < alloc_num; i++)
@@ -56,6 +253,17 @@ static __attribute__((noinline)) int pool_malloc_free(void *arg ALLOC_UNUSED)
     return EXIT_SUCCESS;
 }
 
+static __attribute__((noinline)) int pool_malloc_free_medium(void *arg ALLOC_UNUSED)
+{
+    for (size_t i = 0; i < medium_alloc_num; i++)
+    {
+        char *alloc = malloc(medium_alloc_size);
+        assert(alloc != NULL);
+        free(alloc);
+    }
+    return EXIT_SUCCESS;
+}
+
 static __attribute__((noinline)) int pool_malloc_free_rand_size(void *arg ALLOC_UNUSED)
 {
     int alloc_size = random0(8, 256);
@@ -84,7 +292,90 @@ void bench_pool_allocs_same_alloc_size_single_thread()
 
     cpu_time_used = ((double)(end - start)) / CLOCKS_PER_SEC;
 
-    printf("%s => %f seconds %f MB/s\n", __FUNCTION__, cpu_time_used, (((alloc_num * alloc_size) / (1024 * 1024)) / cpu_time_used));
+    printf("%s => %f seconds %f MB/s %f ns/call\n", __FUNCTION__, cpu_time_used, (((alloc_num * alloc_size) / (1024 * 1024)) / cpu_time_used), (cpu_time_used * 1e9) / (alloc_num * 2));
+}
+
+// Same loop as above through alloc_inline.h; the difference is the call and the checks the fast path skips
+void bench_pool_inline_allocs_same_alloc_size_single_thread()
+{
+    clock_t start, end;
+    double cpu_time_used;
+    size_t size = 2224154624;
+    struct KV_alloc_pool *pool = KV_alloc_pool_init(size, false);
+
+    start = clock();
+    pool_alloc_free_inline(pool);
+    end = clock();
+
+    KV_alloc_pool_free(pool);
+
+    cpu_time_used = ((double)(end - start)) / CLOCKS_PER_SEC;
+
+    printf("%s => %f seconds %f MB/s %f ns/call\n", __FUNCTION__, cpu_time_used, (((alloc_num * alloc_size) / (1024 * 1024)) / cpu_time_used), (cpu_time_used * 1e9) / (alloc_num * 2));
+}
+
+void bench_pool_medium_allocs_single_thread()
+{
+    clock_t start, end;
+    double cpu_time_used;
+    size_t size = 64 * 1024 * 1024;
+    struct KV_alloc_pool *pool = KV_alloc_pool_init(size, false);
+
+    start = clock();
+    pool_alloc_free_medium(pool);
+    end = clock();
+
+    KV_alloc_pool_free(pool);
+
+    cpu_time_used = ((double)(end - start)) / CLOCKS_PER_SEC;
+
+    printf("%s => %f seconds %f ns/call\n", __FUNCTION__, cpu_time_used, (cpu_time_used * 1e9) / (medium_alloc_num * 2));
+}
+
+void bench_pool_scopes_single_thread()
+{
+    clock_t start, end;
+    double cpu_time_used;
+
+    start = clock();
+    pool_scopes(NULL);
+    end = clock();
+
+    cpu_time_used = ((double)(end - start)) / CLOCKS_PER_SEC;
+
+    printf("%s => %f seconds %f ns/scope\n", __FUNCTION__, cpu_time_used, (cpu_time_used * 1e9) / scope_num);
+}
+
+void bench_subpool_scopes_single_thread()
+{
+    clock_t start, end;
+    double cpu_time_used;
+    size_t size = 64 * 1024 * 1024;
+    struct KV_alloc_pool *pool = KV_alloc_pool_init(size, true);
+
+    start = clock();
+    subpool_scopes(pool);
+    end = clock();
+
+    KV_alloc_pool_free(pool);
+
+    cpu_time_used = ((double)(end - start)) / CLOCKS_PER_SEC;
+
+    printf("%s => %f seconds %f ns/scope\n", __FUNCTION__, cpu_time_used, (cpu_time_used * 1e9) / scope_num);
+}
+
+void bench_pool_chase_single_thread()
+{
+    double cpu_time_used = pool_chase(false);
+
+    printf("%s => %f seconds %f ns/node\n", __FUNCTION__, cpu_time_used, (cpu_time_used * 1e9) / (chase_rounds * chase_num_chains * chase_chain_len));
+}
+
+void bench_pool_chase_near_single_thread()
+{
+    double cpu_time_used = pool_chase(true);
+
+    printf("%s => %f seconds %f ns/node\n", __FUNCTION__, cpu_time_used, (cpu_time_used * 1e9) / (chase_rounds * chase_num_chains * chase_chain_len));
 }
 
 void bench_pool_allocs_same_alloc_size_multiple_threads_shared_pool()
@@ -115,6 +406,63 @@ void bench_pool_allocs_same_alloc_size_multiple_threads_shared_pool()
     printf("%s => %f seconds %f MB/s\n", __FUNCTION__, cpu_time_used, (((alloc_num * alloc_size * num_threads) / (1024 * 1024)) / cpu_time_used));
 }
 
+void bench_pool_deferred_frees_multiple_threads_shared_pool()
+{
+    clock_t start, end;
+    double cpu_time_used;
+    size_t size = 2224154624;
+    struct KV_alloc_pool *pool = KV_alloc_pool_init(size, true);
+    thrd_t threads[num_threads];
+
+    KV_pool_start_reclaimer(pool);
+    start = clock();
+    for (size_t i = 0; i < num_threads; i++)
+    {
+        thrd_create(&threads[i], pool_alloc_free_deferred, (void *)pool);
+    }
+
+    for (size_t i = 0; i < num_threads; i++)
+    {
+        thrd_join(threads[i], NULL);
+    }
+
+    end = clock();
+
+    KV_alloc_pool_free(pool);
+
+    cpu_time_used = ((double)(end - start)) / CLOCKS_PER_SEC;
+
+    printf("%s => %f seconds %f MB/s\n", __FUNCTION__, cpu_time_used, (((alloc_num * alloc_size * num_threads) / (1024 * 1024)) / cpu_time_used));
+}
+
+void bench_pool_allocs_same_alloc_size_multiple_threads_percpu_pool()
+{
+    clock_t start, end;
+    double cpu_time_used;
+    size_t size = 2224154624;
+    struct KV_alloc_pool *pool = KV_alloc_pool_init_flags(size, true, ALLOC_POOL_PERCPU);
+    thrd_t threads[num_threads];
+
+    start = clock();
+    for (size_t i = 0; i < num_threads; i++)
+    {
+        thrd_create(&threads[i], pool_alloc_free, (void *)pool);
+    }
+
+    for (size_t i = 0; i < num_threads; i++)
+    {
+        thrd_join(threads[i], NULL);
+    }
+
+    end = clock();
+
+    KV_alloc_pool_free(pool);
+
+    cpu_time_used = ((double)(end - start)) / CLOCKS_PER_SEC;
+
+    printf("%s => %f seconds %f MB/s\n", __FUNCTION__, cpu_time_used, (((alloc_num * alloc_size * num_threads) / (1024 * 1024)) / cpu_time_used));
+}
+
 void bench_pool_allocs_random_size_multiple_threads_shared_pool()
 {
     clock_t start, end;
@@ -145,6 +493,34 @@ void bench_pool_allocs_random_size_multiple_threads_shared_pool()
     printf("%s => %f seconds %f MB/s\n", __FUNCTION__, cpu_time_used, (((alloc_num * alloc_size * num_threads) / (1024 * 1024)) / cpu_time_used));
 }
 
+void bench_pool_bump_allocs_multiple_threads_shared_pool()
+{
+    clock_t start, end;
+    double cpu_time_used;
+    size_t size = 2224154624;
+    struct KV_alloc_pool *pool = KV_alloc_pool_init(size, true);
+    thrd_t threads[num_threads];
+
+    start = clock();
+    for (size_t i = 0; i < num_threads; i++)
+    {
+        thrd_create(&threads[i], pool_alloc_no_free, (void *)pool);
+    }
+
+    for (size_t i = 0; i < num_threads; i++)
+    {
+        thrd_join(threads[i], NULL);
+    }
+
+    end = clock();
+
+    KV_alloc_pool_free(pool);
+
+    cpu_time_used = ((double)(end - start)) / CLOCKS_PER_SEC;
+
+    printf("%s => %f seconds %f MB/s\n", __FUNCTION__, cpu_time_used, ((((alloc_num / 16) * alloc_size * num_threads) / (1024 * 1024)) / cpu_time_used));
+}
+
 void bench_pool_allocs_multiple_threads_local_pool()
 {
     clock_t start, end;
@@ -183,6 +559,56 @@ void bench_pool_allocs_multiple_threads_local_pool()
     printf("%s => %f seconds %f MB/s\n", __FUNCTION__, cpu_time_used, (((alloc_num * alloc_size * num_threads) / (1024 * 1024)) / cpu_time_used));
 }
 
+void bench_object_pool_same_alloc_size_single_thread()
+{
+    clock_t start, end;
+    double cpu_time_used;
+    size_t size = 2224154624;
+    struct KV_alloc_pool *pool = KV_alloc_pool_init(size, false);
+    struct KV_object_pool *opool = KV_object_pool_init(pool, alloc_size, 8);
+
+    start = clock();
+    object_pool_alloc_free(opool);
+    end = clock();
+
+    KV_object_pool_free(opool);
+    KV_alloc_pool_free(pool);
+
+    cpu_time_used = ((double)(end - start)) / CLOCKS_PER_SEC;
+
+    printf("%s => %f seconds %f MB/s\n", __FUNCTION__, cpu_time_used, (((alloc_num * alloc_size) / (1024 * 1024)) / cpu_time_used));
+}
+
+void bench_object_pool_same_alloc_size_multiple_threads_shared_pool()
+{
+    clock_t start, end;
+    double cpu_time_used;
+    size_t size = 2224154624;
+    struct KV_alloc_pool *pool = KV_alloc_pool_init(size, true);
+    struct KV_object_pool *opool = KV_object_pool_init(pool, alloc_size, 8);
+    thrd_t threads[num_threads];
+
+    start = clock();
+    for (size_t i = 0; i < num_threads; i++)
+    {
+        thrd_create(&threads[i], object_pool_alloc_free, (void *)opool);
+    }
+
+    for (size_t i = 0; i < num_threads; i++)
+    {
+        thrd_join(threads[i], NULL);
+    }
+
+    end = clock();
+
+    KV_object_pool_free(opool);
+    KV_alloc_pool_free(pool);
+
+    cpu_time_used = ((double)(end - start)) / CLOCKS_PER_SEC;
+
+    printf("%s => %f seconds %f MB/s\n", __FUNCTION__, cpu_time_used, (((alloc_num * alloc_size * num_threads) / (1024 * 1024)) / cpu_time_used));
+}
+
 void bench_malloc_same_alloc_size_single_thread()
 {
     clock_t start, end;
@@ -197,6 +623,20 @@ void bench_malloc_same_alloc_size_single_thread()
     printf("%s => %f seconds %f MB/s\n", __FUNCTION__, cpu_time_used, (((alloc_num * alloc_size) / (1024 * 1024)) / cpu_time_used));
 }
 
+void bench_malloc_medium_allocs_single_thread()
+{
+    clock_t start, end;
+    double cpu_time_used;
+
+    start = clock();
+    pool_malloc_free_medium(NULL);
+    end = clock();
+
+    cpu_time_used = ((double)(end - start)) / CLOCKS_PER_SEC;
+
+    printf("%s => %f seconds %f ns/call\n", __FUNCTION__, cpu_time_used, (cpu_time_used * 1e9) / (medium_alloc_num * 2));
+}
+
 void bench_malloc_same_alloc_size_multiple_threads()
 {
     clock_t start, end;
@@ -245,6 +685,18 @@ void bench_malloc_random_size_multiple_threads()
 }
 // #endif
 
+// Single-threaded pool benches; run by both builds
+void bench_pool_single_thread()
+{
+    bench_pool_allocs_same_alloc_size_single_thread();
+    bench_pool_inline_allocs_same_alloc_size_single_thread();
+    bench_pool_medium_allocs_single_thread();
+    bench_pool_scopes_single_thread();
+    bench_subpool_scopes_single_thread();
+    bench_pool_chase_single_thread();
+    bench_pool_chase_near_single_thread();
+}
+
 int main(int argc ALLOC_UNUSED, char *argv[] ALLOC_UNUSED)
 {
 // #if defined(__linux__)
@@ -253,17 +705,28 @@ int main(int argc ALLOC_UNUSED, char *argv[] ALLOC_UNUSED)
     printf("==============================MULTITHREADED==================================\n");
     printf("    **************************SHARED POOL***************************\n");
     bench_pool_allocs_same_alloc_size_multiple_threads_shared_pool();
+    bench_pool_allocs_same_alloc_size_multiple_threads_percpu_pool();
+    bench_pool_deferred_frees_multiple_threads_shared_pool();
     bench_pool_allocs_random_size_multiple_threads_shared_pool();
+    bench_pool_bump_allocs_multiple_threads_shared_pool();
     printf("    **************************LOCAL POOL***************************\n");
     bench_pool_allocs_multiple_threads_local_pool();
+    printf("    **************************SINGLE THREAD***************************\n");
+    bench_pool_single_thread();
+    printf("    **************************OBJECT POOL***************************\n");
+    bench_object_pool_same_alloc_size_single_thread();
+    bench_object_pool_same_alloc_size_multiple_threads_shared_pool();
     printf("=============================================================================\n");
     bench_malloc_same_alloc_size_multiple_threads();
     bench_malloc_random_size_multiple_threads();
+    bench_malloc_medium_allocs_single_thread();
     printf("=============================================================================\n\n");
 #else
     printf("==============================SINGLETHREADED=================================\n");
-    bench_pool_allocs_same_alloc_size_single_thread();
+    bench_pool_single_thread();
     bench_malloc_same_alloc_size_single_thread();
+    bench_malloc_medium_allocs_single_thread();
+    bench_object_pool_same_alloc_size_single_thread();
     bench_pool_allocs_multiple_threads_local_pool();
     printf("=============================================================================\n\n");
 #endif // CONCURRENT_ACCESS
@@ -1,8 +1,24 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <assert.h>
 
 #include "alloc.h"
+#include "alloc_inline.h"
+
+#if defined(__linux__)
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#define TEST_HAVE_IO_URING 1
+#endif
+#endif
+#endif
 
 #define TEST_ALLOC_DEBUG_VERBOSE 0
 
@@ -220,14 +236,1619 @@ void test_multiple_pool_allocs_stats() {
     KV_alloc_pool_free(pool);
 }
 
-int main(int argc, char *argv[])
+void test_KV_object_pool()
 {
-    test_KV_alloc_pool_init();
-    test_KV_malloc();
-    test_KV_free();
-    test_KV_freelist_class_linked_list();
-    test_alloc_class();
-    test_min_ensure_pointer_links_allocd();
-    test_multiple_pool_allocs_stats();
+    struct KV_alloc_pool *pool = KV_alloc_pool_init(MIN_ALLOCATION_POOL_SIZE, false);
+    struct KV_object_pool *opool = KV_object_pool_init(pool, 40, 16);
+    int alloc_num = 10;
+    char *alloc[alloc_num];
+
+    assert(opool != NULL);
+    assert(opool->obj_size == 48); // Rounded up to the alignment
+
+    for (size_t i = 0; i < alloc_num; i++)
+    {
+        alloc[i] = (char *)KV_object_alloc(opool);
+        assert(alloc[i] != NULL);
+        assert(((uintptr_t)alloc[i] & 15) == 0);
+        if (i > 0)
+        {
+            assert(alloc[i] - alloc[i - 1] == 48); // No header between objects
+        }
+    }
+    assert(pool->offset == OBJECT_POOL_SLAB_SIZE + 16); // A single slab carved for all objects
+
+    KV_object_free(opool, alloc[3]);
+    KV_object_free(opool, alloc[7]);
+    assert(KV_object_alloc(opool) == alloc[7]); // LIFO reuse
+    assert(KV_object_alloc(opool) == alloc[3]);
+    assert(opool->free_list == NULL);
+
+    KV_object_pool_free(opool);
+    KV_alloc_pool_free(pool);
+}
+
+static int count_free_chunks(const char *start, size_t size, int alloc_class, void *arg)
+{
+    size_t *counts = (size_t *)arg;
+    if (alloc_class >= 0)
+    {
+        assert(*(uint64_t *)start == size);
+        counts[alloc_class] += 1;
+    }
+    return 0;
+}
+
+void test_KV_pool_report()
+{
+    struct KV_alloc_pool *pool = KV_alloc_pool_init(MIN_ALLOCATION_POOL_SIZE, false);
+    struct KV_pool_report report;
+    size_t counts[MAX_FREELIST_NUM_CLASSES] = {0};
+    int alloc_num = 10;
+    char *alloc[alloc_num];
+
+    for (size_t i = 0; i < alloc_num; i++)
+    {
+        alloc[i] = (char *)KV_malloc(pool, 40); // 48 byte chunks; class 4
+    }
+    char *large = (char *)KV_malloc(pool, BUDDY_MAX_BLOCK_SIZE);
+
+    for (size_t i = 0; i < alloc_num; i += 2)
+    {
+        KV_free(pool, alloc[i]);
+    }
+
+    assert(KV_pool_report(pool, &report) == 0);
+    assert(report.size == MIN_ALLOCATION_POOL_SIZE);
+    assert(report.bump_used == alloc_num * 48);
+    assert(report.bump_free == MIN_ALLOCATION_POOL_SIZE - alloc_num * 48);
+    assert(report.classes[4].chunk_size == 48);
+    assert(report.classes[4].free_count == 5);
+    assert(report.classes[4].free_bytes == 5 * 48);
+    assert(report.free_count == 5);
+    assert(report.largest_free == report.bump_free);
+    assert(report.num_large_allocs == 1);
+    assert(report.large_allocs_size == BUDDY_MAX_BLOCK_SIZE + ALLOCATION_SIZE_OVERHEAD);
+    assert(report.fragmentation > 0 && report.fragmentation < 0.01);
+
+    assert(KV_pool_walk(pool, count_free_chunks, counts) == 0);
+    assert(counts[4] == 5);
+
+    KV_free(pool, large);
+    assert(KV_pool_report(pool, &report) == 0);
+    assert(report.num_large_allocs == 0 && report.large_allocs_size == 0);
+
+    KV_alloc_pool_free(pool);
+}
+
+void test_KV_percpu_freelists()
+{
+    struct KV_alloc_pool *pool = KV_alloc_pool_init_flags(MIN_ALLOCATION_POOL_SIZE, true, ALLOC_POOL_PERCPU);
+    struct KV_pool_report report;
+    int alloc_num = PERCPU_CACHE_SLOTS + 8;
+    char *alloc[alloc_num];
+
+    for (size_t i = 0; i < alloc_num; i++)
+    {
+        alloc[i] = (char *)KV_malloc(pool, 40);
+    }
+    for (size_t i = 0; i < alloc_num; i++)
+    {
+        KV_free(pool, alloc[i]);
+    }
+
+    KV_pool_report(pool, &report);
+    assert(report.classes[4].free_count == alloc_num);
+
+    const char *item = get_freelist_item(pool, 4);
+    if (pool->percpu != NULL)
+    {
+        // The first PERCPU_CACHE_SLOTS frees stayed with this CPU; the rest spilled to the shared class
+        assert(item == alloc[alloc_num - 1] - ALLOCATION_SIZE_OVERHEAD);
+        assert(pool->alloc_freelist->count[4] == alloc_num - PERCPU_CACHE_SLOTS);
+        assert(KV_malloc(pool, 40) == alloc[PERCPU_CACHE_SLOTS - 1]); // Cache is popped LIFO before the shared list
+    }
+    else
+    {
+        // No rseq: the pool behaves like any other
+        assert(pool->alloc_freelist->count[4] == alloc_num);
+    }
+
+    KV_alloc_pool_free(pool);
+}
+
+void test_KV_free_any()
+{
+    int pool_num = 16; // More pools than the old fixed registry could hold
+    struct KV_alloc_pool *pools[pool_num];
+    char *alloc[pool_num];
+    int stack_var;
+
+    for (size_t i = 0; i < pool_num; i++)
+    {
+        pools[i] = KV_alloc_pool_init(MIN_ALLOCATION_POOL_SIZE, false);
+        assert(pools[i] != NULL);
+        alloc[i] = (char *)KV_malloc(pools[i], 40);
+        assert(KV_pool_of(alloc[i]) == pools[i]);
+        assert(KV_pool_of(pools[i]->data + pools[i]->size - 1) == pools[i]);
+    }
+
+    for (size_t i = 0; i < pool_num; i++)
+    {
+        KV_free_any(alloc[i]);
+        assert(get_freelist_item(pools[i], 4) == alloc[i] - ALLOCATION_SIZE_OVERHEAD);
+    }
+
+    char *large = (char *)KV_malloc(pools[3], 3 * 4096);
+    assert(KV_pool_of(large) == pools[3]);
+    assert(KV_pool_of(large + 2 * 4096) == pools[3]);
+    KV_free_any(large);
+
+    struct KV_pool_report report;
+    KV_pool_report(pools[3], &report);
+    assert(report.num_large_allocs == 0);
+
+    assert(KV_pool_of(&stack_var) == NULL);
+
+    char *data = pools[0]->data;
+    for (size_t i = 0; i < pool_num; i++)
+    {
+        KV_alloc_pool_free(pools[i]);
+    }
+    assert(KV_pool_of(data) == NULL);
+}
+
+void test_KV_free_deferred()
+{
+    struct KV_alloc_pool *pool = KV_alloc_pool_init(MIN_ALLOCATION_POOL_SIZE, true);
+    struct KV_pool_report report;
+    int alloc_num = 2 * DEFERRED_FREE_BATCH_SIZE + 8;
+    char *alloc[alloc_num];
+
+    for (size_t i = 0; i < alloc_num; i++)
+    {
+        alloc[i] = (char *)KV_malloc(pool, 40);
+    }
+    char *large = (char *)KV_malloc(pool, BUDDY_MAX_BLOCK_SIZE);
+
+    for (size_t i = 0; i < alloc_num; i++)
+    {
+        KV_free_deferred(pool, alloc[i]);
+    }
+    KV_free_deferred(pool, large);
+
+    // Nothing reaches the freelist until a slow path or a flush drains the queue
+    KV_pool_report(pool, &report);
+    assert(report.free_count == 0);
+    assert(report.num_large_allocs == 1);
+
+    // A miss in the class drains the published batches and takes one of their chunks
+    char *reused = (char *)KV_malloc(pool, 40);
+    bool found = false;
+    for (size_t i = 0; i < alloc_num; i++)
+    {
+        found |= reused == alloc[i];
+    }
+    assert(found);
+
+    KV_free(pool, reused);
+    KV_pool_flush_deferred(pool);
+    KV_pool_report(pool, &report);
+    assert(report.classes[4].free_count == alloc_num);
+    assert(report.num_large_allocs == 0);
+
+    KV_alloc_pool_free(pool);
+}
+
+void test_KV_inline_fast_path()
+{
+    struct KV_alloc_pool *pool = KV_alloc_pool_init(MIN_ALLOCATION_POOL_SIZE, false);
+    char *alloc[4];
+
+    assert(pool->inline_fast_path);
+
+    // Misses fall through to the library; frees land where KV_malloc looks for them
+    for (size_t i = 0; i < 4; i++)
+    {
+        alloc[i] = (char *)KV_malloc_inline(pool, 40);
+    }
+    KV_free_inline(pool, alloc[0]);
+    KV_free(pool, alloc[1]);
+    KV_free_inline(pool, alloc[2]);
+    assert(pool->alloc_freelist->count[4] == 3);
+    assert(get_freelist_item(pool, 4) == alloc[2] - ALLOCATION_SIZE_OVERHEAD);
+
+    assert(KV_malloc(pool, 40) == alloc[2]);
+    assert(KV_malloc_inline(pool, 40) == alloc[1]);
+    assert(*(char **)(alloc[0] - ALLOCATION_SIZE_OVERHEAD + 8) == NULL); // New head has no previous chunk
+    assert(KV_malloc_inline(pool, 40) == alloc[0]);
+    assert(pool->alloc_freelist->count[4] == 0);
+
+    // Singly linked smallest class
+    char *small = (char *)KV_malloc_inline(pool, 8);
+    KV_free_inline(pool, alloc[3]);
+    KV_free_inline(pool, small);
+    assert(get_freelist_item(pool, 0) == small - ALLOCATION_SIZE_OVERHEAD);
+    assert(KV_malloc_inline(pool, 8) == small);
+
+    char *large = (char *)KV_malloc_inline(pool, 4096);
+    KV_free_inline(pool, large);
+    struct KV_pool_report report;
+    KV_pool_report(pool, &report);
+    assert(report.num_large_allocs == 0);
+
+    KV_pool_set_budget(pool, 0, MIN_ALLOCATION_POOL_SIZE);
+    assert(!pool->inline_fast_path);
+    KV_alloc_pool_free(pool);
+
+    pool = KV_alloc_pool_init(MIN_ALLOCATION_POOL_SIZE, true);
+    assert(!pool->inline_fast_path);
+    KV_free_inline(pool, KV_malloc_inline(pool, 40));
+    assert(pool->alloc_freelist->count[4] == 1);
+    KV_alloc_pool_free(pool);
+}
+
+void test_KV_handles()
+{
+    struct KV_alloc_pool *pool = KV_alloc_pool_init(MIN_ALLOCATION_POOL_SIZE, false);
+    uint32_t handles[64];
+
+    for (size_t i = 0; i < 64; i++)
+    {
+        handles[i] = KV_malloc_handle(pool, 40);
+        assert(handles[i] != KV_HANDLE_NULL);
+        char *ptr = (char *)KV_handle_to_ptr(pool, handles[i]);
+        assert(ptr == KV_handle_to_ptr_inline(pool, handles[i]));
+        assert(KV_ptr_to_handle(pool, ptr) == handles[i]);
+        memset(ptr, (int)i, 40);
+    }
+    assert(handles[0] == ALLOCATION_SIZE_OVERHEAD >> HANDLE_SHIFT);
+
+    for (size_t i = 0; i < 64; i++)
+    {
+        assert(((char *)KV_handle_to_ptr(pool, handles[i]))[39] == (char)i);
+    }
+
+    KV_free_handle(pool, handles[10]);
+    assert(KV_malloc_handle(pool, 40) == handles[10]);
+    KV_free_handle(pool, KV_HANDLE_NULL);
+
+    assert(KV_handle_to_ptr(pool, KV_HANDLE_NULL) == NULL);
+    assert(KV_malloc_handle(pool, BUDDY_MAX_BLOCK_SIZE) == KV_HANDLE_NULL);
+    int stack_var;
+    assert(KV_ptr_to_handle(pool, &stack_var) == KV_HANDLE_NULL);
+
+    KV_alloc_pool_free(pool);
+}
+
+void test_KV_pool_reserve()
+{
+    struct KV_alloc_pool *pool = KV_alloc_pool_init(MIN_ALLOCATION_POOL_SIZE, true);
+    struct KV_pool_report report;
+
+    assert(KV_pool_reserve(pool, 40, 100) == 0);
+    KV_pool_report(pool, &report);
+    assert(report.classes[4].free_count == 100);
+    assert(report.bump_used == 100 * 48);
+
+    // Handed out in address order, all from the freelist
+    for (size_t i = 0; i < 100; i++)
+    {
+        assert((char *)KV_malloc(pool, 40) == pool->data + (i * 48) + ALLOCATION_SIZE_OVERHEAD);
+    }
+    KV_pool_report(pool, &report);
+    assert(report.classes[4].free_count == 0 && report.bump_used == 100 * 48);
+
+    assert(KV_pool_reserve(pool, 4096, 1) == -1);
+    assert(KV_pool_reserve(pool, 40, MIN_ALLOCATION_POOL_SIZE) == -1);
+    assert(KV_pool_reserve(pool, 40, SIZE_MAX / 48 + 1) == -1);
+    assert(KV_pool_reserve(pool, 8, 0) == 0);
+
+    KV_alloc_pool_free(pool);
+}
+
+struct eviction_state
+{
+    char **alloc;
+    size_t head; // Oldest live allocation
+    size_t tail;
+    int calls;
+};
+
+static void evict_oldest_half(struct KV_alloc_pool *pool, uint64_t usage, uint64_t soft_limit, void *arg)
+{
+    struct eviction_state *state = (struct eviction_state *)arg;
+    size_t evict_num = (state->tail - state->head) / 2;
+
+    assert(usage > 0 && soft_limit > 0);
+    state->calls++;
+    for (size_t i = 0; i < evict_num; i++)
+    {
+        KV_free(pool, state->alloc[state->head++]);
+    }
+}
+
+void test_KV_pool_budget()
+{
+    struct KV_alloc_pool *pool = KV_alloc_pool_init(MIN_ALLOCATION_POOL_SIZE * 4, true);
+    size_t soft_limit = 256 * 1024, hard_limit = 512 * 1024;
+    int alloc_num = 50000;
+    struct eviction_state state = {malloc(alloc_num * sizeof(char *)), 0, 0, 0};
+
+    assert(KV_pool_set_budget(pool, hard_limit, soft_limit) == -1);
+    assert(KV_pool_set_budget(pool, soft_limit, hard_limit) == 0);
+    assert(KV_pool_add_pressure_callback(pool, evict_oldest_half, &state) == 0);
+
+    // Eviction keeps the store well inside the hard limit; no allocation fails
+    for (size_t i = 0; i < alloc_num; i++)
+    {
+        state.alloc[state.tail] = (char *)KV_malloc(pool, 40);
+        assert(state.alloc[state.tail] != NULL);
+        state.tail++;
+        assert(KV_pool_usage(pool) <= hard_limit);
+    }
+    assert(state.calls > 0);
+    assert(KV_pool_usage(pool) == (state.tail - state.head) * 48);
+
+    while (state.head < state.tail)
+    {
+        KV_free(pool, state.alloc[state.head++]);
+    }
+    assert(KV_pool_usage(pool) == 0);
+    KV_alloc_pool_free(pool);
+
+    // Without a callback that frees, the hard limit fails the allocation instead of exhausting the pool
+    pool = KV_alloc_pool_init(MIN_ALLOCATION_POOL_SIZE, false);
+    assert(KV_pool_set_budget(pool, 0, 64 * 1024) == 0);
+    size_t count = 0;
+    while ((state.alloc[count] = (char *)KV_malloc(pool, 40)) != NULL)
+    {
+        count++;
+    }
+    assert(count == (64 * 1024) / 48);
+    assert(KV_malloc(pool, 8192) == NULL);
+
+    KV_free(pool, state.alloc[0]);
+    assert(KV_malloc(pool, 40) != NULL);
+    KV_alloc_pool_free(pool);
+
+    // A budget switched on for a pool in use starts from what is live, so later frees do not drive it negative
+    pool = KV_alloc_pool_init(MIN_ALLOCATION_POOL_SIZE, true);
+    for (size_t i = 0; i < 100; i++)
+    {
+        state.alloc[i] = (char *)KV_malloc(pool, 40);
+    }
+    char *large = (char *)KV_malloc(pool, BUDDY_MAX_BLOCK_SIZE);
+    KV_free(pool, state.alloc[0]);
+    assert(KV_pool_set_budget(pool, 4096, 0) == 0);
+    assert(KV_pool_usage(pool) == 99 * 48 + BUDDY_MAX_BLOCK_SIZE + ALLOCATION_SIZE_OVERHEAD);
+    KV_free(pool, large);
+    for (size_t i = 1; i < 100; i++)
+    {
+        KV_free(pool, state.alloc[i]);
+    }
+    assert(KV_pool_usage(pool) == 0);
+
+    free(state.alloc);
+    KV_alloc_pool_free(pool);
+}
+
+void test_KV_buddy_tier()
+{
+    struct KV_alloc_pool *pool = KV_alloc_pool_init(BUDDY_MAX_BLOCK_SIZE * BUDDY_GROW_POOL_FRACTION, false);
+    struct KV_pool_report report;
+
+    // One past the largest class used to have no home at all
+    char *edge = (char *)KV_malloc(pool, MAX_ALLOCATION_CLASS_SIZE);
+    assert(*(uint64_t *)(edge - ALLOCATION_SIZE_OVERHEAD) == BUDDY_MIN_BLOCK_SIZE);
+    KV_free(pool, edge);
+    KV_pool_report(pool, &report);
+    assert(report.buddy_free_count == 1 && report.buddy_free_bytes == BUDDY_MAX_BLOCK_SIZE);
+
+    // Splitting a 2MB block leaves one free block per order below it; the second page is the first one's buddy
+    char *a = (char *)KV_malloc(pool, 4000);
+    char *b = (char *)KV_malloc(pool, 4000);
+    char *c = (char *)KV_malloc(pool, 100000);
+    assert((a - ALLOCATION_SIZE_OVERHEAD - pool->data) % BUDDY_MIN_BLOCK_SIZE == 0);
+    assert(b - a == BUDDY_MIN_BLOCK_SIZE);
+    assert(*(uint64_t *)(c - ALLOCATION_SIZE_OVERHEAD) == 128 * 1024);
+    assert(KV_pool_of(c) == pool);
+    memset(c, 1, 100000);
+
+    KV_pool_report(pool, &report);
+    assert(report.num_large_allocs == 0);
+    assert(report.buddy_free_count == BUDDY_NUM_ORDERS - 3);
+    assert(report.buddy_free_bytes == BUDDY_MAX_BLOCK_SIZE - 2 * BUDDY_MIN_BLOCK_SIZE - 128 * 1024);
+
+    KV_free(pool, b);
+    KV_free(pool, c);
+    KV_free(pool, a);
+    KV_pool_report(pool, &report);
+    assert(report.buddy_free_count == 1 && report.buddy_free_bytes == BUDDY_MAX_BLOCK_SIZE);
+
+    // Once the pool is out of room a block falls back to a mapping of its own
+    char *blocks[BUDDY_GROW_POOL_FRACTION + 1];
+    for (int i = 0; i <= BUDDY_GROW_POOL_FRACTION; i++)
+    {
+        blocks[i] = (char *)KV_malloc(pool, BUDDY_MAX_BLOCK_SIZE - ALLOCATION_SIZE_OVERHEAD);
+        assert(blocks[i] != NULL);
+    }
+    KV_pool_report(pool, &report);
+    assert(report.bump_free == 0 && report.buddy_free_count == 0);
+    assert(report.num_large_allocs == 1 && KV_pool_of(blocks[BUDDY_GROW_POOL_FRACTION]) == pool);
+
+    for (int i = 0; i <= BUDDY_GROW_POOL_FRACTION; i++)
+    {
+        KV_free(pool, blocks[i]);
+    }
+    KV_pool_report(pool, &report);
+    assert(report.num_large_allocs == 0 && report.buddy_free_count == BUDDY_GROW_POOL_FRACTION);
+    KV_alloc_pool_free(pool);
+
+    // Smaller pools claim smaller blocks. The pages skipped to align one become blocks too, the rest class chunks
+    size_t block_size = MIN_ALLOCATION_POOL_SIZE / BUDDY_GROW_POOL_FRACTION;
+    pool = KV_alloc_pool_init(MIN_ALLOCATION_POOL_SIZE, false);
+    KV_malloc(pool, 40);
+    a = (char *)KV_malloc(pool, 4000);
+    assert(a - ALLOCATION_SIZE_OVERHEAD == pool->data + BUDDY_MIN_BLOCK_SIZE);
+
+    KV_pool_report(pool, &report);
+    assert(report.bump_free == MIN_ALLOCATION_POOL_SIZE - 2 * block_size);
+    assert(report.free_count > 0 && report.free_bytes == BUDDY_MIN_BLOCK_SIZE - 48);
+    assert(report.buddy_free_bytes == 2 * block_size - 2 * BUDDY_MIN_BLOCK_SIZE);
+    KV_alloc_pool_free(pool);
+}
+
+struct relocation_state
+{
+    char **table; // Objects store their own index
+    char *pinned; // Refused, as if a reader held it
+    size_t moved;
+};
+
+static int relocate_indexed(struct KV_alloc_pool *pool, void *old_ptr, void *new_ptr, size_t size, void *arg)
+{
+    struct relocation_state *state = (struct relocation_state *)arg;
+    size_t index = *(size_t *)new_ptr;
+
+    assert(KV_pool_of(new_ptr) == pool && size == 40);
+    assert(state->table[index] == old_ptr);
+    if (old_ptr == state->pinned)
+    {
+        return -1;
+    }
+    state->table[index] = (char *)new_ptr;
+    state->moved++;
+    return 0;
+}
+
+struct region_count
+{
+    const char *start;
+    size_t count;
+};
+
+static int count_region_chunks(const char *start, size_t size, int alloc_class, void *arg)
+{
+    struct region_count *region = (struct region_count *)arg;
+    if (alloc_class == 4 && start >= region->start && start < region->start + COMPACT_REGION_SIZE)
+    {
+        assert(*(uint64_t *)start == size);
+        region->count++;
+    }
+    return 0;
+}
+
+void test_KV_pool_compact()
+{
+    struct KV_alloc_pool *pool = KV_alloc_pool_init_flags(MIN_ALLOCATION_POOL_SIZE * 4, false, ALLOC_POOL_COMPACTABLE);
+    size_t per_region = COMPACT_REGION_SIZE / 48, alloc_num = 4 * per_region + 1;
+    struct relocation_state state = {malloc(alloc_num * sizeof(char *)), NULL, 0};
+    struct KV_pool_report report;
+
+    assert(KV_pool_compact(pool, 0) == 0); // Nobody to tell about moves yet
+
+    // Every 16th object survives, leaving the four full regions 1/16 live
+    for (size_t i = 0; i < alloc_num; i++)
+    {
+        state.table[i] = (char *)KV_malloc(pool, 40);
+        *(size_t *)state.table[i] = i;
+    }
+    assert(state.table[per_region] - ALLOCATION_SIZE_OVERHEAD == pool->data + COMPACT_REGION_SIZE); // No chunk crosses a region
+    for (size_t i = 0; i < alloc_num; i++)
+    {
+        if (i % 16)
+        {
+            KV_free(pool, state.table[i]);
+            state.table[i] = NULL;
+        }
+    }
+
+    // A refused object pins its region; its free chunks go back on the freelist
+    size_t pinned = (2 * per_region + 15) / 16 * 16;
+    state.pinned = state.table[pinned];
+    assert(KV_pool_set_relocate(pool, relocate_indexed, &state) == 0);
+    assert(KV_pool_compact(pool, 0) == 3 * COMPACT_REGION_SIZE);
+    assert(state.moved == (4 * per_region + 15) / 16 - 1);
+    assert(state.table[pinned] == state.pinned);
+
+    for (size_t i = 0; i < alloc_num; i += 16)
+    {
+        assert(*(size_t *)state.table[i] == i);
+    }
+    KV_pool_report(pool, &report);
+    assert(report.buddy_free_bytes == 3 * COMPACT_REGION_SIZE);
+
+    struct region_count region = {pool->data + 2 * COMPACT_REGION_SIZE, 0};
+    assert(KV_pool_walk(pool, count_region_chunks, &region) == 0);
+    assert(region.count == per_region - 1);
+
+    state.pinned = NULL;
+    assert(KV_pool_compact(pool, 0) == COMPACT_REGION_SIZE);
+    assert(*(size_t *)state.table[pinned] == pinned);
+    KV_pool_report(pool, &report);
+    assert(report.buddy_free_bytes == 4 * COMPACT_REGION_SIZE);
+
+    // Released regions serve page-sized allocations
+    char *page = (char *)KV_malloc(pool, 4000);
+    assert(page - ALLOCATION_SIZE_OVERHEAD < pool->data + 4 * COMPACT_REGION_SIZE);
+    KV_free(pool, page);
+
+    for (size_t i = 0; i < alloc_num; i += 16)
+    {
+        KV_free(pool, state.table[i]);
+    }
+    free(state.table);
+    KV_alloc_pool_free(pool);
+
+    pool = KV_alloc_pool_init(MIN_ALLOCATION_POOL_SIZE, false);
+    assert(KV_pool_set_relocate(pool, relocate_indexed, &state) == -1);
+    KV_alloc_pool_free(pool);
+}
+
+// A refused tagged object keeps its tag bits; the restore walk must still step over it to the free chunks behind
+void test_KV_pool_compact_tagged()
+{
+    struct KV_alloc_pool *pool = KV_alloc_pool_init_flags(MIN_ALLOCATION_POOL_SIZE, false, ALLOC_POOL_COMPACTABLE);
+    size_t per_region = COMPACT_REGION_SIZE / 48;
+    char *allocs[per_region + 1];
+    struct relocation_state state = {allocs, NULL, 0};
+
+    for (size_t i = 0; i <= per_region; i++)
+    {
+        allocs[i] = (char *)(i == 0 ? KV_malloc_tagged(pool, 40, 1) : KV_malloc(pool, 40));
+        *(size_t *)allocs[i] = i;
+    }
+    for (size_t i = 1; i < per_region; i++)
+    {
+        KV_free(pool, allocs[i]);
+    }
+
+    state.pinned = allocs[0];
+    assert(KV_pool_set_relocate(pool, relocate_indexed, &state) == 0);
+    assert(KV_pool_compact(pool, 0) == 0);
+    assert(state.moved == 0 && allocs[0] == state.pinned);
+
+    struct region_count region = {pool->data, 0};
+    assert(KV_pool_walk(pool, count_region_chunks, &region) == 0);
+    assert(region.count == per_region - 1);
+
+    KV_free(pool, allocs[0]);
+    KV_free(pool, allocs[per_region]);
+    KV_alloc_pool_free(pool);
+}
+
+void test_KV_malloc_tagged()
+{
+    struct KV_alloc_pool *pool = KV_alloc_pool_init(BUDDY_MAX_BLOCK_SIZE * BUDDY_GROW_POOL_FRACTION, false);
+    struct KV_pool_report report;
+    size_t counts[MAX_FREELIST_NUM_CLASSES] = {0};
+    char *index[10];
+
+    assert(KV_malloc_tagged(pool, 40, ALLOC_NUM_TAGS) == NULL);
+    assert(KV_malloc_tagged(pool, 40, -1) == NULL);
+
+    for (int i = 0; i < 10; i++)
+    {
+        index[i] = (char *)KV_malloc_tagged(pool, 40, 1);
+        memset(index[i], 1, 40);
+    }
+    char *value = (char *)KV_malloc_tagged(pool, 10000, 2);   // Buddy block
+    char *large = (char *)KV_malloc_tagged(pool, BUDDY_MAX_BLOCK_SIZE, 2); // Own mapping
+    char *scratch = (char *)KV_malloc_tagged(pool, 40, 0);
+    KV_free(pool, KV_malloc(pool, 40));
+
+    KV_pool_report(pool, &report);
+    assert(report.tags[0].live_count == 0);
+    assert(report.tags[1].live_count == 10 && report.tags[1].live_bytes == 10 * 48);
+    assert(report.tags[2].live_count == 2 && report.tags[2].live_bytes == 16384 + BUDDY_MAX_BLOCK_SIZE + 8);
+
+    // Freed chunks lose their tag, so they are reused untagged and counted nowhere
+    for (int i = 0; i < 10; i += 2)
+    {
+        KV_free_inline(pool, index[i]);
+    }
+    KV_free(pool, large);
+    assert(KV_pool_walk(pool, count_free_chunks, counts) == 0);
+    assert(counts[4] == 5 + 1); // and the untagged chunk freed above
+    assert(KV_malloc(pool, 40) == index[8]);
+
+    KV_pool_report(pool, &report);
+    assert(report.tags[1].live_count == 5 && report.tags[1].live_bytes == 5 * 48);
+    assert(report.tags[2].live_count == 1 && report.tags[2].live_bytes == 16384);
+
+    for (int i = 1; i < 10; i += 2)
+    {
+        KV_free(pool, index[i]);
+    }
+    KV_free(pool, value);
+    KV_free(pool, scratch);
+    KV_pool_report(pool, &report);
+    assert(report.tags[1].live_count == 0 && report.tags[1].live_bytes == 0);
+    assert(report.tags[2].live_count == 0 && report.tags[2].live_bytes == 0);
+    KV_alloc_pool_free(pool);
+}
+
+void test_KV_subpool()
+{
+    struct KV_alloc_pool *parent = KV_alloc_pool_init(BUDDY_MAX_BLOCK_SIZE * BUDDY_GROW_POOL_FRACTION, true);
+    struct KV_pool_report report;
+
+    assert(KV_subpool_init(parent, BUDDY_MAX_BLOCK_SIZE) == NULL);
+
+    struct KV_alloc_pool *child = KV_subpool_init(parent, 64 * 1024);
+    assert(child != NULL && child->parent == parent && child->parent_block_size == 128 * 1024);
+    assert(child->data >= parent->data && child->data + child->parent_block_size <= parent->data + parent->size);
+    assert(child->size >= 64 * 1024 && child->inline_fast_path);
+    KV_pool_report(parent, &report);
+    assert(report.buddy_free_bytes == BUDDY_MAX_BLOCK_SIZE - 128 * 1024);
+
+    // Class chunks and buddy blocks both come out of the child's block, and nothing past it is mapped
+    char *page = (char *)KV_malloc(child, 4000);
+    assert(page != NULL && page > child->data && page < child->data + child->size);
+    assert(KV_malloc(child, BUDDY_MAX_BLOCK_SIZE) == NULL);
+
+    size_t num_allocs = 0;
+    char *alloc;
+    while ((alloc = (char *)KV_malloc(child, 40)) != NULL)
+    {
+        assert(alloc > child->data && alloc + 40 <= child->data + child->size);
+        memset(alloc, 1, 40);
+        num_allocs++;
+    }
+    assert(num_allocs > (64 * 1024 - BUDDY_MIN_BLOCK_SIZE) / 48);
+    KV_pool_report(child, &report);
+    assert(report.num_large_allocs == 0);
+
+    KV_free(child, page);
+    assert(KV_malloc(child, 4000) == page);
+
+    // The address map names the child for its block, so a chunk freed without its pool goes back to the child
+    assert(KV_pool_of(page) == child && KV_pool_of(child->data) == child);
+    KV_free_any(page);
+    assert(KV_malloc(child, 4000) == page);
+
+    // Everything still allocated in the child goes back in one step
+    char *block = child->data;
+    KV_subpool_free(child);
+    assert(KV_pool_of(block) == parent);
+    KV_pool_report(parent, &report);
+    assert(report.buddy_free_count == 1 && report.buddy_free_bytes == BUDDY_MAX_BLOCK_SIZE);
+
+    for (int i = 0; i < 1000; i++)
+    {
+        child = KV_subpool_init(parent, 1024);
+        assert(child != NULL && child->parent_block_size == BUDDY_MIN_BLOCK_SIZE); // Metadata shares the page
+        assert(KV_malloc(child, 40) != NULL);
+        KV_alloc_pool_free(child);
+    }
+    KV_pool_report(parent, &report);
+    assert(report.buddy_free_count == 1 && report.buddy_free_bytes == BUDDY_MAX_BLOCK_SIZE);
+    KV_alloc_pool_free(parent);
+}
+
+void test_KV_malloc_near()
+{
+    struct KV_alloc_pool *pool = KV_alloc_pool_init(8 * MIN_ALLOCATION_POOL_SIZE, false);
+    size_t counts[MAX_FREELIST_NUM_CLASSES] = {0};
+    size_t num_allocs = 3 * NEAR_HUGE_PAGE_SIZE / 48;
+    char **allocs = malloc(num_allocs * sizeof(char *));
+
+    for (size_t i = 0; i < num_allocs; i++)
+    {
+        allocs[i] = (char *)KV_malloc(pool, 40);
+    }
+    assert(allocs[0] == pool->data + ALLOCATION_SIZE_OVERHEAD); // The first page holds chunks 0 .. 84
+
+    // Ten chunks on the first page sit behind fifty at the far end of the pool
+    for (size_t i = 0; i < 10; i++)
+    {
+        KV_free(pool, allocs[i]);
+    }
+    for (size_t i = num_allocs - 50; i < num_allocs; i++)
+    {
+        KV_free(pool, allocs[i]);
+    }
+
+    char *near = (char *)KV_malloc_near(pool, 40, allocs[20]);
+    assert(near == allocs[9]);
+    assert(KV_malloc_near(pool, 40, allocs[9]) == allocs[8]);
+
+    // A hint with nothing free close by falls back to the head, as does one outside the pool
+    assert(KV_malloc_near(pool, 40, allocs[num_allocs / 2]) == allocs[num_allocs - 1]);
+    assert(KV_malloc_near(pool, 40, counts) == allocs[num_allocs - 2]);
+    assert(KV_malloc_near(pool, 40, NULL) == allocs[num_allocs - 3]);
+
+    // Unlinking from the middle keeps both lists intact
+    assert(KV_pool_walk(pool, count_free_chunks, counts) == 0);
+    assert(counts[4] == 8 + 47);
+    for (size_t i = 0; i < 8 + 47; i++)
+    {
+        assert(KV_malloc(pool, 40) != NULL);
+    }
+    assert(pool->alloc_freelist->freelist[4] == NULL);
+
+    // Class 0 chunks are singly linked; the second one is a page and more past the first
+    char *small[2];
+    small[0] = (char *)KV_malloc(pool, 8);
+    for (size_t i = 0; i < NEAR_PAGE_SIZE / 48 + 1; i++)
+    {
+        assert(KV_malloc(pool, 40) != NULL);
+    }
+    small[1] = (char *)KV_malloc(pool, 8);
+    assert(KV_malloc_near(pool, 8, allocs[0]) == small[1] + MIN_ALLOCATION_CLASS_SIZE); // Freelist empty, bump far away
+    KV_free(pool, small[1]);
+    KV_free(pool, small[0]);
+    assert(KV_malloc_near(pool, 8, small[1]) == small[1]);
+    memset(counts, 0, sizeof(counts));
+    assert(KV_pool_walk(pool, count_free_chunks, counts) == 0);
+    assert(counts[0] == 1);
+    assert(KV_malloc(pool, 8) == small[0]);
+
+    // With no free chunk close by, the bump region is used when it is on the hint's huge page
+    char *top = pool->data + pool->offset + ALLOCATION_SIZE_OVERHEAD;
+    KV_free(pool, allocs[30]);
+    assert(KV_malloc_near(pool, 40, top - 48) == top);
+    assert(KV_malloc(pool, 40) == allocs[30]);
+
+    KV_alloc_pool_free(pool);
+
+    // With an address map, chunks on the hint's page are found however deep in the freelist they are
+    pool = KV_alloc_pool_init_flags(8 * MIN_ALLOCATION_POOL_SIZE, false, ALLOC_POOL_NEAR);
+    assert(!pool->inline_fast_path);
+    for (size_t i = 0; i < num_allocs; i++)
+    {
+        allocs[i] = (char *)KV_malloc(pool, 40);
+    }
+    for (size_t i = 0; i < 10; i++)
+    {
+        KV_free(pool, allocs[i]);
+    }
+    for (size_t i = num_allocs - 2 * NEAR_SCAN_LIMIT; i < num_allocs; i++)
+    {
+        KV_free(pool, allocs[i]);
+    }
+
+    assert(KV_malloc_near(pool, 40, allocs[20]) == allocs[0]);
+    assert(KV_malloc_near(pool, 40, allocs[20]) == allocs[1]);
+    assert(KV_malloc(pool, 40) == allocs[num_allocs - 1]);
+    for (size_t i = 0; i < 8 + 2 * NEAR_SCAN_LIMIT - 1; i++)
+    {
+        assert(KV_malloc(pool, 40) != NULL);
+    }
+    assert(pool->alloc_freelist->freelist[4] == NULL && pool->alloc_freelist->count[4] == 0);
+    top = pool->data + pool->offset + ALLOCATION_SIZE_OVERHEAD;
+    assert(KV_malloc_near(pool, 40, allocs[20]) == top); // Nothing free is left on the map
+
+    free(allocs);
+    KV_alloc_pool_free(pool);
+}
+
+#if defined(__linux__)
+#define TEST_THREAD_ALLOC_NUM 500
+
+// pthreads rather than thrd_create: ThreadSanitizer does not intercept C11 thread creation
+static void *thread_bump_allocs(void *arg)
+{
+    struct KV_alloc_pool *pool = (struct KV_alloc_pool *)arg;
+    char *alloc[TEST_THREAD_ALLOC_NUM];
+
+    for (size_t i = 0; i < TEST_THREAD_ALLOC_NUM; i++)
+    {
+        alloc[i] = (char *)KV_malloc(pool, 40);
+        assert(alloc[i] != NULL);
+        memset(alloc[i], (int)pthread_self() & 0x7f, 40);
+    }
+
+    // Nobody else carved into our chunk
+    for (size_t i = 0; i < TEST_THREAD_ALLOC_NUM; i++)
+    {
+        assert(alloc[i][0] == ((int)pthread_self() & 0x7f) && alloc[i][39] == alloc[i][0]);
+        if (i > 0 && (alloc[i] - alloc[i - 1]) != 48)
+        {
+            assert(((alloc[i] - ALLOCATION_SIZE_OVERHEAD - pool->data) % THREAD_BUMP_CHUNK_SIZE) == 0); // Started a new chunk
+        }
+    }
+    return NULL;
+}
+
+void test_KV_thread_bump_chunks()
+{
+    struct KV_alloc_pool *pool = KV_alloc_pool_init(MIN_ALLOCATION_POOL_SIZE, true);
+    struct KV_pool_report report;
+    pthread_t threads[2];
+
+    for (size_t i = 0; i < 2; i++)
+    {
+        assert(pthread_create(&threads[i], NULL, thread_bump_allocs, pool) == 0);
+    }
+    for (size_t i = 0; i < 2; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+
+    // Unused tails were handed back or recycled into freelists when the threads exited
+    KV_pool_report(pool, &report);
+    assert(report.bump_used - report.free_bytes == 2 * TEST_THREAD_ALLOC_NUM * 48);
+
+    KV_alloc_pool_free(pool);
+}
+
+static void *thread_deferred_frees(void *arg)
+{
+    char **alloc = (char **)arg;
+    struct KV_alloc_pool *pool = KV_pool_of(alloc[0]);
+
+    for (size_t i = 0; i < TEST_THREAD_ALLOC_NUM; i++)
+    {
+        KV_free_deferred(pool, alloc[i]);
+    }
+    return NULL; // The partial batch is published when the thread exits
+}
+
+void test_KV_free_deferred_reclaimer()
+{
+    struct KV_alloc_pool *pool = KV_alloc_pool_init(MIN_ALLOCATION_POOL_SIZE * 4, true);
+    struct KV_pool_report report;
+    int thread_num = 4;
+    pthread_t threads[thread_num];
+    char **alloc = malloc(thread_num * TEST_THREAD_ALLOC_NUM * sizeof(char *));
+    size_t large_num = 0;
+
+    // Allocated up front: the workers only queue frees while the reclaimer drains
+    for (size_t i = 0; i < thread_num * TEST_THREAD_ALLOC_NUM; i++)
+    {
+        alloc[i] = (char *)KV_malloc(pool, i % 16 == 0 ? BUDDY_MAX_BLOCK_SIZE : 40);
+        large_num += i % 16 == 0;
+    }
+    KV_pool_report(pool, &report);
+    assert(report.num_large_allocs == large_num);
+
+    assert(KV_pool_start_reclaimer(pool) == 0);
+    for (size_t i = 0; i < thread_num; i++)
+    {
+        pthread_create(&threads[i], NULL, thread_deferred_frees, &alloc[i * TEST_THREAD_ALLOC_NUM]);
+    }
+    for (size_t i = 0; i < thread_num; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+
+    for (int i = 0; i < 1000 && __atomic_load_n(&pool->deferred, __ATOMIC_ACQUIRE) != NULL; i++)
+    {
+        usleep(1000);
+    }
+    assert(__atomic_load_n(&pool->deferred, __ATOMIC_ACQUIRE) == NULL);
+
+    KV_pool_stop_reclaimer(pool);
+    KV_pool_report(pool, &report);
+    assert(report.num_large_allocs == 0);
+    assert(report.classes[4].free_count == thread_num * TEST_THREAD_ALLOC_NUM - large_num);
+
+    free(alloc);
+    KV_alloc_pool_free(pool);
+}
+
+static int parked_state = 0; // 1 once the free is queued, 2 when told to exit
+
+static void *thread_deferred_large_park(void *arg)
+{
+    void **args = (void **)arg;
+
+    KV_free_deferred((struct KV_alloc_pool *)args[0], args[1]);
+    __atomic_store_n(&parked_state, 1, __ATOMIC_RELEASE);
+    while (__atomic_load_n(&parked_state, __ATOMIC_ACQUIRE) != 2)
+    {
+        usleep(100);
+    }
+    return NULL;
+}
+
+// One large free queued by a thread that then goes idle is still unmapped by the reclaimer
+void test_KV_free_deferred_idle_thread()
+{
+    struct KV_alloc_pool *pool = KV_alloc_pool_init(MIN_ALLOCATION_POOL_SIZE, true);
+    struct KV_pool_report report;
+    pthread_t thread;
+    void *args[2] = {pool, KV_malloc(pool, BUDDY_MAX_BLOCK_SIZE)};
+
+    KV_pool_report(pool, &report);
+    assert(report.num_large_allocs == 1);
+
+    assert(KV_pool_start_reclaimer(pool) == 0);
+    pthread_create(&thread, NULL, thread_deferred_large_park, args);
+    while (__atomic_load_n(&parked_state, __ATOMIC_ACQUIRE) != 1)
+    {
+        usleep(100);
+    }
+
+    for (int i = 0; i < 1000 && __atomic_load_n(&pool->num_large_allocs, __ATOMIC_ACQUIRE) != 0; i++)
+    {
+        usleep(1000);
+    }
+    assert(__atomic_load_n(&pool->num_large_allocs, __ATOMIC_ACQUIRE) == 0);
+
+    __atomic_store_n(&parked_state, 2, __ATOMIC_RELEASE);
+    pthread_join(thread, NULL);
+    KV_pool_stop_reclaimer(pool);
+    KV_alloc_pool_free(pool);
+}
+
+static int reader_state = 0; // 1 once inside the section, 2 when told to leave
+
+static void *thread_epoch_reader(void *arg)
+{
+    struct KV_alloc_pool *pool = (struct KV_alloc_pool *)arg;
+
+    KV_epoch_enter(pool);
+    __atomic_store_n(&reader_state, 1, __ATOMIC_RELEASE);
+    while (__atomic_load_n(&reader_state, __ATOMIC_ACQUIRE) != 2)
+    {
+        usleep(100);
+    }
+    KV_epoch_exit(pool);
+    return NULL;
+}
+
+void test_KV_epoch_retire()
+{
+    struct KV_alloc_pool *pool = KV_alloc_pool_init(MIN_ALLOCATION_POOL_SIZE, true);
+    struct KV_pool_report report;
+    pthread_t reader;
+
+    // Nested sections on this thread hold the epoch until the outermost exit
+    char *alloc = (char *)KV_malloc(pool, 40);
+    KV_epoch_enter(pool);
+    KV_epoch_enter(pool);
+    KV_retire(pool, alloc);
+    KV_epoch_exit(pool);
+    for (int i = 0; i < 4; i++)
+    {
+        assert(KV_epoch_reclaim(pool) == 0);
+    }
+    KV_epoch_exit(pool);
+    assert(KV_epoch_reclaim(pool) == 1);
+    assert(get_freelist_item(pool, 4) == alloc - ALLOCATION_SIZE_OVERHEAD);
+
+    // A reader on another thread keeps everything retired after it entered
+    alloc = (char *)KV_malloc(pool, 40);
+    char *large = (char *)KV_malloc(pool, BUDDY_MAX_BLOCK_SIZE);
+    pthread_create(&reader, NULL, thread_epoch_reader, pool);
+    while (__atomic_load_n(&reader_state, __ATOMIC_ACQUIRE) != 1)
+    {
+        usleep(100);
+    }
+
+    KV_retire(pool, alloc);
+    KV_retire(pool, large);
+    for (int i = 0; i < 4; i++)
+    {
+        assert(KV_epoch_reclaim(pool) == 0);
+    }
+    KV_pool_report(pool, &report);
+    assert(report.classes[4].free_count == 0 && report.num_large_allocs == 1);
+
+    __atomic_store_n(&reader_state, 2, __ATOMIC_RELEASE);
+    pthread_join(reader, NULL);
+
+    size_t num_freed = 0;
+    for (int i = 0; i < 4; i++)
+    {
+        num_freed += KV_epoch_reclaim(pool);
+    }
+    assert(num_freed == 2);
+    KV_pool_report(pool, &report);
+    assert(report.classes[4].free_count == 1 && report.num_large_allocs == 0);
+
+    // Batches are collected on their own once enough retires pile up
+    char *batch[4 * EPOCH_RETIRE_SCAN_INTERVAL];
+    for (int i = 0; i < 4 * EPOCH_RETIRE_SCAN_INTERVAL; i++)
+    {
+        batch[i] = (char *)KV_malloc(pool, 40);
+    }
+    for (int i = 0; i < 4 * EPOCH_RETIRE_SCAN_INTERVAL; i++)
+    {
+        KV_retire(pool, batch[i]);
+    }
+    KV_pool_report(pool, &report);
+    assert(report.classes[4].free_count >= 2 * EPOCH_RETIRE_SCAN_INTERVAL);
+
+    KV_alloc_pool_free(pool);
+}
+
+void test_KV_pool_latency()
+{
+    struct KV_alloc_pool *pool = KV_alloc_pool_init_flags(MIN_ALLOCATION_POOL_SIZE, true, ALLOC_POOL_LATENCY);
+    struct KV_pool_report report;
+
+    for (int i = 0; i < 4; i++)
+    {
+        KV_free(pool, KV_malloc(pool, BUDDY_MAX_BLOCK_SIZE));
+        KV_free(pool, KV_malloc(pool, 40));
+    }
+
+    KV_pool_report(pool, &report);
+    assert(report.latency[LATENCY_MMAP].count == 4);
+    assert(report.latency[LATENCY_MUNMAP].count == 4);
+    assert(report.latency[LATENCY_LOCK_WAIT].count == 0); // Nobody else holds the class locks
+
+    uint64_t bucket_total = 0;
+    for (int i = 0; i < LATENCY_HIST_BUCKETS; i++)
+    {
+        bucket_total += report.latency[LATENCY_MMAP].buckets[i];
+    }
+    assert(bucket_total == 4);
+    assert(report.latency[LATENCY_MMAP].max_ns <= report.latency[LATENCY_MMAP].total_ns);
+    KV_alloc_pool_free(pool);
+
+    // Off by default
+    pool = KV_alloc_pool_init(MIN_ALLOCATION_POOL_SIZE, true);
+    KV_free(pool, KV_malloc(pool, BUDDY_MAX_BLOCK_SIZE));
+    KV_pool_report(pool, &report);
+    assert(report.latency[LATENCY_MMAP].count == 0);
+    KV_alloc_pool_free(pool);
+}
+
+static size_t resident_pages(char *start, size_t size)
+{
+    size_t page_num = size / 4096, resident = 0;
+    unsigned char *vec = malloc(page_num);
+
+    assert(mincore(start, size, vec) == 0);
+    for (size_t i = 0; i < page_num; i++)
+    {
+        resident += vec[i] & 1;
+    }
+    free(vec);
+    return resident;
+}
+
+void test_KV_pool_prefault()
+{
+    size_t size = MIN_ALLOCATION_POOL_SIZE * 8;
+    struct KV_alloc_pool *pool = KV_alloc_pool_init_flags(size, true, ALLOC_POOL_PREFAULT);
+    assert(resident_pages(pool->data, size) == size / 4096);
+    KV_alloc_pool_free(pool);
+
+    pool = KV_alloc_pool_init(size, true);
+    assert(resident_pages(pool->data, size) == 0);
+    KV_alloc_pool_free(pool);
+
+    // The background thread stays PREFAULT_AHEAD_SIZE ahead of the bump offset
+    pool = KV_alloc_pool_init_flags(size, true, ALLOC_POOL_PREFAULT_AHEAD);
+    for (size_t i = 0; i < 1000; i++)
+    {
+        KV_malloc(pool, 200);
+    }
+
+    size_t ahead = PREFAULT_AHEAD_SIZE / 4096;
+    for (int i = 0; i < 1000 && resident_pages(pool->data, size) < ahead; i++)
+    {
+        usleep(1000);
+    }
+    assert(resident_pages(pool->data, size) >= ahead);
+    assert(resident_pages(pool->data, size) < size / 4096);
+    KV_alloc_pool_free(pool);
+}
+
+#if defined(TEST_HAVE_IO_URING)
+// Just enough of a ring to submit one request and wait for it
+struct test_ring
+{
+    int fd;
+    unsigned *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+};
+
+static int test_ring_init(struct test_ring *ring)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring->fd = syscall(__NR_io_uring_setup, 4, &params);
+    if (ring->fd < 0)
+    {
+        return -1;
+    }
+
+    char *sq = mmap(NULL, params.sq_off.array + params.sq_entries * sizeof(unsigned), PROT_READ | PROT_WRITE, MAP_SHARED, ring->fd, IORING_OFF_SQ_RING);
+    char *cq = mmap(NULL, params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe), PROT_READ | PROT_WRITE, MAP_SHARED, ring->fd, IORING_OFF_CQ_RING);
+    ring->sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED, ring->fd, IORING_OFF_SQES);
+    assert(sq != MAP_FAILED && cq != MAP_FAILED && ring->sqes != MAP_FAILED);
+
+    ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+    ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    return 0;
+}
+
+static int test_ring_rw_fixed(struct test_ring *ring, int opcode, int fd, char *buf, unsigned len, uint64_t offset, int index)
+{
+    unsigned tail = *ring->sq_tail;
+    unsigned slot = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[slot];
+
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t)buf;
+    sqe->len = len;
+    sqe->off = offset;
+    sqe->buf_index = index;
+    ring->sq_array[slot] = slot;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    if (syscall(__NR_io_uring_enter, ring->fd, 1, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0)
+    {
+        return -1;
+    }
+
+    unsigned head = *ring->cq_head;
+    assert(__atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE) != head);
+    int res = ring->cqes[head & *ring->cq_mask].res;
+    __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+    return res;
+}
+#endif
+
+void test_KV_io_pool()
+{
+    struct KV_alloc_pool *pool = KV_io_pool_init(4000, 8, -1, false);
+    char *bufs[8];
+
+    assert(KV_io_pool_init(4096, IO_MAX_BUFFERS + 1, -1, false) == NULL);
+
+    // Rounded up to whole pages and handed out in address order
+    for (int i = 0; i < 8; i++)
+    {
+        bufs[i] = (char *)KV_malloc(pool, 4000);
+        assert(bufs[i] != NULL && ((uintptr_t)bufs[i] % IO_BUFFER_ALIGN) == 0);
+        assert(KV_io_buffer_index(pool, bufs[i]) == i && KV_io_buffer(pool, i) == bufs[i]);
+        memset(bufs[i], i, IO_BUFFER_ALIGN);
+    }
+    assert(KV_malloc(pool, 1) == NULL);
+    assert(KV_io_buffer_index(pool, bufs[1] + 1) == -1);
+    assert(KV_io_buffer(pool, 8) == NULL);
+
+    KV_free(pool, bufs[5]);
+    KV_free_inline(pool, bufs[0]);
+    assert(KV_malloc(pool, IO_BUFFER_ALIGN) == bufs[0]);
+    assert(KV_malloc(pool, IO_BUFFER_ALIGN + 1) == NULL);
+    assert(KV_malloc(pool, 64) == bufs[5]);
+    KV_free_any(bufs[5]);
+    assert(KV_malloc(pool, 64) == bufs[5]);
+
+    // A second free is dropped, so the buffer is not handed out twice
+    KV_free(pool, bufs[3]);
+    KV_free(pool, bufs[3]);
+    assert(pool->io_num_free == 1);
+    assert(KV_malloc(pool, 64) == bufs[3]);
+    assert(KV_malloc(pool, 64) == NULL);
+
+    // Buffers have no header: deferred frees go straight back, handles and retirement are refused
+    KV_free_deferred(pool, bufs[0]);
+    assert(pool->io_num_free == 1);
+    assert(KV_malloc_handle(pool, 64) == KV_HANDLE_NULL && pool->io_num_free == 1);
+    assert(KV_malloc(pool, 64) == bufs[0]);
+    KV_retire(pool, bufs[0]);
+    assert(pool->io_num_free == 0);
+
+    for (int i = 0; i < 8; i++)
+    {
+        KV_free(pool, bufs[i]);
+    }
+    KV_alloc_pool_free(pool);
+
+#if defined(TEST_HAVE_IO_URING)
+    struct test_ring ring;
+    if (test_ring_init(&ring) == -1)
+    {
+        return; // io_uring is disabled here; nothing more to check
+    }
+
+    // Registered once; a recycled buffer keeps its fixed-buffer index
+    pool = KV_io_pool_init(4096, 4, ring.fd, true);
+    assert(pool != NULL);
+
+    char path[] = "/tmp/test_KV_io_pool_XXXXXX";
+    int fd = mkstemp(path);
+    assert(fd != -1);
+    unlink(path);
+
+    char *buf = (char *)KV_malloc(pool, 4096);
+    int index = KV_io_buffer_index(pool, buf);
+    memset(buf, 'a', 4096);
+    assert(test_ring_rw_fixed(&ring, IORING_OP_WRITE_FIXED, fd, buf, 4096, 0, index) == 4096);
+    KV_free(pool, buf);
+
+    buf = (char *)KV_malloc(pool, 4096);
+    assert(KV_io_buffer_index(pool, buf) == index);
+    memset(buf, 'b', 4096);
+    assert(test_ring_rw_fixed(&ring, IORING_OP_WRITE_FIXED, fd, buf, 4096, 4096, index) == 4096);
+
+    memset(buf, 0, 4096);
+    assert(test_ring_rw_fixed(&ring, IORING_OP_READ_FIXED, fd, buf, 4096, 0, index) == 4096);
+    assert(buf[0] == 'a' && buf[4095] == 'a');
+
+    char check[4096];
+    assert(pread(fd, check, sizeof(check), 4096) == sizeof(check));
+    assert(check[0] == 'b' && check[4095] == 'b');
+
+    // The kernel rejects a buffer outside the registered one
+    char *other = (char *)KV_io_buffer(pool, index + 1);
+    assert(test_ring_rw_fixed(&ring, IORING_OP_WRITE_FIXED, fd, other, 4096, 0, index) < 0);
+
+    KV_free(pool, buf);
+    close(fd);
+    KV_alloc_pool_free(pool);
+    close(ring.fd);
+#endif
+}
+
+void test_KV_alloc_pool_open()
+{
+    char path[] = "/tmp/test_alloc_pool.XXXXXX";
+    int fd = mkstemp(path);
+    assert(fd != -1);
+    close(fd);
+
+    struct KV_alloc_pool *pool = KV_alloc_pool_open(path, MIN_ALLOCATION_POOL_SIZE, false);
+    assert(pool != NULL);
+    assert(pool->size == MIN_ALLOCATION_POOL_SIZE);
+
+    char *alloc = (char *)KV_malloc(pool, 40);
+    char *alloc2 = (char *)KV_malloc(pool, 40);
+    char *alloc3 = (char *)KV_malloc(pool, 40);
+    strcpy(alloc, "persisted");
+    KV_pool_set_root(pool, alloc);
+    KV_free(pool, alloc2);
+    KV_free(pool, alloc3);
+
+    size_t root_offset = alloc - pool->data;
+    size_t alloc2_offset = alloc2 - pool->data;
+    size_t alloc3_offset = alloc3 - pool->data;
+    uint64_t offset = pool->header->offset;
+    KV_alloc_pool_free(pool);
+
+    pool = KV_alloc_pool_open(path, 0, false); // Size comes from the existing image
+    assert(pool != NULL);
+    assert(pool->size == MIN_ALLOCATION_POOL_SIZE);
+    assert(pool->header->offset == offset);
+
+    char *root = (char *)KV_pool_get_root(pool);
+    assert(root - pool->data == root_offset);
+    assert(strcmp(root, "persisted") == 0);
+
+    // Freelist chain is intact regardless of where the file got mapped this time
+    assert((char *)KV_malloc(pool, 40) - pool->data == alloc3_offset);
+    assert((char *)KV_malloc(pool, 40) - pool->data == alloc2_offset);
+    assert(get_freelist_item(pool, 4) == NULL);
+
+    // An image written by a build whose libc locks have another size is refused
+    pool->header->lock_size += 1;
+    KV_alloc_pool_free(pool);
+    assert(KV_alloc_pool_open(path, 0, false) == NULL);
+    unlink(path);
+}
+
+// A concurrent file pool carves exactly what is asked for, so reopening it leaks nothing
+void test_KV_alloc_pool_open_concurrent()
+{
+    char path[] = "/tmp/test_alloc_open.XXXXXX";
+    int fd = mkstemp(path);
+    assert(fd != -1);
+    close(fd);
+
+    for (uint64_t i = 1; i <= 3; i++)
+    {
+        struct KV_alloc_pool *pool = KV_alloc_pool_open(path, MIN_ALLOCATION_POOL_SIZE, true);
+        assert(pool != NULL);
+        assert(KV_malloc(pool, 40) != NULL);
+        assert(pool->header->offset == i * 48);
+        KV_alloc_pool_free(pool);
+    }
+    unlink(path);
+}
+
+void test_KV_alloc_pool_shm_open()
+{
+    char name[64];
+    snprintf(name, sizeof(name), "/test_alloc_pool.%d", (int)getpid());
+    int alloc_num = 100;
+
+    struct KV_alloc_pool *pool = KV_alloc_pool_shm_open(name, MIN_ALLOCATION_POOL_SIZE);
+    assert(pool != NULL);
+    assert(pool->process_shared);
+
+    char *alloc = (char *)KV_malloc(pool, 40);
+    assert(alloc != NULL);
+
+    pid_t pid = fork();
+    assert(pid != -1);
+    if (pid == 0)
+    {
+        // Mapped at a different address than the parent's mapping
+        struct KV_alloc_pool *child_pool = KV_alloc_pool_shm_open(name, 0);
+        char *child_alloc[alloc_num];
+        if (child_pool == NULL || child_pool->size != MIN_ALLOCATION_POOL_SIZE)
+        {
+            _exit(1);
+        }
+
+        for (size_t i = 0; i < alloc_num; i++)
+        {
+            child_alloc[i] = (char *)KV_malloc(child_pool, 40);
+            snprintf(child_alloc[i], 40, "child %zu", i);
+        }
+
+        for (size_t i = 0; i < alloc_num - 1; i++)
+        {
+            KV_free(child_pool, child_alloc[i]);
+        }
+        KV_pool_set_root(child_pool, child_alloc[alloc_num - 1]);
+        KV_alloc_pool_free(child_pool);
+        _exit(0);
+    }
+
+    int status;
+    assert(waitpid(pid, &status, 0) == pid);
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+    char *root = (char *)KV_pool_get_root(pool);
+    assert(root != NULL && root != alloc);
+    assert(strcmp(root, "child 99") == 0);
+    assert(pool->header->offset == (alloc_num + 1) * 48);
+
+    // Chunks freed by the child come back out of the shared freelist
+    for (size_t i = 0; i < alloc_num - 1; i++)
+    {
+        char *reuse = (char *)KV_malloc(pool, 40);
+        assert(reuse > alloc && reuse < root);
+    }
+    assert(get_freelist_item(pool, 4) == NULL);
+
+    KV_alloc_pool_free(pool);
+    assert(KV_alloc_pool_shm_unlink(name) == 0);
+}
+
+void test_KV_alloc_pool_fork_snapshot()
+{
+    struct KV_alloc_pool *pool = KV_alloc_pool_init_flags(MIN_ALLOCATION_POOL_SIZE, true, ALLOC_POOL_PRIVATE);
+    struct KV_object_pool *opool = KV_object_pool_init(pool, 32, 8);
+    int ready[2];
+    char buf = 0;
+
+    char *alloc = (char *)KV_malloc(pool, 40);
+    char *large = (char *)KV_malloc(pool, 8192);
+    strcpy(alloc, "before");
+    strcpy(large, "before");
+    assert(pipe(ready) == 0);
+
+    pid_t pid = fork();
+    assert(pid != -1);
+    if (pid == 0)
+    {
+        // Wait for the parent to scribble over its copy, then check ours is the fork-time image
+        if (read(ready[0], &buf, 1) != 1 || strcmp(alloc, "before") != 0 || strcmp(large, "before") != 0)
+        {
+            _exit(1);
+        }
+
+        // Locks were reinitialised for this process
+        char *child_alloc = (char *)KV_malloc(pool, 40);
+        char *obj = (char *)KV_object_alloc(opool);
+        if (child_alloc == NULL || obj == NULL)
+        {
+            _exit(1);
+        }
+        KV_free(pool, child_alloc);
+        KV_object_free(opool, obj);
+        _exit(0);
+    }
+
+    strcpy(alloc, "after");
+    strcpy(large, "after");
+    assert(write(ready[1], &buf, 1) == 1);
+
+    int status;
+    assert(waitpid(pid, &status, 0) == pid);
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    assert(strcmp(alloc, "after") == 0);
+
+    close(ready[0]);
+    close(ready[1]);
+    KV_free(pool, alloc);
+    KV_free(pool, large);
+    KV_object_pool_free(opool);
+    KV_alloc_pool_free(pool);
+}
+
+// File pools are left out of the fork handlers; the child uses its private pools and the parent's image is untouched
+void test_KV_alloc_pool_fork_file()
+{
+    char path[] = "/tmp/test_alloc_fork.XXXXXX";
+    int fd = mkstemp(path);
+    assert(fd != -1);
+    close(fd);
+
+    struct KV_alloc_pool *file_pool = KV_alloc_pool_open(path, MIN_ALLOCATION_POOL_SIZE, true);
+    struct KV_alloc_pool *pool = KV_alloc_pool_init_flags(MIN_ALLOCATION_POOL_SIZE, true, ALLOC_POOL_PRIVATE);
+    assert(file_pool != NULL && pool != NULL);
+
+    char *alloc = (char *)KV_malloc(file_pool, 40);
+    char *freed = (char *)KV_malloc(file_pool, 40);
+    KV_free(file_pool, freed);
+    uint64_t offset = file_pool->header->offset;
+
+    pid_t pid = fork();
+    assert(pid != -1);
+    if (pid == 0)
+    {
+        char *child_alloc = (char *)KV_malloc(pool, 40);
+        _exit(child_alloc != NULL && file_pool->header->offset == offset ? 0 : 1);
+    }
+
+    int status;
+    assert(waitpid(pid, &status, 0) == pid);
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+    assert(file_pool->header->offset == offset);
+    assert(KV_malloc(file_pool, 40) == freed);
+    KV_free(file_pool, freed);
+    KV_free(file_pool, alloc);
+    KV_alloc_pool_free(file_pool);
+    KV_alloc_pool_free(pool);
+    unlink(path);
+}
+
+void test_KV_alloc_ctl()
+{
+    struct KV_alloc_pool *pool = KV_alloc_pool_init(MIN_ALLOCATION_POOL_SIZE * 4, true);
+    struct KV_pool_report report;
+    char name[ALLOC_CTL_NAME_MAX];
+    uint64_t value, num_pools;
+    int flags;
+    bool on;
+
+    assert(KV_alloc_ctl("opt.no_such_option", &value, NULL) == -1);
+    assert(KV_alloc_ctl("stats.pools", &num_pools, NULL) == 0 && num_pools >= 1);
+    assert(KV_alloc_ctl("stats.pools", NULL, &num_pools) == -1);
+
+    assert(KV_alloc_ctl("opt.reclaim_interval_ns", &value, NULL) == 0 && value == DEFERRED_RECLAIM_INTERVAL_NS);
+    value = 0;
+    assert(KV_alloc_ctl("opt.reclaim_interval_ns", NULL, &value) == -1);
+
+    // Pools created while opt.pool_flags is set get its flags
+    flags = ALLOC_POOL_LATENCY;
+    assert(KV_alloc_ctl("opt.pool_flags", NULL, &flags) == 0);
+    struct KV_alloc_pool *timed = KV_alloc_pool_init(MIN_ALLOCATION_POOL_SIZE, true);
+    flags = 0;
+    int old_flags = 0;
+    assert(KV_alloc_ctl("opt.pool_flags", &old_flags, &flags) == 0 && old_flags == ALLOC_POOL_LATENCY);
+    assert(timed->latency != NULL && (timed->flags & ALLOC_POOL_LATENCY));
+    KV_alloc_pool_free(timed);
+
+    snprintf(name, sizeof(name), "pool.%llu.nothing", (unsigned long long)pool->id);
+    assert(KV_alloc_ctl(name, &value, NULL) == -1);
+    assert(KV_alloc_ctl("pool.0.usage", &value, NULL) == -1);
+
+    // Budgets and usage
+    snprintf(name, sizeof(name), "pool.%llu.budget.hard", (unsigned long long)pool->id);
+    value = 16 << 20;
+    assert(KV_alloc_ctl(name, NULL, &value) == 0);
+    snprintf(name, sizeof(name), "pool.%llu.budget.soft", (unsigned long long)pool->id);
+    value = 32 << 20;
+    assert(KV_alloc_ctl(name, NULL, &value) == -1); // Above the hard limit
+    value = 8 << 20;
+    assert(KV_alloc_ctl(name, NULL, &value) == 0);
+    assert(KV_alloc_ctl(name, &value, NULL) == 0 && value == 8 << 20 && pool->budget_soft == value);
+
+    char *alloc = (char *)KV_malloc(pool, 40);
+    snprintf(name, sizeof(name), "pool.%llu.usage", (unsigned long long)pool->id);
+    assert(KV_alloc_ctl(name, &value, NULL) == 0 && value == KV_pool_usage(pool));
+
+    // The thread's bump chunk goes back to the offset on a flush
+    KV_pool_report(pool, &report);
+    assert(report.bump_used == THREAD_BUMP_CHUNK_SIZE);
+    assert(KV_alloc_ctl("thread.flush", NULL, NULL) == 0);
+    snprintf(name, sizeof(name), "pool.%llu.report", (unsigned long long)pool->id);
+    assert(KV_alloc_ctl(name, &report, NULL) == 0);
+    assert(report.bump_used == 48);
+    KV_free(pool, alloc);
+
+    // Timing can be switched on and off; the histograms stay readable
+    snprintf(name, sizeof(name), "pool.%llu.latency", (unsigned long long)pool->id);
+    assert(KV_alloc_ctl(name, &on, NULL) == 0 && !on);
+    on = true;
+    assert(KV_alloc_ctl(name, NULL, &on) == 0);
+    KV_free(pool, KV_malloc(pool, BUDDY_MAX_BLOCK_SIZE));
+    on = false;
+    assert(KV_alloc_ctl(name, &on, &on) == 0 && on); // Old value out, new one in
+    KV_free(pool, KV_malloc(pool, BUDDY_MAX_BLOCK_SIZE));
+    KV_pool_report(pool, &report);
+    assert(report.latency[LATENCY_MMAP].count == 1 && report.latency[LATENCY_MUNMAP].count == 1);
+
+    // Purging hands back all but the first page of each free buddy block
+    KV_free(pool, KV_malloc(pool, 60000));
+    snprintf(name, sizeof(name), "pool.%llu.purge", (unsigned long long)pool->id);
+    assert(KV_alloc_ctl(name, &value, NULL) == 0);
+    KV_pool_report(pool, &report);
+    assert(report.buddy_free_bytes > 0 && value == report.buddy_free_bytes - report.buddy_free_count * BUDDY_MIN_BLOCK_SIZE);
+    memset(KV_malloc(pool, 60000), 1, 60000);
+
+    snprintf(name, sizeof(name), "pool.%llu.reclaimer", (unsigned long long)pool->id);
+    on = true;
+    assert(KV_alloc_ctl(name, NULL, &on) == 0 && pool->background_running);
+    on = false;
+    assert(KV_alloc_ctl(name, NULL, &on) == 0 && !pool->background_running);
+
+    KV_alloc_pool_free(pool);
+}
+#endif
+
+int main(int argc, char *argv[])
+{
+    test_KV_alloc_pool_init();
+    test_KV_malloc();
+    test_KV_free();
+    test_KV_freelist_class_linked_list();
+    test_alloc_class();
+    test_min_ensure_pointer_links_allocd();
+    test_multiple_pool_allocs_stats();
+    test_KV_object_pool();
+    test_KV_pool_report();
+    test_KV_percpu_freelists();
+    test_KV_free_any();
+    test_KV_free_deferred();
+    test_KV_inline_fast_path();
+    test_KV_handles();
+    test_KV_pool_reserve();
+    test_KV_pool_budget();
+    test_KV_buddy_tier();
+    test_KV_pool_compact();
+    test_KV_pool_compact_tagged();
+    test_KV_malloc_tagged();
+    test_KV_subpool();
+    test_KV_malloc_near();
+#if defined(__linux__)
+    test_KV_thread_bump_chunks();
+    test_KV_free_deferred_reclaimer();
+    test_KV_free_deferred_idle_thread();
+    test_KV_epoch_retire();
+    test_KV_pool_latency();
+    test_KV_pool_prefault();
+    test_KV_io_pool();
+    test_KV_alloc_pool_open();
+    test_KV_alloc_pool_open_concurrent();
+    test_KV_alloc_pool_shm_open();
+    test_KV_alloc_pool_fork_snapshot();
+    test_KV_alloc_pool_fork_file();
+    test_KV_alloc_ctl();
+#endif
     return 0;
 }